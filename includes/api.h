@@ -24,8 +24,63 @@
 
 namespace Tako {
 
+    // Capture, desktop and stats calls may be made from any thread and are serialized with each other and with
+    // the stream server and region watches, which capture on threads of their own. Background captures neither
+    // consume the frames nor invalidate the views returned to the caller. Initialize, Shutdown and the Start/Stop
+    // functions must not race with other calls.
     TAKO_API TakoError Initialize();
     TAKO_API TakoError Shutdown();
 
-    TAKO_API TakoError CaptureIntoBuffer(HANDLE bufferHandle, TakoRect targetRect);
+    // The best CPU level is picked in Initialize(). Forcing a lower level is meant for testing and benchmarking.
+    TAKO_API TakoError SetCpuLevel(TakoCpuLevel level);
+    TAKO_API TakoCpuLevel GetCpuLevel();
+
+    // Recreates the CPU worker pool. numWorkers excludes the calling thread; an empty affinityMask leaves
+    // placement to the OS, otherwise workers are pinned to its set bits in order. Fails with EXPECTED_ERROR
+    // while the stream server or the replay buffer runs, and must not race with the view conversion functions.
+    TAKO_API TakoError ConfigureThreadPool(uint32_t numWorkers, uint64_t affinityMask);
+    TAKO_API TakoError GetStats(TakoStats* outStats);
+
+    // Redactions are applied to the composited frame before it is written to the destination
+    TAKO_API TakoError CaptureIntoBuffer(HANDLE bufferHandle, TakoRect targetRect,
+        const TakoRedaction* redactions = nullptr, uint32_t numRedactions = 0);
+    TAKO_API TakoError CaptureIntoMemory(void* buffer, uint32_t pitch, DXGI_FORMAT format, TakoRect targetRect,
+        const TakoRedaction* redactions = nullptr, uint32_t numRedactions = 0);
+
+    // Captures targetRect and returns one CPU view per overlapped display, cropped to targetRect without copying.
+    // The views remain valid until the next capture through this API.
+    TAKO_API TakoError CaptureIntoViews(TakoRect targetRect, TakoFrameView* outViews, uint32_t* outNumViews);
+    TAKO_API TakoError CopyViewIntoBuffer(const TakoFrameView& view, void* buffer, uint32_t pitch);
+
+    // Captures every display into a tiled framebuffer that only holds memory where displays are, however sparse
+    // the desktop layout. Reports what changed since the previous successful call; the first one reports every display.
+    // If more than maxDirtyRects changed, the changed displays are reported whole, so pass at least MaxNumDisplays.
+    TAKO_API TakoError CaptureDesktop(TakoRect* outDirtyRects, uint32_t maxDirtyRects, uint32_t* outNumDirtyRects);
+    // Reads part of the last CaptureDesktop result. Areas outside every display read as opaque black.
+    TAKO_API TakoError ReadDesktop(TakoRect rect, void* buffer, uint32_t pitch, DXGI_FORMAT format);
+    TAKO_API TakoError GetDesktopRect(TakoRect* outRect);
+    // Serves captures to local subscribers over the named pipe pipeName (e.g. L"\\\\.\\pipe\\tako").
+    // Only local clients running as the same user can connect. See TakoStreamRequest and TakoStreamFrameHeader
+    // for the protocol, and samples/streamclient.cpp for a subscriber.
+    TAKO_API TakoError StartStreamServer(const wchar_t* pipeName);
+    TAKO_API TakoError StopStreamServer();
+
+    // Keeps the last captures of region in memory within budgetBytes, for saving after the fact. Whenever one of
+    // the Capture functions runs, region is captured alongside it if anything changed there, whatever rect the
+    // caller asked for. The redactions given here apply to every recorded frame; those passed to a Capture
+    // function only apply to its own result. GetStats reports the span currently held and the span the budget
+    // holds at the current data rate.
+    TAKO_API TakoError StartReplayBuffer(TakoRect region, uint64_t budgetBytes,
+        const TakoRedaction* redactions = nullptr, uint32_t numRedactions = 0);
+    TAKO_API TakoError StopReplayBuffer();
+    // Writes the buffered frames to path in the background, as a sequence of stream frames starting with a keyframe
+    TAKO_API TakoError SaveReplay(const wchar_t* path);
+
+    // Watches rect for changes affecting more than threshold (0 to 1) of its pixels, compared with its content when
+    // first captured or when the watch last fired. callback runs on a background thread and event is set with
+    // SetEvent; either may be null. Watches are captured from a background thread while any exist.
+    TAKO_API TakoError AddRegionWatch(TakoRect rect, float threshold, TakoWatchCallback callback, void* userData, HANDLE event, uint32_t* outWatchId);
+    TAKO_API TakoError RemoveRegionWatch(uint32_t watchId);
+
+    TAKO_API TakoError ConvertViewIntoBuffer(const TakoFrameView& view, DXGI_FORMAT format, void* buffer, uint32_t pitch);
 }
@@ -28,6 +28,7 @@
 #include <DirectXMath.h>
 #include <vector>
 #include <cstdint>
+#include <algorithm>
 
 #include <wrl.h>
 namespace wrl = Microsoft::WRL;
@@ -39,6 +40,8 @@ namespace wrl = Microsoft::WRL;
 #endif
 
 static constexpr uint32_t MaxNumDisplays = 8;
+static constexpr uint32_t MaxNumWorkers = 64;
+static constexpr uint32_t MaxRedactionStrength = 4096;
 
 namespace Tako
 {
@@ -49,11 +52,46 @@ namespace Tako
         uint32_t m_Width;
         uint32_t m_Height;
 
-        bool operator==(const TakoRect& other)
+        bool operator==(const TakoRect& other) const
         {
             return other.m_X == m_X && other.m_Y == m_Y &&
                 other.m_Width == m_Width && other.m_Height == m_Height;
         }
+
+        inline bool IsEmpty() const { return m_Width == 0 || m_Height == 0; }
+
+        // Returns the overlapping area of both rects, or an empty rect if they do not overlap
+        inline TakoRect Intersect(const TakoRect& other) const
+        {
+            int64_t left = std::max<int64_t>(m_X, other.m_X);
+            int64_t top = std::max<int64_t>(m_Y, other.m_Y);
+            int64_t right = std::min<int64_t>(int64_t(m_X) + m_Width, int64_t(other.m_X) + other.m_Width);
+            int64_t bottom = std::min<int64_t>(int64_t(m_Y) + m_Height, int64_t(other.m_Y) + other.m_Height);
+
+            if (right <= left || bottom <= top)
+                return { static_cast<int32_t>(left), static_cast<int32_t>(top), 0, 0 };
+
+            return { static_cast<int32_t>(left), static_cast<int32_t>(top),
+                static_cast<uint32_t>(right - left), static_cast<uint32_t>(bottom - top) };
+        }
+
+        // Returns the smallest rect containing both rects, empty rects are ignored
+        inline TakoRect Union(const TakoRect& other) const
+        {
+            if (IsEmpty())
+                return other;
+
+            if (other.IsEmpty())
+                return *this;
+
+            int64_t left = std::min<int64_t>(m_X, other.m_X);
+            int64_t top = std::min<int64_t>(m_Y, other.m_Y);
+            int64_t right = std::max<int64_t>(int64_t(m_X) + m_Width, int64_t(other.m_X) + other.m_Width);
+            int64_t bottom = std::max<int64_t>(int64_t(m_Y) + m_Height, int64_t(other.m_Y) + other.m_Height);
+
+            return { static_cast<int32_t>(left), static_cast<int32_t>(top),
+                static_cast<uint32_t>(right - left), static_cast<uint32_t>(bottom - top) };
+        }
     };
 
     struct TakoDisplayBuffer
@@ -61,6 +99,135 @@ namespace Tako
         wrl::ComPtr<ID3D11Texture2D> m_Buffer;
         TakoRect m_DisplayRect;
         uint32_t m_DisplayIndex;
+        uint64_t m_Generation;
+    };
+
+    // A non-owning view into CPU-visible pixels. m_Data points at the top-left pixel of
+    // m_Rect (in desktop coordinates) and consecutive rows are m_Pitch bytes apart, so
+    // sub-rects can be described without copying. m_Generation identifies the captured
+    // frame the pixels belong to; a view is only valid until its display is captured again.
+    struct TakoFrameView
+    {
+        uint8_t* m_Data;
+        uint32_t m_Pitch;
+        DXGI_FORMAT m_Format;
+        TakoRect m_Rect;
+        uint64_t m_Generation;
+    };
+
+    struct TakoWorkerStats
+    {
+        uint64_t m_TasksExecuted;
+        uint64_t m_TasksStolen;
+        uint64_t m_BusyTimeUs;
+        float m_Utilization; // Fraction of wall time spent running tasks since the pool started
+    };
+
+    struct TakoStats
+    {
+        uint64_t m_InitializeTimeUs;
+        uint64_t m_TimeToFirstFrameUs; // From the start of Initialize() to the first completed capture, 0 until then
+        uint32_t m_NumDisplays;
+        uint32_t m_NumActiveDuplications; // Duplications are created on first capture and released when idle
+        uint64_t m_DisplayBufferBytes; // Capture and readback textures currently held
+        uint64_t m_DesktopFramebufferBytes; // Tiles held for CaptureDesktop
+
+        uint32_t m_NumWorkers;
+        TakoWorkerStats m_Workers[MaxNumWorkers];
+
+        uint32_t m_NumStreamSubscribers;
+        uint64_t m_StreamFramesSent;
+        uint64_t m_StreamFramesSkipped; // Frames replaced before a slow subscriber could take them
+
+        uint64_t m_ReplayDurationUs; // Span of the frames currently held by the replay buffer
+        uint64_t m_ReplayBudgetDurationUs; // Span the budget would hold at the current data rate
+        uint64_t m_ReplayBytes;
+        uint64_t m_ReplayFramesRecorded;
+        uint64_t m_ReplayFramesDropped; // Captures that arrived while the encoder was still busy
+        uint32_t m_ReplaySaving;
+        uint32_t m_ReplayLastSaveResult; // TakoError of the last completed save
+    };
+
+    static constexpr uint32_t TakoStreamMagic = 0x4F4B4154; // "TAKO"
+    static constexpr uint32_t TakoStreamVersion = 1;
+
+    enum class TakoStreamFlags : uint32_t
+    {
+        NONE = 0,
+        KEYFRAME = 1, // The chunks cover the whole region, earlier frames are not needed
+    };
+
+    // Sent once by a subscriber right after connecting to the stream pipe
+    struct TakoStreamRequest
+    {
+        uint32_t m_Magic;
+        uint32_t m_Version;
+        TakoRect m_Region;
+        uint32_t m_MaxFps;
+        uint32_t m_Reserved;
+    };
+
+    // Every streamed frame starts with this header, followed by m_NumMoveRects TakoStreamMoveRect
+    // entries and then m_NumChunks chunks. A chunk is a TakoStreamChunk followed by m_Rect.m_Height
+    // tightly packed rows of pixels. Moves read from the previous frame and are applied before the chunks.
+    struct TakoStreamFrameHeader
+    {
+        uint32_t m_Magic;
+        uint32_t m_Version;
+        uint64_t m_FrameId;
+        uint64_t m_TimestampUs;
+        TakoRect m_Region;
+        uint32_t m_Format; // DXGI_FORMAT
+        uint32_t m_Flags; // TakoStreamFlags
+        uint32_t m_NumMoveRects;
+        uint32_t m_NumChunks;
+        uint32_t m_NumSkippedFrames;
+        uint32_t m_Reserved;
+    };
+
+    struct TakoStreamMoveRect
+    {
+        int32_t m_SourceX;
+        int32_t m_SourceY;
+        TakoRect m_Destination;
+    };
+
+    struct TakoStreamChunk
+    {
+        TakoRect m_Rect;
+        uint32_t m_Size;
+        uint32_t m_Reserved;
+    };
+
+    enum class TakoRedactionMode : uint32_t
+    {
+        FILL = 0,
+        PIXELATE = 1,
+        BLUR = 2, // Box blur
+    };
+
+    // Part of the desktop hidden before a frame leaves the compositor. m_Strength is the block size for
+    // PIXELATE and the radius for BLUR, in pixels, from 1 to MaxRedactionStrength. Blurring repeats the edge
+    // pixels of the rect past its border. m_Color is the 0xAARRGGBB color used by FILL.
+    struct TakoRedaction
+    {
+        TakoRect m_Rect;
+        TakoRedactionMode m_Mode;
+        uint32_t m_Strength;
+        uint32_t m_Color;
+    };
+
+    // Called when the content of a watched region changed by more than its threshold. changedFraction is the
+    // part of the region that differs from what it held when the watch last fired or was first captured.
+    using TakoWatchCallback = void (*)(uint32_t watchId, float changedFraction, void* userData);
+
+    // Instruction set used by the CPU pixel kernels, ordered from least to most capable
+    enum class TakoCpuLevel : uint32_t
+    {
+        SCALAR = 0,
+        SSE42 = 1,
+        AVX2 = 2,
+        AVX512 = 3,
     };
 
     enum class TakoError : uint32_t
@@ -70,6 +237,8 @@ namespace Tako
         DX11_ERROR = 2,
         EXPECTED_ERROR = 3,
         UNEXPECTED_ERROR = 4,
+        INVALID_ARGUMENT = 5,
+        IO_ERROR = 6,
     };
 }
 
@@ -0,0 +1,267 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Subscribes to a local stream server and reads much slower than it captures. A window animated over the
+// watched region keeps the screen changing, so the server has to skip frames for this subscriber. Once the
+// animation stops, the image rebuilt from the stream must match a direct capture of the same region.
+
+#include "api.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+using namespace Tako;
+
+static constexpr wchar_t PipeName[] = L"\\\\.\\pipe\\tako_streamclient";
+static constexpr uint32_t RegionSize = 256;
+static constexpr uint32_t RequestedFps = 60;
+static constexpr DWORD ReadDelayMs = 100; // Several frames are captured for every one read
+static constexpr auto AnimationTime = std::chrono::seconds(3);
+
+static std::atomic<bool> g_Animating = true;
+static std::atomic<HWND> g_Window = nullptr;
+
+static LRESULT CALLBACK WindowProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
+{
+    static uint32_t tick = 0;
+
+    switch (message)
+    {
+    case WM_TIMER:
+        if (g_Animating)
+        {
+            tick++;
+            InvalidateRect(hwnd, nullptr, FALSE);
+        }
+        return 0;
+
+    case WM_PAINT:
+    {
+        PAINTSTRUCT paint;
+        HDC dc = BeginPaint(hwnd, &paint);
+
+        // A bar sweeping across the window changes a narrow band of pixels every tick
+        RECT client = { 0, 0, RegionSize, RegionSize };
+        FillRect(dc, &client, static_cast<HBRUSH>(GetStockObject(BLACK_BRUSH)));
+
+        LONG barX = static_cast<LONG>(tick * 8 % RegionSize);
+        RECT bar = { barX, 0, barX + 16, RegionSize };
+        FillRect(dc, &bar, static_cast<HBRUSH>(GetStockObject(WHITE_BRUSH)));
+
+        EndPaint(hwnd, &paint);
+        return 0;
+    }
+
+    case WM_DESTROY:
+        PostQuitMessage(0);
+        return 0;
+    }
+
+    return DefWindowProcW(hwnd, message, wParam, lParam);
+}
+
+static void WindowLoop(TakoRect region)
+{
+    WNDCLASSW windowClass = {};
+    windowClass.lpfnWndProc = WindowProc;
+    windowClass.hInstance = GetModuleHandleW(nullptr);
+    windowClass.lpszClassName = L"TakoStreamClient";
+    RegisterClassW(&windowClass);
+
+    HWND hwnd = CreateWindowExW(WS_EX_TOPMOST | WS_EX_TOOLWINDOW, windowClass.lpszClassName, L"", WS_POPUP | WS_VISIBLE,
+        region.m_X, region.m_Y, region.m_Width, region.m_Height, nullptr, nullptr, windowClass.hInstance, nullptr);
+    SetTimer(hwnd, 1, 10, nullptr);
+    g_Window = hwnd;
+
+    MSG message;
+    while (GetMessageW(&message, nullptr, 0, 0) > 0)
+    {
+        TranslateMessage(&message);
+        DispatchMessageW(&message);
+    }
+}
+
+static bool ReadExact(HANDLE pipe, void* data, uint32_t size)
+{
+    uint8_t* bytes = static_cast<uint8_t*>(data);
+    while (size > 0)
+    {
+        DWORD read;
+        if (!ReadFile(pipe, bytes, size, &read, nullptr) || read == 0)
+            return false;
+
+        bytes += read;
+        size -= read;
+    }
+
+    return true;
+}
+
+// Reads one frame and applies it to image, which holds the region as tightly packed rows
+static bool ReadFrame(HANDLE pipe, TakoRect region, std::vector<uint32_t>* image, TakoStreamFrameHeader* outHeader)
+{
+    TakoStreamFrameHeader& header = *outHeader;
+    if (!ReadExact(pipe, &header, sizeof(header)) || header.m_Magic != TakoStreamMagic || header.m_Version != TakoStreamVersion ||
+        !(header.m_Region == region) || header.m_Format != DXGI_FORMAT_B8G8R8A8_UNORM)
+        return false;
+
+    std::vector<TakoStreamMoveRect> moveRects(header.m_NumMoveRects);
+    if (!moveRects.empty() && !ReadExact(pipe, moveRects.data(), static_cast<uint32_t>(moveRects.size() * sizeof(TakoStreamMoveRect))))
+        return false;
+
+    // Moves read from the previous frame, not from the result of earlier moves
+    std::vector<uint32_t> previous = *image;
+    for (const TakoStreamMoveRect& move : moveRects)
+    {
+        const TakoRect& destination = move.m_Destination;
+        TakoRect source = { move.m_SourceX, move.m_SourceY, destination.m_Width, destination.m_Height };
+        if (!(region.Intersect(source) == source) || !(region.Intersect(destination) == destination))
+            return false;
+
+        for (uint32_t y = 0; y < destination.m_Height; ++y)
+        {
+            memcpy(&(*image)[static_cast<size_t>(destination.m_Y - region.m_Y + y) * region.m_Width + (destination.m_X - region.m_X)],
+                &previous[static_cast<size_t>(source.m_Y - region.m_Y + y) * region.m_Width + (source.m_X - region.m_X)],
+                destination.m_Width * sizeof(uint32_t));
+        }
+    }
+
+    std::vector<uint32_t> rows;
+    for (uint32_t i = 0; i < header.m_NumChunks; ++i)
+    {
+        TakoStreamChunk chunk;
+        if (!ReadExact(pipe, &chunk, sizeof(chunk)) || !(region.Intersect(chunk.m_Rect) == chunk.m_Rect) ||
+            chunk.m_Size != chunk.m_Rect.m_Width * chunk.m_Rect.m_Height * sizeof(uint32_t))
+            return false;
+
+        rows.resize(chunk.m_Size / sizeof(uint32_t));
+        if (!ReadExact(pipe, rows.data(), chunk.m_Size))
+            return false;
+
+        for (uint32_t y = 0; y < chunk.m_Rect.m_Height; ++y)
+        {
+            memcpy(&(*image)[static_cast<size_t>(chunk.m_Rect.m_Y - region.m_Y + y) * region.m_Width + (chunk.m_Rect.m_X - region.m_X)],
+                &rows[static_cast<size_t>(y) * chunk.m_Rect.m_Width], chunk.m_Rect.m_Width * sizeof(uint32_t));
+        }
+    }
+
+    return true;
+}
+
+static bool HasPendingData(HANDLE pipe)
+{
+    DWORD available = 0;
+    return PeekNamedPipe(pipe, nullptr, 0, nullptr, &available, nullptr) && available > 0;
+}
+
+int main()
+{
+    // Window and capture coordinates only agree without DPI virtualization
+    SetProcessDPIAware();
+
+    if (Initialize() != TakoError::OK)
+    {
+        printf("Initialize failed\n");
+        return 1;
+    }
+
+    // The primary display always starts at the desktop origin
+    TakoRect region = { 64, 64, RegionSize, RegionSize };
+
+    std::thread windowThread(WindowLoop, region);
+
+    // The pipe exists once the server has started
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    if (StartStreamServer(PipeName) == TakoError::OK)
+        pipe = CreateFileW(PipeName, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+
+    bool passed = pipe != INVALID_HANDLE_VALUE;
+    uint32_t numFrames = 0;
+    uint32_t numKeyframes = 0;
+    uint64_t numSkipped = 0;
+    std::vector<uint32_t> image(static_cast<size_t>(RegionSize) * RegionSize);
+
+    if (passed)
+    {
+        TakoStreamRequest request = { TakoStreamMagic, TakoStreamVersion, region, RequestedFps, 0 };
+        DWORD written;
+        passed = WriteFile(pipe, &request, sizeof(request), &written, nullptr) && written == sizeof(request);
+    }
+
+    auto readFrame = [&]()
+    {
+        TakoStreamFrameHeader header;
+        if (!ReadFrame(pipe, region, &image, &header))
+            return false;
+
+        bool keyframe = (header.m_Flags & static_cast<uint32_t>(TakoStreamFlags::KEYFRAME)) != 0;
+
+        // Nothing before the first frame can be built upon
+        if (numFrames == 0 && !keyframe)
+            return false;
+
+        numFrames++;
+        numKeyframes += keyframe;
+        numSkipped += header.m_NumSkippedFrames;
+        return true;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    while (passed && std::chrono::steady_clock::now() - start < AnimationTime)
+    {
+        passed = readFrame();
+        Sleep(ReadDelayMs);
+    }
+
+    // The server sends at most one more frame, holding everything skipped since the last one read
+    g_Animating = false;
+    Sleep(500);
+    while (passed && HasPendingData(pipe))
+    {
+        passed = readFrame();
+        Sleep(500);
+    }
+
+    std::vector<uint32_t> expected(image.size());
+    if (passed)
+        passed = CaptureIntoMemory(expected.data(), RegionSize * sizeof(uint32_t), DXGI_FORMAT_B8G8R8A8_UNORM, region) == TakoError::OK;
+
+    bool matches = passed && image == expected;
+
+    printf("frames %u, keyframes %u, skipped %llu, image %s\n", numFrames, numKeyframes,
+        static_cast<unsigned long long>(numSkipped), matches ? "matches" : "differs");
+
+    // A reader this slow must have had frames folded together for it, and still end up with the right image
+    passed = matches && numSkipped > 0;
+    printf("%s\n", passed ? "PASSED" : "FAILED");
+
+    if (pipe != INVALID_HANDLE_VALUE)
+        CloseHandle(pipe);
+
+    while (g_Window == nullptr)
+        Sleep(1);
+    PostMessageW(g_Window, WM_CLOSE, 0, 0);
+    windowThread.join();
+
+    StopStreamServer();
+    Shutdown();
+
+    return passed ? 0 : 1;
+}
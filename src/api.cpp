@@ -21,17 +21,61 @@
 #include "graphiccontext.h"
 #include "capturemanager.h"
 #include "compositor.h"
+#include "frameview.h"
+#include "pixelkernels.h"
+#include "threadpool.h"
+#include "streamserver.h"
+#include "replaybuffer.h"
+#include "sparseframebuffer.h"
+#include "regionwatcher.h"
 #include <dxgidebug.h>
 #include <dxgi1_3.h>
+#include <memory>
+#include <mutex>
 
 Tako::GraphicContext* g_GraphicContext;
 Tako::CaptureManager* g_CaptureManager;
 Tako::Compositor* g_Compositor;
+Tako::ThreadPool* g_ThreadPool;
+Tako::StreamServer* g_StreamServer;
+Tako::ReplayBuffer* g_ReplayBuffer;
+// Shared with the RemoveRegionWatch and AddRegionWatch calls in flight, which cannot hold a lock while the watcher
+// waits for callbacks that may call them in turn
+std::shared_ptr<Tako::RegionWatcher> g_RegionWatcher;
+
+// Last CaptureDesktop result and the buffer the next call composites into, created by the first call
+Tako::SparseFramebuffer* g_DesktopFramebuffers[2];
+// Set once a CaptureDesktop call succeeds; until then every display is reported dirty
+bool g_DesktopCaptured;
+
+// Serializes the CaptureManager, the Compositor and the immediate context between API calls and background threads
+std::mutex g_CaptureMutex;
+// Serializes starting and stopping background services with ConfigureThreadPool, and guards g_RegionWatcher.
+// The stream server and replay buffer are published and retired while also holding g_CaptureMutex, so code
+// holding either lock may use them.
+std::mutex g_ServiceMutex;
+
+std::chrono::steady_clock::time_point g_InitializeTime;
+uint64_t g_InitializeTimeUs;
 
 Tako::TakoError Tako::Initialize()
 {
     TakoError err;
 
+    g_InitializeTime = std::chrono::steady_clock::now();
+
+    err = SelectPixelKernels(DetectCpuLevel());
+    if (err != TakoError::OK)
+        return err;
+
+    // The calling thread takes part in every parallel stage, so one core is left for it. The workers are only
+    // started by the first stage that runs in parallel, callers that never get there do not pay for them.
+    uint32_t numCores = std::max(1u, std::thread::hardware_concurrency());
+    g_ThreadPool = new Tako::ThreadPool();
+    err = g_ThreadPool->Initialize(std::min(numCores - 1, MaxNumWorkers), 0);
+    if (err != TakoError::OK)
+        return err;
+
     g_GraphicContext = new Tako::GraphicContext();
     err = g_GraphicContext->Initialize();
     if (err != TakoError::OK)
@@ -47,6 +91,8 @@ Tako::TakoError Tako::Initialize()
     if (err != TakoError::OK)
         return err;
 
+    g_InitializeTimeUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - g_InitializeTime).count();
+
     return TakoError::OK;
 }
 
@@ -54,6 +100,47 @@ Tako::TakoError Tako::Shutdown()
 {
     TakoError err;
 
+    err = StopStreamServer();
+    if (err != TakoError::OK)
+        return err;
+
+    err = StopReplayBuffer();
+    if (err != TakoError::OK)
+        return err;
+
+    std::shared_ptr<Tako::RegionWatcher> regionWatcher;
+    {
+        std::lock_guard<std::mutex> serviceLock(g_ServiceMutex);
+        regionWatcher.swap(g_RegionWatcher);
+    }
+
+    // Callbacks may call into the API, so the watch thread is stopped without holding the lock.
+    // Calls that still hold the watcher find it without watches and it is freed by the last of them.
+    if (regionWatcher != nullptr)
+    {
+        err = regionWatcher->Shutdown();
+        if (err != TakoError::OK)
+        {
+            // Keep it reachable so that a later call can try again
+            std::lock_guard<std::mutex> serviceLock(g_ServiceMutex);
+            g_RegionWatcher = regionWatcher;
+            return err;
+        }
+    }
+
+    for (Tako::SparseFramebuffer*& framebuffer : g_DesktopFramebuffers)
+    {
+        if (framebuffer == nullptr)
+            continue;
+
+        err = framebuffer->Shutdown();
+        if (err != TakoError::OK)
+            return err;
+        delete framebuffer;
+        framebuffer = nullptr;
+    }
+    g_DesktopCaptured = false;
+
     err = g_CaptureManager->Shutdown();
     if (err != TakoError::OK)
         return err;
@@ -69,24 +156,510 @@ Tako::TakoError Tako::Shutdown()
         return err;
     delete g_GraphicContext;
 
+    err = g_ThreadPool->Shutdown();
+    if (err != TakoError::OK)
+        return err;
+    delete g_ThreadPool;
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::SetCpuLevel(TakoCpuLevel level)
+{
+    return SelectPixelKernels(level);
+}
+
+Tako::TakoCpuLevel Tako::GetCpuLevel()
+{
+    return GetSelectedCpuLevel();
+}
+
+Tako::TakoError Tako::ConfigureThreadPool(uint32_t numWorkers, uint64_t affinityMask)
+{
+    TakoError err;
+
+    if (numWorkers > MaxNumWorkers)
+        return TakoError::INVALID_ARGUMENT;
+
+    // Background services run parallel work outside the capture lock, the pool cannot be swapped under them.
+    // Holding the service lock also waits out a service that is still shutting down.
+    std::lock_guard<std::mutex> serviceLock(g_ServiceMutex);
+    if (g_StreamServer != nullptr || g_ReplayBuffer != nullptr)
+        return TakoError::EXPECTED_ERROR;
+
+    // Captures, including those of region watches, only use the pool while holding the lock
+    std::lock_guard<std::mutex> lock(g_CaptureMutex);
+
+    err = g_ThreadPool->Shutdown();
+    if (err != TakoError::OK)
+        return err;
+
+    err = g_ThreadPool->Initialize(numWorkers, affinityMask);
+    if (err != TakoError::OK)
+        return err;
+
+    // Started right away, so that a mask the workers cannot be pinned to is reported here
+    err = g_ThreadPool->StartWorkers();
+    if (err != TakoError::OK)
+    {
+        g_ThreadPool->Shutdown();
+        return err;
+    }
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::GetStats(TakoStats* outStats)
+{
+    std::lock_guard<std::mutex> lock(g_CaptureMutex);
+
+    outStats->m_InitializeTimeUs = g_InitializeTimeUs;
+    g_CaptureManager->GetStats(g_InitializeTime, outStats);
+
+    outStats->m_DesktopFramebufferBytes = 0;
+    for (const Tako::SparseFramebuffer* framebuffer : g_DesktopFramebuffers)
+    {
+        if (framebuffer != nullptr)
+            outStats->m_DesktopFramebufferBytes += framebuffer->GetMemoryBytes();
+    }
+
+    g_ThreadPool->GetWorkerStats(outStats->m_Workers, &outStats->m_NumWorkers);
+
+    outStats->m_NumStreamSubscribers = 0;
+    outStats->m_StreamFramesSent = 0;
+    outStats->m_StreamFramesSkipped = 0;
+    if (g_StreamServer != nullptr)
+        g_StreamServer->GetStats(outStats);
+
+    outStats->m_ReplayDurationUs = 0;
+    outStats->m_ReplayBudgetDurationUs = 0;
+    outStats->m_ReplayBytes = 0;
+    outStats->m_ReplayFramesRecorded = 0;
+    outStats->m_ReplayFramesDropped = 0;
+    outStats->m_ReplaySaving = 0;
+    outStats->m_ReplayLastSaveResult = static_cast<uint32_t>(TakoError::OK);
+    if (g_ReplayBuffer != nullptr)
+        g_ReplayBuffer->GetStats(outStats);
+
     return TakoError::OK;
 }
 
-Tako::TakoError Tako::CaptureIntoBuffer(HANDLE bufferHandle, TakoRect targetRect)
+// Captures a frame for the stream server as its own CaptureManager client. Views of the displays are only valid
+// while the lock is held, so it covers compositing as well.
+static Tako::TakoError CaptureStreamFrame(Tako::TakoRect region, const Tako::TakoFrameView& target)
 {
+    using namespace Tako;
+    TakoError err;
+
+    // Short enough for the server to notice new subscribers and shutdown while the screen is static
+    static constexpr uint32_t TimeoutMs = 100;
+
+    TakoDisplayBuffer displays[MaxNumDisplays];
+    uint32_t numDisplays;
+
+    std::lock_guard<std::mutex> lock(g_CaptureMutex);
+
+    err = g_CaptureManager->Capture(CaptureClient::STREAM_SERVER, region, displays, &numDisplays, TimeoutMs);
+    if (err != TakoError::OK)
+        return err;
+
+    TakoFrameView displayViews[MaxNumDisplays];
+    for (uint32_t i = 0; i < numDisplays; ++i)
+    {
+        err = g_CaptureManager->Readback(CaptureClient::STREAM_SERVER, displays[i], region, &displayViews[i]);
+        if (err != TakoError::OK)
+            return err;
+    }
+
+    return g_Compositor->RenderCompositeCpu(target, displayViews, numDisplays);
+}
+
+Tako::TakoError Tako::StartStreamServer(const wchar_t* pipeName)
+{
+    std::lock_guard<std::mutex> serviceLock(g_ServiceMutex);
+
+    if (g_StreamServer != nullptr)
+        return TakoError::EXPECTED_ERROR;
+
+    Tako::StreamServer* server = new Tako::StreamServer();
+    TakoError err = server->Initialize(pipeName, CaptureStreamFrame);
+    if (err != TakoError::OK)
+    {
+        delete server;
+        return err;
+    }
+
+    std::lock_guard<std::mutex> lock(g_CaptureMutex);
+    g_StreamServer = server;
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::StopStreamServer()
+{
+    std::lock_guard<std::mutex> serviceLock(g_ServiceMutex);
+
+    Tako::StreamServer* server;
+    {
+        std::lock_guard<std::mutex> lock(g_CaptureMutex);
+        server = g_StreamServer;
+        g_StreamServer = nullptr;
+    }
+
+    if (server == nullptr)
+        return TakoError::OK;
+
+    // The capture thread of the server takes g_CaptureMutex, so it is only shut down once unpublished
+    TakoError err = server->Shutdown();
+    if (err != TakoError::OK)
+    {
+        // Keep it reachable so that a later call can try again
+        std::lock_guard<std::mutex> lock(g_CaptureMutex);
+        g_StreamServer = server;
+        return err;
+    }
+
+    delete server;
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::StartReplayBuffer(TakoRect region, uint64_t budgetBytes, const TakoRedaction* redactions, uint32_t numRedactions)
+{
+    std::lock_guard<std::mutex> serviceLock(g_ServiceMutex);
+
+    if (g_ReplayBuffer != nullptr)
+        return TakoError::EXPECTED_ERROR;
+
+    Tako::ReplayBuffer* replayBuffer = new Tako::ReplayBuffer();
+    TakoError err = replayBuffer->Initialize(region, budgetBytes, redactions, numRedactions);
+    if (err != TakoError::OK)
+    {
+        delete replayBuffer;
+        return err;
+    }
+
+    std::lock_guard<std::mutex> lock(g_CaptureMutex);
+    g_ReplayBuffer = replayBuffer;
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::StopReplayBuffer()
+{
+    std::lock_guard<std::mutex> serviceLock(g_ServiceMutex);
+
+    // Captures insert while holding g_CaptureMutex, once unpublished none can reach the buffer anymore
+    Tako::ReplayBuffer* replayBuffer;
+    {
+        std::lock_guard<std::mutex> lock(g_CaptureMutex);
+        replayBuffer = g_ReplayBuffer;
+        g_ReplayBuffer = nullptr;
+    }
+
+    if (replayBuffer == nullptr)
+        return TakoError::OK;
+
+    TakoError err = replayBuffer->Shutdown();
+    if (err != TakoError::OK)
+    {
+        // Keep it reachable so that a later call can try again
+        std::lock_guard<std::mutex> lock(g_CaptureMutex);
+        g_ReplayBuffer = replayBuffer;
+        return err;
+    }
+
+    delete replayBuffer;
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::SaveReplay(const wchar_t* path)
+{
+    // Keeps the buffer from being stopped underneath, and concurrent saves from racing over the save thread
+    std::lock_guard<std::mutex> serviceLock(g_ServiceMutex);
+
+    if (g_ReplayBuffer == nullptr)
+        return TakoError::EXPECTED_ERROR;
+
+    return g_ReplayBuffer->Save(path);
+}
+
+Tako::TakoError Tako::AddRegionWatch(TakoRect rect, float threshold, TakoWatchCallback callback, void* userData, HANDLE event, uint32_t* outWatchId)
+{
+    std::shared_ptr<Tako::RegionWatcher> regionWatcher;
+    {
+        std::lock_guard<std::mutex> serviceLock(g_ServiceMutex);
+
+        // The watch thread is only started once something is watched
+        if (g_RegionWatcher == nullptr)
+        {
+            std::shared_ptr<Tako::RegionWatcher> created = std::make_shared<Tako::RegionWatcher>();
+            TakoError err = created->Initialize();
+            if (err != TakoError::OK)
+                return err;
+
+            g_RegionWatcher = created;
+        }
+
+        regionWatcher = g_RegionWatcher;
+    }
+
+    return regionWatcher->AddWatch(rect, threshold, callback, userData, event, outWatchId);
+}
+
+Tako::TakoError Tako::RemoveRegionWatch(uint32_t watchId)
+{
+    std::shared_ptr<Tako::RegionWatcher> regionWatcher;
+    {
+        std::lock_guard<std::mutex> serviceLock(g_ServiceMutex);
+        regionWatcher = g_RegionWatcher;
+    }
+
+    if (regionWatcher == nullptr)
+        return TakoError::INVALID_ARGUMENT;
+
+    // Waits for callbacks of the watch, which may call back into the API, so no lock is held
+    return regionWatcher->RemoveWatch(watchId);
+}
+
+// Records the replay region after an API capture. The replay buffer is its own CaptureManager client, so it
+// always gets its whole region whatever the caller captured, and only when something changed there since
+// the last recording. Expects g_CaptureMutex to be held.
+static void RecordReplay()
+{
+    using namespace Tako;
+
+    if (g_ReplayBuffer == nullptr)
+        return;
+
+    const TakoRect region = g_ReplayBuffer->GetRegion();
+
+    TakoDisplayBuffer displays[MaxNumDisplays];
+    uint32_t numDisplays;
+
+    // The caller just waited for a frame, so this never waits itself
+    if (g_CaptureManager->Capture(CaptureClient::REPLAY_BUFFER, region, displays, &numDisplays, 0) != TakoError::OK)
+        return;
+
+    TakoFrameView views[MaxNumDisplays];
+    for (uint32_t i = 0; i < numDisplays; ++i)
+    {
+        if (g_CaptureManager->Readback(CaptureClient::REPLAY_BUFFER, displays[i], region, &views[i]) != TakoError::OK)
+            return;
+    }
+
+    g_ReplayBuffer->Insert(views, numDisplays);
+}
+
+// Captures targetRect as one cropped view per display. Expects g_CaptureMutex to be held.
+static Tako::TakoError CaptureViews(Tako::TakoRect targetRect, Tako::TakoFrameView* outViews, uint32_t* outNumViews)
+{
+    using namespace Tako;
     TakoError err;
 
     static TakoDisplayBuffer overlappedDisplays[MaxNumDisplays];
     uint32_t numDisplays;
 
-    err = g_CaptureManager->Capture(targetRect, overlappedDisplays, &numDisplays);
+    err = g_CaptureManager->Capture(CaptureClient::API, targetRect, overlappedDisplays, &numDisplays);
     if (err != TakoError::OK)
         return err;
 
-    g_Compositor->RenderComposite(bufferHandle, targetRect, overlappedDisplays, numDisplays);
+    // Buffers may hold more of a display for other clients, only the part within targetRect is read back
+    *outNumViews = 0;
+    for (uint32_t i = 0; i < numDisplays; ++i)
+    {
+        err = g_CaptureManager->Readback(CaptureClient::API, overlappedDisplays[i], targetRect, &outViews[*outNumViews]);
+        if (err != TakoError::OK)
+            return err;
+
+        (*outNumViews)++;
+    }
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::CaptureIntoBuffer(HANDLE bufferHandle, TakoRect targetRect, const TakoRedaction* redactions, uint32_t numRedactions)
+{
+    TakoError err;
+
+    static TakoDisplayBuffer overlappedDisplays[MaxNumDisplays];
+    uint32_t numDisplays;
+
+    std::lock_guard<std::mutex> lock(g_CaptureMutex);
+
+    err = g_CaptureManager->Capture(CaptureClient::API, targetRect, overlappedDisplays, &numDisplays);
+    if (err != TakoError::OK)
+        return err;
+
+    err = g_Compositor->RenderComposite(bufferHandle, targetRect, overlappedDisplays, numDisplays, redactions, numRedactions);
+    if (err != TakoError::OK)
+        return err;
+
+    RecordReplay();
+
+    return TakoError::OK;
+}
+
+
+Tako::TakoError Tako::CaptureIntoViews(TakoRect targetRect, TakoFrameView* outViews, uint32_t* outNumViews)
+{
+    TakoError err;
+
+    std::lock_guard<std::mutex> lock(g_CaptureMutex);
+
+    err = CaptureViews(targetRect, outViews, outNumViews);
     if (err != TakoError::OK)
         return err;
 
+    // Recording reads back as another client, which leaves the returned views intact
+    RecordReplay();
+
     return TakoError::OK;
 }
 
+Tako::TakoError Tako::CaptureIntoMemory(void* buffer, uint32_t pitch, DXGI_FORMAT format, TakoRect targetRect,
+    const TakoRedaction* redactions, uint32_t numRedactions)
+{
+    TakoError err;
+
+    if (buffer == nullptr || pitch < static_cast<uint64_t>(targetRect.m_Width) * GetBytesPerPixel(format))
+        return TakoError::INVALID_ARGUMENT;
+
+    TakoFrameView displayViews[MaxNumDisplays];
+    uint32_t numViews;
+
+    std::lock_guard<std::mutex> lock(g_CaptureMutex);
+
+    err = CaptureViews(targetRect, displayViews, &numViews);
+    if (err != TakoError::OK)
+        return err;
+
+    TakoFrameView target;
+    target.m_Data = static_cast<uint8_t*>(buffer);
+    target.m_Pitch = pitch;
+    target.m_Format = format;
+    target.m_Rect = targetRect;
+    target.m_Generation = 0;
+
+    err = g_Compositor->RenderCompositeCpu(target, displayViews, numViews, redactions, numRedactions);
+    if (err != TakoError::OK)
+        return err;
+
+    RecordReplay();
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::CaptureDesktop(TakoRect* outDirtyRects, uint32_t maxDirtyRects, uint32_t* outNumDirtyRects)
+{
+    TakoError err;
+
+    std::lock_guard<std::mutex> lock(g_CaptureMutex);
+
+    const TakoRect desktopRect = g_CaptureManager->GetDesktopRect();
+    const std::vector<TakoRect>& displayRects = g_CaptureManager->GetDisplayRects();
+
+    if (g_DesktopFramebuffers[0] == nullptr)
+    {
+        for (Tako::SparseFramebuffer*& framebuffer : g_DesktopFramebuffers)
+        {
+            framebuffer = new Tako::SparseFramebuffer();
+            err = framebuffer->Initialize(desktopRect, displayRects.data(), static_cast<uint32_t>(displayRects.size()));
+            if (err != TakoError::OK)
+            {
+                // Start over on the next call rather than keep a half initialized pair
+                for (Tako::SparseFramebuffer*& created : g_DesktopFramebuffers)
+                {
+                    delete created;
+                    created = nullptr;
+                }
+                return err;
+            }
+        }
+    }
+
+    TakoFrameView displayViews[MaxNumDisplays];
+    uint32_t numViews;
+
+    err = CaptureViews(desktopRect, displayViews, &numViews);
+    if (err != TakoError::OK)
+        return err;
+
+    // Composite into the older buffer and only swap once everything succeeded, so a failed call leaves the
+    // last result readable and the next call diffs against it
+    err = g_DesktopFramebuffers[1]->Composite(displayViews, numViews);
+    if (err != TakoError::OK)
+        return err;
+
+    static std::vector<TakoRect> dirtyRects;
+    dirtyRects.clear();
+
+    if (!g_DesktopCaptured)
+    {
+        dirtyRects.assign(displayRects.begin(), displayRects.end());
+    }
+    else
+    {
+        err = g_DesktopFramebuffers[1]->Diff(*g_DesktopFramebuffers[0], &dirtyRects);
+        if (err != TakoError::OK)
+            return err;
+    }
+
+    std::swap(g_DesktopFramebuffers[0], g_DesktopFramebuffers[1]);
+    g_DesktopCaptured = true;
+
+    RecordReplay();
+
+    if (dirtyRects.size() > maxDirtyRects)
+    {
+        std::vector<TakoRect> changedDisplays;
+        for (const TakoRect& displayRect : displayRects)
+        {
+            for (const TakoRect& dirtyRect : dirtyRects)
+            {
+                if (!displayRect.Intersect(dirtyRect).IsEmpty())
+                {
+                    changedDisplays.push_back(displayRect);
+                    break;
+                }
+            }
+        }
+
+        dirtyRects.swap(changedDisplays);
+    }
+
+    *outNumDirtyRects = std::min(static_cast<uint32_t>(dirtyRects.size()), maxDirtyRects);
+    std::copy(dirtyRects.begin(), dirtyRects.begin() + *outNumDirtyRects, outDirtyRects);
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::ReadDesktop(TakoRect rect, void* buffer, uint32_t pitch, DXGI_FORMAT format)
+{
+    if (buffer == nullptr || pitch < static_cast<uint64_t>(rect.m_Width) * GetBytesPerPixel(format))
+        return TakoError::INVALID_ARGUMENT;
+
+    std::lock_guard<std::mutex> lock(g_CaptureMutex);
+
+    if (!g_DesktopCaptured)
+        return TakoError::EXPECTED_ERROR;
+
+    return g_DesktopFramebuffers[0]->Readback(rect, format, buffer, pitch);
+}
+
+Tako::TakoError Tako::GetDesktopRect(TakoRect* outRect)
+{
+    *outRect = g_CaptureManager->GetDesktopRect();
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::CopyViewIntoBuffer(const TakoFrameView& view, void* buffer, uint32_t pitch)
+{
+    return CopyFrameView(view, buffer, pitch);
+}
+
+Tako::TakoError Tako::ConvertViewIntoBuffer(const TakoFrameView& view, DXGI_FORMAT format, void* buffer, uint32_t pitch)
+{
+    return ConvertFrameView(view, format, buffer, pitch);
+}
@@ -19,6 +19,8 @@
 
 #include "capturemanager.h"
 #include "graphiccontext.h"
+#include "frameview.h"
+#include <algorithm>
 
 extern Tako::GraphicContext* g_GraphicContext;
 
@@ -34,32 +36,253 @@ Tako::TakoError Tako::CaptureManager::Initialize()
     if (err != TakoError::OK)
         return err;
 
+    // Duplications and display buffers are created on demand, only for displays that get captured
+    m_DxgiDuplications.resize(m_DxgiOutputs.size());
+    m_DuplicationSupported.resize(m_DxgiOutputs.size(), true);
+    m_CapturedTextures.resize(m_DxgiOutputs.size());
+    m_CapturedRegions.resize(m_DxgiOutputs.size());
+    m_FrameGenerations.resize(m_DxgiOutputs.size(), 0);
+    m_DirtyHistory.resize(m_DxgiOutputs.size());
+    m_LastCaptureTimes.resize(m_DxgiOutputs.size());
+
+    for (ClientState& client : m_Clients)
+    {
+        client.m_ReturnedRegions.resize(m_DxgiOutputs.size());
+        client.m_ReturnedGenerations.resize(m_DxgiOutputs.size(), 0);
+        client.m_RequestedRegions.resize(m_DxgiOutputs.size());
+        client.m_RequestTimes.resize(m_DxgiOutputs.size());
+        client.m_StagingTextures.resize(m_DxgiOutputs.size());
+        client.m_StagingMapped.resize(m_DxgiOutputs.size(), false);
+    }
+
     return TakoError::OK;
 }
 
 Tako::TakoError Tako::CaptureManager::Shutdown()
 {
+    for (uint32_t i = 0; i < m_CapturedTextures.size(); ++i)
+    {
+        ResetDuplication(i);
+
+        for (uint32_t client = 0; client < static_cast<uint32_t>(CaptureClient::COUNT); ++client)
+            ReleaseStagingTexture(static_cast<CaptureClient>(client), i);
+    }
+
     return TakoError::OK;
 }
 
-Tako::TakoError Tako::CaptureManager::Capture(TakoRect targetRect, TakoDisplayBuffer* outDisplays, uint32_t* outNumBuffers)
+Tako::TakoError Tako::CaptureManager::Capture(CaptureClient client, TakoRect targetRect, TakoDisplayBuffer* outDisplays, uint32_t* outNumBuffers,
+    uint32_t timeoutMs, std::vector<TakoRect>* outDirtyRects)
 {
+    TakoError err;
+    ClientState& state = m_Clients[static_cast<uint32_t>(client)];
+
+    *outNumBuffers = 0;
+
+    uint32_t displayIndices[MaxNumDisplays];
+    TakoRect regions[MaxNumDisplays];
+    uint32_t numDisplays = 0;
+
+    for (uint32_t i = 0; i < m_DxgiOutputs.size() && numDisplays < MaxNumDisplays; ++i)
+    {
+        TakoRect region = targetRect.Intersect(m_DisplayRects[i]);
+        if (region.IsEmpty())
+            continue;
+
+        // Pixels outside the buffer only come with a new frame. A new duplication delivers the current image
+        // right away, while the old one may not present anything for as long as the screen is static.
+        if (m_CapturedTextures[i] != nullptr && !(m_CapturedRegions[i].Intersect(region) == region))
+            ResetDuplication(i);
+
+        // Outputs that cannot be duplicated on this device are left out, like areas outside any display
+        err = PrepareDuplication(i);
+        if (err == TakoError::NOT_SUPPORTED)
+            continue;
 
-    TakoError err = Capture(0, outDisplays);
-    *outNumBuffers = 1;
+        if (err != TakoError::OK)
+            return err;
+
+        // Waiting on a display counts as use even when it presents nothing new
+        auto now = std::chrono::steady_clock::now();
+        m_LastCaptureTimes[i] = now;
+        state.m_RequestedRegions[i] = region;
+        state.m_RequestTimes[i] = now;
+
+        displayIndices[numDisplays] = i;
+        regions[numDisplays] = region;
+        numDisplays++;
+    }
+
+    // Displays are polled in turn with short waits instead of waiting on each one for the whole timeout, so a
+    // display showing static content cannot hold back the others. Each display falls back to its last image.
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t pass = 0; numDisplays > 0; ++pass)
+    {
+        uint32_t waitMs = pass == 0 ? 0 : std::max(1u, AcquireSliceMs / numDisplays);
+        if (timeoutMs != INFINITE)
+        {
+            auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            waitMs = static_cast<uint32_t>(std::min<int64_t>(waitMs, std::max<int64_t>(int64_t(timeoutMs) - elapsedMs, 0)));
+        }
+
+        bool ready = true;
+        bool changed = false;
+        for (uint32_t j = 0; j < numDisplays; ++j)
+        {
+            uint32_t i = displayIndices[j];
 
-    //for (wrl::ComPtr<IDXGIOutput1> display : m_DxgiOutputs)
-    //{
-    //    if (true /*targetRect.Intersect(display.getRect())*/)
-    //    {
-    //        // append to outBuffers
-    //        //Capture()
-    //    }
-    //}
+            err = UpdateDisplay(i, waitMs);
+            if (err != TakoError::OK && err != TakoError::EXPECTED_ERROR)
+                return err;
 
-    return err;
+            ready &= m_CapturedTextures[i] != nullptr;
+            changed |= m_FrameGenerations[i] != state.m_ReturnedGenerations[i] || !(state.m_ReturnedRegions[i] == regions[j]);
+        }
+
+        if (ready && changed)
+            break;
+
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        if (timeoutMs != INFINITE && elapsed >= std::chrono::milliseconds(timeoutMs))
+        {
+            ReleaseIdleDisplayBuffers(client);
+            return TakoError::EXPECTED_ERROR;
+        }
+    }
+
+    for (uint32_t j = 0; j < numDisplays; ++j)
+    {
+        uint32_t i = displayIndices[j];
+
+        if (outDirtyRects != nullptr)
+            AppendDirtyRects(i, state.m_ReturnedGenerations[i], outDirtyRects);
+
+        state.m_ReturnedGenerations[i] = m_FrameGenerations[i];
+        state.m_ReturnedRegions[i] = regions[j];
+
+        TakoDisplayBuffer& out = outDisplays[*outNumBuffers];
+        out.m_Buffer = m_CapturedTextures[i];
+        out.m_DisplayRect = m_CapturedRegions[i];
+        out.m_DisplayIndex = i;
+        out.m_Generation = m_FrameGenerations[i];
+        (*outNumBuffers)++;
+    }
+
+    ReleaseIdleDisplayBuffers(client);
+
+    if (outDirtyRects != nullptr)
+    {
+        for (TakoRect& dirtyRect : *outDirtyRects)
+            dirtyRect = dirtyRect.Intersect(targetRect);
+
+        outDirtyRects->erase(std::remove_if(outDirtyRects->begin(), outDirtyRects->end(),
+            [](const TakoRect& rect) { return rect.IsEmpty(); }), outDirtyRects->end());
+    }
+
+    if (m_FirstFrameTime == std::chrono::steady_clock::time_point() && *outNumBuffers > 0)
+        m_FirstFrameTime = std::chrono::steady_clock::now();
+
+    return TakoError::OK;
 }
 
+void Tako::CaptureManager::GetStats(std::chrono::steady_clock::time_point initializeTime, TakoStats* outStats) const
+{
+    outStats->m_NumDisplays = static_cast<uint32_t>(m_DxgiOutputs.size());
+    outStats->m_NumActiveDuplications = 0;
+    outStats->m_DisplayBufferBytes = 0;
+
+    for (uint32_t i = 0; i < m_DxgiOutputs.size(); ++i)
+    {
+        if (m_DxgiDuplications[i] != nullptr)
+            outStats->m_NumActiveDuplications++;
+
+        if (m_CapturedTextures[i] != nullptr)
+        {
+            D3D11_TEXTURE2D_DESC desc;
+            m_CapturedTextures[i]->GetDesc(&desc);
+            outStats->m_DisplayBufferBytes += static_cast<uint64_t>(desc.Width) * desc.Height * sizeof(uint32_t);
+        }
+
+        for (const ClientState& client : m_Clients)
+        {
+            if (client.m_StagingTextures[i] == nullptr)
+                continue;
+
+            D3D11_TEXTURE2D_DESC desc;
+            client.m_StagingTextures[i]->GetDesc(&desc);
+            outStats->m_DisplayBufferBytes += static_cast<uint64_t>(desc.Width) * desc.Height * sizeof(uint32_t);
+        }
+    }
+
+    outStats->m_TimeToFirstFrameUs = 0;
+    if (m_FirstFrameTime != std::chrono::steady_clock::time_point())
+        outStats->m_TimeToFirstFrameUs = std::chrono::duration_cast<std::chrono::microseconds>(m_FirstFrameTime - initializeTime).count();
+}
+
+Tako::TakoError Tako::CaptureManager::Readback(CaptureClient client, const TakoDisplayBuffer& display, TakoRect region, TakoFrameView* out)
+{
+    ClientState& state = m_Clients[static_cast<uint32_t>(client)];
+
+    uint32_t displayIndex = display.m_DisplayIndex;
+    if (displayIndex >= state.m_StagingTextures.size())
+        return TakoError::INVALID_ARGUMENT;
+
+    // Views handed out to this client for the previous frame of this display become invalid here
+    if (state.m_StagingMapped[displayIndex])
+    {
+        g_GraphicContext->GetDeviceContext()->Unmap(state.m_StagingTextures[displayIndex].Get(), 0);
+        state.m_StagingMapped[displayIndex] = false;
+    }
+
+    TakoRect rect = region.Intersect(display.m_DisplayRect);
+    if (display.m_Buffer == nullptr || rect.IsEmpty())
+        return TakoError::INVALID_ARGUMENT;
+
+    if (!CanReuseTexture(state.m_StagingTextures[displayIndex].Get(), rect.m_Width, rect.m_Height))
+    {
+        state.m_StagingTextures[displayIndex].Reset();
+
+        ID3D11Texture2D* stagingTexture;
+        TakoError err = CreateStagingTexture(rect.m_Width, rect.m_Height, &stagingTexture);
+        if (err != TakoError::OK)
+            return err;
+
+        state.m_StagingTextures[displayIndex].Attach(stagingTexture);
+    }
+
+    // Only the requested part is transferred, not everything the buffer holds for other clients
+    D3D11_BOX box;
+    box.left = rect.m_X - display.m_DisplayRect.m_X;
+    box.top = rect.m_Y - display.m_DisplayRect.m_Y;
+    box.front = 0;
+    box.right = box.left + rect.m_Width;
+    box.bottom = box.top + rect.m_Height;
+    box.back = 1;
+    g_GraphicContext->GetDeviceContext()->CopySubresourceRegion(state.m_StagingTextures[displayIndex].Get(), 0, 0, 0, 0, display.m_Buffer.Get(), 0, &box);
+
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    HRESULT hr = g_GraphicContext->GetDeviceContext()->Map(state.m_StagingTextures[displayIndex].Get(), 0, D3D11_MAP_READ, 0, &mapped);
+    if (FAILED(hr))
+        return TakoError::DX11_ERROR;
+
+    state.m_StagingMapped[displayIndex] = true;
+
+    out->m_Data = static_cast<uint8_t*>(mapped.pData);
+    out->m_Pitch = mapped.RowPitch;
+    out->m_Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    out->m_Rect = rect;
+    out->m_Generation = display.m_Generation;
+
+    return TakoError::OK;
+}
+
+void Tako::CaptureManager::Invalidate(CaptureClient client)
+{
+    ClientState& state = m_Clients[static_cast<uint32_t>(client)];
+    std::fill(state.m_ReturnedRegions.begin(), state.m_ReturnedRegions.end(), TakoRect());
+}
+
+// Only records the outputs and where they are, duplicating an output is left to the first capture that needs it
 Tako::TakoError Tako::CaptureManager::InitializeDxgiOutputs()
 {
     // Enumerate the available adapters (i.e., graphics cards)
@@ -79,19 +302,17 @@ Tako::TakoError Tako::CaptureManager::InitializeDxgiOutputs()
             output->Release();
             output = nullptr;
 
-            IDXGIOutputDuplication* duplicator;
-            hr = dxgiOutput1->DuplicateOutput(g_GraphicContext->GetDevice().Get(), &duplicator);
+            DXGI_OUTPUT_DESC desc;
+            dxgiOutput1->GetDesc(&desc);
 
-            if (FAILED(hr))
-                continue;
+            TakoRect displayRect;
+            displayRect.m_X = desc.DesktopCoordinates.left;
+            displayRect.m_Y = desc.DesktopCoordinates.top;
+            displayRect.m_Width = desc.DesktopCoordinates.right - desc.DesktopCoordinates.left;
+            displayRect.m_Height = desc.DesktopCoordinates.bottom - desc.DesktopCoordinates.top;
 
-            m_DxgiDuplications.push_back(duplicator);
             m_DxgiOutputs.emplace_back(dxgiOutput1);
-
-            ID3D11Texture2D* outputTexture;
-            TakoError err = CreateOutputTexture(outputIndex, &outputTexture);
-            if (err == TakoError::OK)
-                m_CapturedTextures.emplace_back(outputTexture);
+            m_DisplayRects.push_back(displayRect);
         }
 
         adapter->Release();
@@ -107,8 +328,8 @@ Tako::TakoError Tako::CaptureManager::InitializeDxgiOutputs()
 
 Tako::TakoError Tako::CaptureManager::InitializeDesktopRect()
 {
-    // Set desktop bounds;
-    LONG left = 0, right = 0, top = 0, bottom = 0;
+    // Set desktop bounds; the origin is only included when a display covers it
+    LONG left = LONG_MAX, right = LONG_MIN, top = LONG_MAX, bottom = LONG_MIN;
     for (uint32_t i = 0; i < m_DxgiOutputs.size(); ++i)
     {
         DXGI_OUTPUT_DESC desc;
@@ -121,49 +342,198 @@ Tako::TakoError Tako::CaptureManager::InitializeDesktopRect()
         right = std::max(right, desc.DesktopCoordinates.right);
         top = std::min(top, desc.DesktopCoordinates.top);
         bottom = std::max(bottom, desc.DesktopCoordinates.bottom);
-
-        assert(left < right);
-        assert(top < bottom);
     }
 
+    assert(left < right);
+    assert(top < bottom);
+
     m_DesktopRect.m_Width = right - left;
     m_DesktopRect.m_Height = bottom - top;
     m_DesktopRect.m_X = left;
-    m_DesktopRect.m_Y = right;
+    m_DesktopRect.m_Y = top;
 
     return TakoError::OK;
 }
 
-Tako::TakoError Tako::CaptureManager::Capture(uint32_t displayIndex, TakoDisplayBuffer* out)
+Tako::TakoError Tako::CaptureManager::UpdateDisplay(uint32_t displayIndex, uint32_t timeoutMs)
 {
     TakoError err;
 
-    ID3D11Texture2D* srcTexture = nullptr;
-    err = AcquireNextFrame(displayIndex, &srcTexture, &out->m_DisplayRect);
+    ID3D11Texture2D* frame = nullptr;
+    DXGI_OUTDUPL_FRAME_INFO frameInfo;
+    err = AcquireNextFrame(displayIndex, &frame, &frameInfo, timeoutMs);
     if (err != TakoError::OK)
         return err;
 
-    g_GraphicContext->GetDeviceContext()->CopyResource(m_CapturedTextures[displayIndex].Get(), srcTexture);
+    // Frames that only update the mouse pointer leave the desktop image untouched
+    bool firstImage = m_CapturedTextures[displayIndex] == nullptr;
+    if (frameInfo.LastPresentTime.QuadPart != 0 || firstImage)
+    {
+        // Only the part of the display that clients currently capture is kept, copied straight from the frame
+        TakoRect region = GetCapturedRegion(displayIndex);
+        err = PrepareCapturedTexture(displayIndex, region.m_Width, region.m_Height);
+        if (err == TakoError::OK)
+        {
+            const TakoRect& displayRect = m_DisplayRects[displayIndex];
+            D3D11_BOX box;
+            box.left = region.m_X - displayRect.m_X;
+            box.top = region.m_Y - displayRect.m_Y;
+            box.front = 0;
+            box.right = box.left + region.m_Width;
+            box.bottom = box.top + region.m_Height;
+            box.back = 1;
+            g_GraphicContext->GetDeviceContext()->CopySubresourceRegion(m_CapturedTextures[displayIndex].Get(), 0, 0, 0, 0, frame, 0, &box);
+            m_CapturedRegions[displayIndex] = region;
+
+            // Whatever happened while there was no image is unknown, so the first one counts as changed everywhere
+            DirtyFrame dirtyFrame;
+            dirtyFrame.m_Generation = ++m_FrameGenerations[displayIndex];
+            if (firstImage)
+                dirtyFrame.m_Rects.push_back(m_DisplayRects[displayIndex]);
+            else
+                AppendFrameDirtyRects(displayIndex, frameInfo, m_DisplayRects[displayIndex], &dirtyFrame.m_Rects);
+
+            std::deque<DirtyFrame>& history = m_DirtyHistory[displayIndex];
+            if (firstImage)
+                history.clear();
+            if (history.size() == MaxDirtyHistory)
+                history.pop_front();
+            history.push_back(std::move(dirtyFrame));
+        }
+    }
 
-    err = ReleaseFrame(displayIndex, srcTexture);
+    TakoError releaseErr = ReleaseFrame(displayIndex, frame);
     if (err != TakoError::OK)
+    {
+        // Without an image the next frame could be a long time coming, a new duplication delivers one right away
+        if (m_CapturedTextures[displayIndex] == nullptr)
+            ResetDuplication(displayIndex);
         return err;
+    }
+
+    return releaseErr;
+}
+
+Tako::TakoRect Tako::CaptureManager::GetCapturedRegion(uint32_t displayIndex) const
+{
+    auto now = std::chrono::steady_clock::now();
+
+    TakoRect region = {};
+    for (const ClientState& client : m_Clients)
+    {
+        if (now - client.m_RequestTimes[displayIndex] <= DisplayBufferIdleTimeout)
+            region = region.Union(client.m_RequestedRegions[displayIndex]);
+    }
+
+    return region;
+}
+
+bool Tako::CaptureManager::CanReuseTexture(ID3D11Texture2D* texture, uint32_t width, uint32_t height)
+{
+    if (texture == nullptr)
+        return false;
+
+    D3D11_TEXTURE2D_DESC desc;
+    texture->GetDesc(&desc);
+
+    // Keep using a buffer the region fits into, unless most of it would sit unused
+    return desc.Width >= width && desc.Height >= height &&
+        static_cast<uint64_t>(width) * height * 4 >= static_cast<uint64_t>(desc.Width) * desc.Height;
+}
+
+Tako::TakoError Tako::CaptureManager::PrepareDuplication(uint32_t displayIndex)
+{
+    if (m_DxgiDuplications[displayIndex] != nullptr)
+        return TakoError::OK;
+
+    if (!m_DuplicationSupported[displayIndex])
+        return TakoError::NOT_SUPPORTED;
 
-    out->m_Buffer = m_CapturedTextures[displayIndex];
-    out->m_DisplayIndex = displayIndex;
+    IDXGIOutputDuplication* duplication;
+    HRESULT hr = m_DxgiOutputs[displayIndex]->DuplicateOutput(g_GraphicContext->GetDevice().Get(), &duplication);
 
+    // Outputs of other adapters can never be duplicated on our device, other failures may be transient
+    if (hr == DXGI_ERROR_UNSUPPORTED)
+    {
+        m_DuplicationSupported[displayIndex] = false;
+        return TakoError::NOT_SUPPORTED;
+    }
+
+    if (FAILED(hr))
+        return TakoError::DX11_ERROR;
+
+    // Counts as use, otherwise a duplication whose first capture failed would be released right away
+    m_DxgiDuplications[displayIndex].Attach(duplication);
+    m_LastCaptureTimes[displayIndex] = std::chrono::steady_clock::now();
     return TakoError::OK;
 }
 
-Tako::TakoError Tako::CaptureManager::CreateOutputTexture(uint32_t displayIndex, ID3D11Texture2D** out)
+Tako::TakoError Tako::CaptureManager::PrepareCapturedTexture(uint32_t displayIndex, uint32_t width, uint32_t height)
 {
-    DXGI_OUTPUT_DESC displayDesc;
-    m_DxgiOutputs[displayIndex]->GetDesc(&displayDesc);
+    if (CanReuseTexture(m_CapturedTextures[displayIndex].Get(), width, height))
+        return TakoError::OK;
+
+    m_CapturedTextures[displayIndex].Reset();
+    m_CapturedRegions[displayIndex] = {};
+
+    ID3D11Texture2D* outputTexture;
+    TakoError err = CreateOutputTexture(width, height, &outputTexture);
+    if (err != TakoError::OK)
+        return err;
+
+    m_CapturedTextures[displayIndex].Attach(outputTexture);
+    return TakoError::OK;
+}
 
+void Tako::CaptureManager::ReleaseDisplayBuffers(uint32_t displayIndex)
+{
+    m_CapturedTextures[displayIndex].Reset();
+    m_CapturedRegions[displayIndex] = {};
+    m_DirtyHistory[displayIndex].clear();
+}
+
+void Tako::CaptureManager::ReleaseStagingTexture(CaptureClient client, uint32_t displayIndex)
+{
+    ClientState& state = m_Clients[static_cast<uint32_t>(client)];
+
+    if (state.m_StagingMapped[displayIndex])
+    {
+        g_GraphicContext->GetDeviceContext()->Unmap(state.m_StagingTextures[displayIndex].Get(), 0);
+        state.m_StagingMapped[displayIndex] = false;
+    }
+
+    state.m_StagingTextures[displayIndex].Reset();
+}
+
+void Tako::CaptureManager::ReleaseIdleDisplayBuffers(CaptureClient client)
+{
+    auto now = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < m_CapturedTextures.size(); ++i)
+    {
+        if (now - m_LastCaptureTimes[i] <= DisplayBufferIdleTimeout)
+            continue;
+
+        if (m_DxgiDuplications[i] != nullptr)
+            ResetDuplication(i);
+
+        // Other clients may still be reading views of their staging textures; they release them on their next capture
+        ReleaseStagingTexture(client, i);
+    }
+}
+
+void Tako::CaptureManager::ResetDuplication(uint32_t displayIndex)
+{
+    ReleaseDisplayBuffers(displayIndex);
+    m_DxgiDuplications[displayIndex].Reset();
+}
+
+Tako::TakoError Tako::CaptureManager::CreateOutputTexture(uint32_t width, uint32_t height, ID3D11Texture2D** out)
+{
     D3D11_TEXTURE2D_DESC desc;
     RtlZeroMemory(&desc, sizeof(D3D11_TEXTURE2D_DESC));
-    desc.Width = displayDesc.DesktopCoordinates.right - displayDesc.DesktopCoordinates.left;
-    desc.Height = displayDesc.DesktopCoordinates.bottom - displayDesc.DesktopCoordinates.top;
+    desc.Width = width;
+    desc.Height = height;
     desc.MipLevels = 1;
     desc.ArraySize = 1;
     desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
@@ -180,47 +550,129 @@ Tako::TakoError Tako::CaptureManager::CreateOutputTexture(uint32_t displayIndex,
     return TakoError::OK;
 }
 
-Tako::TakoError Tako::CaptureManager::AcquireNextFrame(int32_t displayIndex, ID3D11Texture2D** out, TakoRect* outRect)
+Tako::TakoError Tako::CaptureManager::CreateStagingTexture(uint32_t width, uint32_t height, ID3D11Texture2D** out)
 {
-    DXGI_OUTPUT_DESC displayDesc;
-    m_DxgiOutputs[displayIndex]->GetDesc(&displayDesc);
+    D3D11_TEXTURE2D_DESC desc;
+    RtlZeroMemory(&desc, sizeof(D3D11_TEXTURE2D_DESC));
+    desc.Width = width;
+    desc.Height = height;
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_STAGING;
+    desc.BindFlags = 0;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    desc.MiscFlags = 0;
 
-    IDXGIResource* outResource = nullptr;
+    HRESULT hr = g_GraphicContext->GetDevice()->CreateTexture2D(&desc, nullptr, out);
+    if (FAILED(hr))
+        return TakoError::DX11_ERROR;
 
-    while (true)
-    {
-        DXGI_OUTDUPL_FRAME_INFO frameInfo;
-        HRESULT hr = m_DxgiDuplications[displayIndex]->AcquireNextFrame(INFINITE, &frameInfo, &outResource);
+    return TakoError::OK;
+}
 
-        if (hr == DXGI_ERROR_WAIT_TIMEOUT)
-            continue;
+Tako::TakoError Tako::CaptureManager::AcquireNextFrame(int32_t displayIndex, ID3D11Texture2D** out, DXGI_OUTDUPL_FRAME_INFO* outFrameInfo,
+    uint32_t timeoutMs)
+{
+    IDXGIResource* outResource = nullptr;
+    HRESULT hr = m_DxgiDuplications[displayIndex]->AcquireNextFrame(timeoutMs, outFrameInfo, &outResource);
 
-        if (FAILED(hr))
-            return TakoError::DX11_ERROR;
+    if (hr == DXGI_ERROR_WAIT_TIMEOUT)
+        return TakoError::EXPECTED_ERROR;
 
-        break;
-    }
+    // Mode changes, desktop switches and secure desktops end the duplication; the next capture duplicates again
+    if (hr == DXGI_ERROR_ACCESS_LOST)
+        ResetDuplication(displayIndex);
 
-    if ((*out) != nullptr)
-        (*out)->Release();
+    if (FAILED(hr))
+        return TakoError::DX11_ERROR;
 
-    HRESULT hr = outResource->QueryInterface(__uuidof(ID3D11Texture2D), reinterpret_cast<void**>(out));
+    hr = outResource->QueryInterface(__uuidof(ID3D11Texture2D), reinterpret_cast<void**>(out));
     outResource->Release();
 
-    outRect->m_Width = displayDesc.DesktopCoordinates.right - displayDesc.DesktopCoordinates.left;
-    outRect->m_Height = displayDesc.DesktopCoordinates.bottom - displayDesc.DesktopCoordinates.top;
-    outRect->m_X = displayDesc.DesktopCoordinates.left;
-    outRect->m_Y = displayDesc.DesktopCoordinates.right;
-
     if (FAILED(hr))
+    {
+        ReleaseFrame(displayIndex, nullptr);
         return TakoError::DX11_ERROR;
+    }
 
     return TakoError::OK;
 }
 
+void Tako::CaptureManager::AppendFrameDirtyRects(int32_t displayIndex, const DXGI_OUTDUPL_FRAME_INFO& frameInfo, TakoRect displayRect,
+    std::vector<TakoRect>* outDirtyRects)
+{
+    // Frames that only update the mouse pointer leave the desktop image untouched
+    if (frameInfo.LastPresentTime.QuadPart == 0)
+        return;
+
+    IDXGIOutputDuplication* duplication = m_DxgiDuplications[displayIndex].Get();
+    m_MetadataBuffer.resize(std::max<size_t>(m_MetadataBuffer.size(), frameInfo.TotalMetadataBufferSize));
+
+    // Metadata rects are relative to the display; moved content only changes the destination
+    UINT movesSize = 0;
+    HRESULT hr = frameInfo.TotalMetadataBufferSize == 0 ? E_FAIL : duplication->GetFrameMoveRects(static_cast<UINT>(m_MetadataBuffer.size()),
+        reinterpret_cast<DXGI_OUTDUPL_MOVE_RECT*>(m_MetadataBuffer.data()), &movesSize);
+
+    if (SUCCEEDED(hr))
+    {
+        const DXGI_OUTDUPL_MOVE_RECT* moves = reinterpret_cast<const DXGI_OUTDUPL_MOVE_RECT*>(m_MetadataBuffer.data());
+        for (UINT i = 0; i < movesSize / sizeof(DXGI_OUTDUPL_MOVE_RECT); ++i)
+        {
+            TakoRect rect = ToTakoRect(moves[i].DestinationRect);
+            outDirtyRects->push_back({ rect.m_X + displayRect.m_X, rect.m_Y + displayRect.m_Y, rect.m_Width, rect.m_Height });
+        }
+
+        UINT dirtySize = 0;
+        hr = duplication->GetFrameDirtyRects(static_cast<UINT>(m_MetadataBuffer.size()),
+            reinterpret_cast<RECT*>(m_MetadataBuffer.data()), &dirtySize);
+
+        if (SUCCEEDED(hr))
+        {
+            const RECT* dirtyRects = reinterpret_cast<const RECT*>(m_MetadataBuffer.data());
+            for (UINT i = 0; i < dirtySize / sizeof(RECT); ++i)
+            {
+                TakoRect rect = ToTakoRect(dirtyRects[i]);
+                outDirtyRects->push_back({ rect.m_X + displayRect.m_X, rect.m_Y + displayRect.m_Y, rect.m_Width, rect.m_Height });
+            }
+        }
+    }
+
+    // Without usable metadata the whole display has to be assumed changed
+    if (FAILED(hr))
+        outDirtyRects->push_back(displayRect);
+}
+
+void Tako::CaptureManager::AppendDirtyRects(uint32_t displayIndex, uint64_t sinceGeneration, std::vector<TakoRect>* outDirtyRects) const
+{
+    const std::deque<DirtyFrame>& history = m_DirtyHistory[displayIndex];
+    if (history.empty() || history.back().m_Generation <= sinceGeneration)
+        return;
+
+    // Frames the client missed that are no longer in the history could have changed anything
+    if (history.front().m_Generation > sinceGeneration + 1)
+    {
+        outDirtyRects->push_back(m_DisplayRects[displayIndex]);
+        return;
+    }
+
+    for (const DirtyFrame& frame : history)
+    {
+        if (frame.m_Generation > sinceGeneration)
+            outDirtyRects->insert(outDirtyRects->end(), frame.m_Rects.begin(), frame.m_Rects.end());
+    }
+}
+
 Tako::TakoError Tako::CaptureManager::ReleaseFrame(int32_t displayIndex, ID3D11Texture2D* frame)
 {
+    if (frame != nullptr)
+        frame->Release();
+
     HRESULT hr = m_DxgiDuplications[displayIndex]->ReleaseFrame();
+    if (hr == DXGI_ERROR_ACCESS_LOST)
+        ResetDuplication(displayIndex);
+
     if (FAILED(hr))
         return TakoError::DX11_ERROR;
 
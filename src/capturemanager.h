@@ -20,9 +20,24 @@
 #pragma once
 
 #include "common.h"
+#include <chrono>
+#include <deque>
 
 namespace Tako
 {
+    // Independent users of the CaptureManager. Each has its own staging textures and its own record of what it
+    // was last given, so captures made for one neither invalidate the views nor swallow the changes of another.
+    enum class CaptureClient : uint32_t
+    {
+        API = 0,
+        STREAM_SERVER = 1,
+        REGION_WATCHER = 2,
+        REPLAY_BUFFER = 3,
+        COUNT = 4,
+    };
+
+    // Not thread safe: callers serialize all use, together with the Compositor and the immediate context, through
+    // g_CaptureMutex and keep holding it while they read views of a background client.
     class CaptureManager
     {
     public:
@@ -31,22 +46,89 @@ namespace Tako
 
         TakoError Initialize();
         TakoError Shutdown();
-        TakoError Capture(TakoRect targetRect, TakoDisplayBuffer* outDisplays, uint32_t* outNumBuffers);
+        // Captures only the parts of the displays that intersect targetRect. Each display keeps one buffer with
+        // the part that clients recently captured, copied straight from each new frame and held at the texture
+        // origin; m_DisplayRect is that part in desktop coordinates. It covers the intersection with targetRect,
+        // may extend past it for other clients, and the texture itself may be larger still because buffers are
+        // reused while they are big enough. Displays without a new frame return their last image, so Capture
+        // waits until any display presents something the client has not seen or the region changed since its
+        // previous call; EXPECTED_ERROR is returned when that does not happen within timeoutMs. Asking for more
+        // of a display than its buffer holds restarts its duplication to get the current image. outDirtyRects
+        // receives the areas that changed since the client's previous capture of each display, in desktop
+        // coordinates and clipped to targetRect.
+        TakoError Capture(CaptureClient client, TakoRect targetRect, TakoDisplayBuffer* outDisplays, uint32_t* outNumBuffers,
+            uint32_t timeoutMs = INFINITE, std::vector<TakoRect>* outDirtyRects = nullptr);
+
+        // Maps the part of a buffer returned by the last Capture that overlaps region for CPU access, before any
+        // other client captures. The view stays valid until the client reads back the same display again.
+        TakoError Readback(CaptureClient client, const TakoDisplayBuffer& display, TakoRect region, TakoFrameView* out);
+
+        // Makes the next Capture of the client return the latest images without waiting for a new frame
+        void Invalidate(CaptureClient client);
+
+        inline TakoRect GetDesktopRect() const { return m_DesktopRect; }
+        inline const std::vector<TakoRect>& GetDisplayRects() const { return m_DisplayRects; }
+
+        // Fills the display and startup fields of outStats; initializeTime is when library initialization began
+        void GetStats(std::chrono::steady_clock::time_point initializeTime, TakoStats* outStats) const;
 
     private:
         TakoError InitializeDxgiOutputs();
         TakoError InitializeDesktopRect();
-        TakoError Capture(uint32_t displayIndex, TakoDisplayBuffer* out);
-        TakoError CreateOutputTexture(uint32_t displayIndex, ID3D11Texture2D** out);
-        TakoError AcquireNextFrame(int32_t displayIndex, ID3D11Texture2D** out, TakoRect* outRect);
+        TakoError UpdateDisplay(uint32_t displayIndex, uint32_t timeoutMs);
+        TakoRect GetCapturedRegion(uint32_t displayIndex) const; // Union of what clients captured of the display lately
+        static bool CanReuseTexture(ID3D11Texture2D* texture, uint32_t width, uint32_t height);
+        TakoError PrepareDuplication(uint32_t displayIndex);
+        TakoError PrepareCapturedTexture(uint32_t displayIndex, uint32_t width, uint32_t height);
+        TakoError CreateOutputTexture(uint32_t width, uint32_t height, ID3D11Texture2D** out);
+        TakoError CreateStagingTexture(uint32_t width, uint32_t height, ID3D11Texture2D** out);
+        void ReleaseDisplayBuffers(uint32_t displayIndex);
+        void ReleaseStagingTexture(CaptureClient client, uint32_t displayIndex);
+        void ReleaseIdleDisplayBuffers(CaptureClient client);
+        void ResetDuplication(uint32_t displayIndex);
+        TakoError AcquireNextFrame(int32_t displayIndex, ID3D11Texture2D** out, DXGI_OUTDUPL_FRAME_INFO* outFrameInfo, uint32_t timeoutMs);
+        void AppendFrameDirtyRects(int32_t displayIndex, const DXGI_OUTDUPL_FRAME_INFO& frameInfo, TakoRect displayRect, std::vector<TakoRect>* outDirtyRects);
+        void AppendDirtyRects(uint32_t displayIndex, uint64_t sinceGeneration, std::vector<TakoRect>* outDirtyRects) const;
         TakoError ReleaseFrame(int32_t displayIndex, ID3D11Texture2D* frame);
 
     private:
+        // Duplications and buffers of displays that have not been captured for this long are released
+        static constexpr std::chrono::seconds DisplayBufferIdleTimeout = std::chrono::seconds(5);
+        // Longest wait for one display per round while polling several
+        static constexpr uint32_t AcquireSliceMs = 16;
+        // Frames of dirty rects kept per display; clients further behind treat the whole display as changed
+        static constexpr size_t MaxDirtyHistory = 32;
+
+        struct DirtyFrame
+        {
+            uint64_t m_Generation;
+            std::vector<TakoRect> m_Rects;
+        };
+
+        struct ClientState
+        {
+            std::vector<TakoRect> m_ReturnedRegions; // What the last Capture returned for each display
+            std::vector<uint64_t> m_ReturnedGenerations;
+            std::vector<TakoRect> m_RequestedRegions; // What the client asked for of each display, and when
+            std::vector<std::chrono::steady_clock::time_point> m_RequestTimes;
+            std::vector<wrl::ComPtr<ID3D11Texture2D>> m_StagingTextures;
+            std::vector<bool> m_StagingMapped;
+        };
+
         std::vector<wrl::ComPtr<IDXGIOutput1>> m_DxgiOutputs;
         std::vector<wrl::ComPtr<IDXGIOutputDuplication>> m_DxgiDuplications;
-        std::vector<wrl::ComPtr<ID3D11Texture2D>> m_CapturedTextures;
+        std::vector<bool> m_DuplicationSupported;
+        std::vector<wrl::ComPtr<ID3D11Texture2D>> m_CapturedTextures; // Latest image of the captured part of each display
+        std::vector<TakoRect> m_CapturedRegions; // What each captured texture currently holds
+        std::vector<uint64_t> m_FrameGenerations;
+        std::vector<std::deque<DirtyFrame>> m_DirtyHistory;
+        ClientState m_Clients[static_cast<uint32_t>(CaptureClient::COUNT)];
+        std::vector<TakoRect> m_DisplayRects;
+        std::vector<std::chrono::steady_clock::time_point> m_LastCaptureTimes;
 
         TakoRect m_DesktopRect; // A rect that represents the entire desktop comprised of all displays
+        std::chrono::steady_clock::time_point m_FirstFrameTime;
+        std::vector<uint8_t> m_MetadataBuffer;
     };
 }
 
@@ -19,23 +19,35 @@
 
 #include "compositor.h"
 #include "graphiccontext.h"
+#include "frameview.h"
+#include "pixelkernels.h"
+#include "threadpool.h"
 #include "data/compositor_vs.h"
 #include "data/compositor_ps.h"
+#include "data/redaction_ps.h"
 
 extern Tako::GraphicContext* g_GraphicContext;
+extern Tako::ThreadPool* g_ThreadPool;
 
-Tako::TakoError Tako::Compositor::Initialize()
+namespace
 {
-    TakoError err;
-    
-    err = InitializeSampler();
-    if (err != TakoError::OK)
-        return err;
-    
-    err = InitializeShaders();
-    if (err != TakoError::OK)
-        return err;
+    // Mirrors RedactionConstants in redaction_ps.hlsl
+    struct RedactionConstants
+    {
+        DirectX::XMFLOAT4 m_FillColor;
+        DirectX::XMINT2 m_Size;
+        DirectX::XMINT2 m_Axis;
+        DirectX::XMFLOAT2 m_SourceSize;
+        uint32_t m_Strength;
+        uint32_t m_Mode;
+        uint32_t m_Quantize;
+        float m_Padding[3];
+    };
+}
 
+Tako::TakoError Tako::Compositor::Initialize()
+{
+    // GPU state is created by the first RenderComposite, CPU-only callers never need it
     return TakoError::OK;
 }
 
@@ -44,24 +56,36 @@ Tako::TakoError Tako::Compositor::Shutdown()
     return TakoError::OK;
 }
 
-Tako::TakoError Tako::Compositor::RenderComposite(HANDLE sharedTextureHandle, TakoRect targetRect, TakoDisplayBuffer* displays, uint32_t numDisplays)
+Tako::TakoError Tako::Compositor::RenderComposite(HANDLE sharedTextureHandle, TakoRect targetRect, TakoDisplayBuffer* displays, uint32_t numDisplays,
+    const TakoRedaction* redactions, uint32_t numRedactions)
 {
-    // TODO: CLEAN!!!
+    TakoError err;
+
+    err = PrepareDeviceState();
+    if (err != TakoError::OK)
+        return err;
+
+    for (uint32_t i = 0; i < numRedactions; ++i)
+    {
+        if (!Redactor::IsValid(redactions[i]))
+            return TakoError::INVALID_ARGUMENT;
+    }
+
     // Query the ID3D11Texture2D interface from the shared resource.
-    ID3D11Texture2D* sharedTexture = nullptr;
-    IDXGIKeyedMutex* keyMutex = nullptr;
+    wrl::ComPtr<ID3D11Texture2D> sharedTexture;
+    wrl::ComPtr<IDXGIKeyedMutex> keyMutex;
 
-    HRESULT hr = g_GraphicContext->GetDevice()->OpenSharedResource(sharedTextureHandle, __uuidof(ID3D11Texture2D), reinterpret_cast<void**>(&sharedTexture));
+    HRESULT hr = g_GraphicContext->GetDevice()->OpenSharedResource(sharedTextureHandle, __uuidof(ID3D11Texture2D), reinterpret_cast<void**>(sharedTexture.GetAddressOf()));
     if (FAILED(hr))
         return TakoError::DX11_ERROR;
 
-    hr = sharedTexture->QueryInterface(__uuidof(IDXGIKeyedMutex), reinterpret_cast<void**>(&keyMutex));
+    hr = sharedTexture.As(&keyMutex);
     if (FAILED(hr))
         return TakoError::DX11_ERROR;
 
     while (true)
     {
-        HRESULT hr = keyMutex->AcquireSync(0, 1000);
+        hr = keyMutex->AcquireSync(0, 1000);
         if (hr == static_cast<HRESULT>(WAIT_TIMEOUT))
             continue;
 
@@ -71,70 +95,272 @@ Tako::TakoError Tako::Compositor::RenderComposite(HANDLE sharedTextureHandle, Ta
         break;
     }
 
-    // Set viewport
+    // The owner of the texture waits for the keyed mutex, so it is released however rendering went
+    hr = RenderTarget(sharedTexture.Get(), targetRect, displays, numDisplays, redactions, numRedactions);
+    HRESULT releaseHr = keyMutex->ReleaseSync(0);
+    if (FAILED(hr) || FAILED(releaseHr))
+        return TakoError::DX11_ERROR;
+
+    return TakoError::OK;
+}
+
+HRESULT Tako::Compositor::RenderTarget(ID3D11Texture2D* target, TakoRect targetRect, TakoDisplayBuffer* displays, uint32_t numDisplays,
+    const TakoRedaction* redactions, uint32_t numRedactions)
+{
+    D3D11_TEXTURE2D_DESC targetDesc;
+    target->GetDesc(&targetDesc);
+
+    D3D11_RENDER_TARGET_VIEW_DESC rtvDesc = {};
+    rtvDesc.Format = targetDesc.Format;
+    rtvDesc.ViewDimension = D3D11_RTV_DIMENSION_TEXTURE2D;
+    rtvDesc.Texture2D.MipSlice = 0;
+
+    wrl::ComPtr<ID3D11RenderTargetView> rtvResource;
+    HRESULT hr = g_GraphicContext->GetDevice()->CreateRenderTargetView(target, &rtvDesc, rtvResource.GetAddressOf());
+    if (FAILED(hr))
+        return hr;
+
+    // Parts of the target not covered by any display stay black
+    FLOAT clearColor[4] = { 0.f, 0.f, 0.f, 1.f };
+    g_GraphicContext->GetDeviceContext()->ClearRenderTargetView(rtvResource.Get(), clearColor);
+
+    FLOAT blendFactor[4] = { 0.f, 0.f, 0.f, 0.f };
+    g_GraphicContext->GetDeviceContext()->OMSetBlendState(nullptr, blendFactor, 0xffffffff);
+    g_GraphicContext->GetDeviceContext()->OMSetRenderTargets(1, rtvResource.GetAddressOf(), nullptr);
+    g_GraphicContext->GetDeviceContext()->VSSetShader(m_VertexShader.Get(), nullptr, 0);
+    g_GraphicContext->GetDeviceContext()->PSSetShader(m_PixelShader.Get(), nullptr, 0);
+    g_GraphicContext->GetDeviceContext()->PSSetSamplers(0, 1, m_Sampler.GetAddressOf());
+    g_GraphicContext->GetDeviceContext()->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+
+    for (uint32_t i = 0; i < numDisplays; ++i)
+    {
+        hr = RenderDisplay(targetRect, displays[i]);
+        if (FAILED(hr))
+            return hr;
+    }
+
+    if (numRedactions > 0)
+    {
+        g_GraphicContext->GetDeviceContext()->PSSetShader(m_RedactionShader.Get(), nullptr, 0);
+        g_GraphicContext->GetDeviceContext()->PSSetConstantBuffers(0, 1, m_RedactionConstants.GetAddressOf());
+    }
+
+    for (uint32_t i = 0; i < numRedactions; ++i)
+    {
+        hr = RenderRedaction(target, rtvResource.Get(), targetRect, redactions[i]);
+        if (FAILED(hr))
+            return hr;
+    }
+
+    return S_OK;
+}
+
+HRESULT Tako::Compositor::RenderDisplay(TakoRect targetRect, const TakoDisplayBuffer& display)
+{
+    // The captured region sits at the origin of a buffer that may be larger than the region
+    D3D11_TEXTURE2D_DESC displayTextureDesc;
+    display.m_Buffer->GetDesc(&displayTextureDesc);
+
+    FLOAT maxU = static_cast<FLOAT>(display.m_DisplayRect.m_Width) / static_cast<FLOAT>(displayTextureDesc.Width);
+    FLOAT maxV = static_cast<FLOAT>(display.m_DisplayRect.m_Height) / static_cast<FLOAT>(displayTextureDesc.Height);
+
+    // Each display is drawn into a viewport matching its position within the target
     D3D11_VIEWPORT vp;
-    vp.Width = static_cast<FLOAT>(displays[0].m_DisplayRect.m_Width);
-    vp.Height = static_cast<FLOAT>(displays[0].m_DisplayRect.m_Height);
+    vp.Width = static_cast<FLOAT>(display.m_DisplayRect.m_Width);
+    vp.Height = static_cast<FLOAT>(display.m_DisplayRect.m_Height);
     vp.MinDepth = 0.0f;
     vp.MaxDepth = 1.0f;
-    vp.TopLeftX = -static_cast<FLOAT>(targetRect.m_X);
-    vp.TopLeftY = -static_cast<FLOAT>(targetRect.m_Y);
-    g_GraphicContext->GetDeviceContext()->RSSetViewports(1, &vp);
+    vp.TopLeftX = static_cast<FLOAT>(display.m_DisplayRect.m_X - targetRect.m_X);
+    vp.TopLeftY = static_cast<FLOAT>(display.m_DisplayRect.m_Y - targetRect.m_Y);
 
-    // Vertices for drawing whole texture
-    DirectX::XMFLOAT3 Pos;
-    DirectX::XMFLOAT2 TexCoord;
+    D3D11_SHADER_RESOURCE_VIEW_DESC srvDesc;
+    srvDesc.Format = displayTextureDesc.Format;
+    srvDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+    srvDesc.Texture2D.MostDetailedMip = displayTextureDesc.MipLevels - 1;
+    srvDesc.Texture2D.MipLevels = displayTextureDesc.MipLevels;
 
-    struct Vertex {
-        DirectX::XMFLOAT3 Pos;
-        DirectX::XMFLOAT2 TexCoord;
-    };
+    ID3D11ShaderResourceView* srvResource = nullptr;
+    HRESULT hr = g_GraphicContext->GetDevice()->CreateShaderResourceView(display.m_Buffer.Get(), &srvDesc, &srvResource);
+    if (FAILED(hr))
+        return hr;
 
-    static constexpr uint32_t NumVertices = 6;
-    Vertex vertices[NumVertices] =
-    {
-        { DirectX::XMFLOAT3(-1.0f, -1.0f, 0), DirectX::XMFLOAT2(0.0f, 1.0f) },
-        { DirectX::XMFLOAT3(-1.0f, 1.0f, 0), DirectX::XMFLOAT2(0.0f, 0.0f) },
-        { DirectX::XMFLOAT3(1.0f, -1.0f, 0), DirectX::XMFLOAT2(1.0f, 1.0f) },
-        { DirectX::XMFLOAT3(1.0f, -1.0f, 0), DirectX::XMFLOAT2(1.0f, 1.0f) },
-        { DirectX::XMFLOAT3(-1.0f, 1.0f, 0), DirectX::XMFLOAT2(0.0f, 0.0f) },
-        { DirectX::XMFLOAT3(1.0f, 1.0f, 0), DirectX::XMFLOAT2(1.0f, 0.0f) },
-    };
+    hr = DrawQuad(vp, maxU, maxV, srvResource);
+    srvResource->Release();
 
-    D3D11_TEXTURE2D_DESC sharedTextureDesc;
-    sharedTexture->GetDesc(&sharedTextureDesc);
+    return hr;
+}
 
-    D3D11_RENDER_TARGET_VIEW_DESC rtvDesc = {};
-    rtvDesc.Format = sharedTextureDesc.Format;
-    rtvDesc.ViewDimension = D3D11_RTV_DIMENSION_TEXTURE2D;
-    rtvDesc.Texture2D.MipSlice = 0;
+HRESULT Tako::Compositor::RenderRedaction(ID3D11Texture2D* target, ID3D11RenderTargetView* targetView, TakoRect targetRect, const TakoRedaction& redaction)
+{
+    TakoRect rect = redaction.m_Rect.Intersect(targetRect);
+    if (rect.IsEmpty())
+        return S_OK;
+
+    UINT left = static_cast<UINT>(rect.m_X - targetRect.m_X);
+    UINT top = static_cast<UINT>(rect.m_Y - targetRect.m_Y);
+
+    RedactionConstants constants = {};
+    constants.m_FillColor = DirectX::XMFLOAT4(
+        static_cast<float>((redaction.m_Color >> 16) & 0xFF) / 255.f,
+        static_cast<float>((redaction.m_Color >> 8) & 0xFF) / 255.f,
+        static_cast<float>(redaction.m_Color & 0xFF) / 255.f,
+        static_cast<float>((redaction.m_Color >> 24) & 0xFF) / 255.f);
+    constants.m_Size = DirectX::XMINT2(static_cast<int32_t>(rect.m_Width), static_cast<int32_t>(rect.m_Height));
+    constants.m_Strength = redaction.m_Strength;
+    constants.m_Mode = static_cast<uint32_t>(redaction.m_Mode);
 
-    ID3D11RenderTargetView* rtvResource = nullptr;
-    hr = g_GraphicContext->GetDevice()->CreateRenderTargetView(sharedTexture, &rtvDesc, &rtvResource);
+    D3D11_VIEWPORT vp;
+    vp.Width = static_cast<FLOAT>(rect.m_Width);
+    vp.Height = static_cast<FLOAT>(rect.m_Height);
+    vp.MinDepth = 0.0f;
+    vp.MaxDepth = 1.0f;
+    vp.TopLeftX = static_cast<FLOAT>(left);
+    vp.TopLeftY = static_cast<FLOAT>(top);
+
+    if (redaction.m_Mode == TakoRedactionMode::FILL)
+    {
+        g_GraphicContext->GetDeviceContext()->UpdateSubresource(m_RedactionConstants.Get(), 0, nullptr, &constants, 0, 0);
+        return DrawQuad(vp, 1.f, 1.f, nullptr);
+    }
+
+    D3D11_TEXTURE2D_DESC targetDesc;
+    target->GetDesc(&targetDesc);
+
+    HRESULT hr = PrepareRedactionTextures(targetDesc.Format, rect.m_Width, rect.m_Height);
     if (FAILED(hr))
-        return TakoError::DX11_ERROR;
+        return hr;
+
+    // The target cannot be sampled while it is bound for rendering, so the composited pixels are copied out first
+    D3D11_BOX box = { left, top, 0, left + rect.m_Width, top + rect.m_Height, 1 };
+    g_GraphicContext->GetDeviceContext()->CopySubresourceRegion(m_RedactionTexture.Get(), 0, 0, 0, 0, target, 0, &box);
+
+    // Vertical pass from the copy into the intermediate texture
+    D3D11_TEXTURE2D_DESC sourceDesc;
+    m_RedactionTexture->GetDesc(&sourceDesc);
 
     D3D11_SHADER_RESOURCE_VIEW_DESC srvDesc;
-    srvDesc.Format = sharedTextureDesc.Format;
+    srvDesc.Format = sourceDesc.Format;
     srvDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
-    srvDesc.Texture2D.MostDetailedMip = sharedTextureDesc.MipLevels - 1;
-    srvDesc.Texture2D.MipLevels = sharedTextureDesc.MipLevels;
+    srvDesc.Texture2D.MostDetailedMip = 0;
+    srvDesc.Texture2D.MipLevels = 1;
 
     ID3D11ShaderResourceView* srvResource = nullptr;
-    hr = g_GraphicContext->GetDevice()->CreateShaderResourceView(displays[0].m_Buffer.Get(), &srvDesc, &srvResource);
+    hr = g_GraphicContext->GetDevice()->CreateShaderResourceView(m_RedactionTexture.Get(), &srvDesc, &srvResource);
     if (FAILED(hr))
-        return TakoError::DX11_ERROR;
+        return hr;
 
-    UINT stride = sizeof(Vertex);
-    UINT offset = 0;
-    FLOAT blendFactor[4] = { 0.f, 0.f, 0.f, 0.f };
-    g_GraphicContext->GetDeviceContext()->OMSetBlendState(nullptr, blendFactor, 0xffffffff);
-    g_GraphicContext->GetDeviceContext()->OMSetRenderTargets(1, &rtvResource, nullptr);
-    g_GraphicContext->GetDeviceContext()->VSSetShader(m_VertexShader.Get(), nullptr, 0);
-    g_GraphicContext->GetDeviceContext()->PSSetShader(m_PixelShader.Get(), nullptr, 0);
-    g_GraphicContext->GetDeviceContext()->PSSetShaderResources(0, 1, &srvResource);
-    g_GraphicContext->GetDeviceContext()->PSSetSamplers(0, 1, m_Sampler.GetAddressOf());
-    g_GraphicContext->GetDeviceContext()->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    constants.m_Axis = DirectX::XMINT2(0, 1);
+    constants.m_SourceSize = DirectX::XMFLOAT2(static_cast<float>(sourceDesc.Width), static_cast<float>(sourceDesc.Height));
+    constants.m_Quantize = redaction.m_Mode == TakoRedactionMode::BLUR;
+    g_GraphicContext->GetDeviceContext()->UpdateSubresource(m_RedactionConstants.Get(), 0, nullptr, &constants, 0, 0);
+
+    // The intermediate texture may still be bound as the source of the previous redaction
+    ID3D11ShaderResourceView* nullSrv = nullptr;
+    g_GraphicContext->GetDeviceContext()->PSSetShaderResources(0, 1, &nullSrv);
+    g_GraphicContext->GetDeviceContext()->OMSetRenderTargets(1, m_RedactionPassTarget.GetAddressOf(), nullptr);
+
+    D3D11_VIEWPORT passVp = vp;
+    passVp.TopLeftX = 0.0f;
+    passVp.TopLeftY = 0.0f;
+
+    hr = DrawQuad(passVp, static_cast<FLOAT>(rect.m_Width) / sourceDesc.Width, static_cast<FLOAT>(rect.m_Height) / sourceDesc.Height, srvResource);
+    srvResource->Release();
+    if (FAILED(hr))
+        return hr;
+
+    // Horizontal pass from the intermediate texture into the target
+    D3D11_TEXTURE2D_DESC passDesc;
+    m_RedactionPassTexture->GetDesc(&passDesc);
+
+    srvDesc.Format = passDesc.Format;
+    hr = g_GraphicContext->GetDevice()->CreateShaderResourceView(m_RedactionPassTexture.Get(), &srvDesc, &srvResource);
+    if (FAILED(hr))
+        return hr;
+
+    constants.m_Axis = DirectX::XMINT2(1, 0);
+    constants.m_SourceSize = DirectX::XMFLOAT2(static_cast<float>(passDesc.Width), static_cast<float>(passDesc.Height));
+    constants.m_Quantize = 0;
+    g_GraphicContext->GetDeviceContext()->UpdateSubresource(m_RedactionConstants.Get(), 0, nullptr, &constants, 0, 0);
+    g_GraphicContext->GetDeviceContext()->OMSetRenderTargets(1, &targetView, nullptr);
+
+    hr = DrawQuad(vp, static_cast<FLOAT>(rect.m_Width) / passDesc.Width, static_cast<FLOAT>(rect.m_Height) / passDesc.Height, srvResource);
+    srvResource->Release();
+
+    return hr;
+}
+
+HRESULT Tako::Compositor::PrepareRedactionTextures(DXGI_FORMAT format, uint32_t width, uint32_t height)
+{
+    HRESULT hr;
+
+    hr = PrepareTexture(&m_RedactionTexture, format, D3D11_BIND_SHADER_RESOURCE, width, height);
+    if (FAILED(hr))
+        return hr;
+
+    // Averages are kept at full precision between the passes
+    wrl::ComPtr<ID3D11Texture2D> passTexture = m_RedactionPassTexture;
+    hr = PrepareTexture(&m_RedactionPassTexture, DXGI_FORMAT_R32G32B32A32_FLOAT, D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET, width, height);
+    if (FAILED(hr))
+        return hr;
+
+    if (m_RedactionPassTexture == passTexture && m_RedactionPassTarget != nullptr)
+        return S_OK;
+
+    m_RedactionPassTarget.Reset();
+    return g_GraphicContext->GetDevice()->CreateRenderTargetView(m_RedactionPassTexture.Get(), nullptr, &m_RedactionPassTarget);
+}
+
+HRESULT Tako::Compositor::PrepareTexture(wrl::ComPtr<ID3D11Texture2D>* texture, DXGI_FORMAT format, UINT bindFlags, uint32_t width, uint32_t height)
+{
+    if (*texture)
+    {
+        D3D11_TEXTURE2D_DESC desc;
+        (*texture)->GetDesc(&desc);
+
+        if (desc.Format == format && desc.Width >= width && desc.Height >= height)
+            return S_OK;
+
+        if (desc.Format == format)
+        {
+            width = std::max(width, static_cast<uint32_t>(desc.Width));
+            height = std::max(height, static_cast<uint32_t>(desc.Height));
+        }
+    }
+
+    D3D11_TEXTURE2D_DESC desc;
+    RtlZeroMemory(&desc, sizeof(desc));
+    desc.Width = width;
+    desc.Height = height;
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Format = format;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = bindFlags;
+
+    texture->Reset();
+    return g_GraphicContext->GetDevice()->CreateTexture2D(&desc, nullptr, texture->GetAddressOf());
+}
+
+HRESULT Tako::Compositor::DrawQuad(const D3D11_VIEWPORT& viewport, FLOAT maxU, FLOAT maxV, ID3D11ShaderResourceView* srv)
+{
+    g_GraphicContext->GetDeviceContext()->RSSetViewports(1, &viewport);
+
+    struct Vertex {
+        DirectX::XMFLOAT3 Pos;
+        DirectX::XMFLOAT2 TexCoord;
+    };
+
+    static constexpr uint32_t NumVertices = 6;
+    Vertex vertices[NumVertices] =
+    {
+        { DirectX::XMFLOAT3(-1.0f, -1.0f, 0), DirectX::XMFLOAT2(0.0f, maxV) },
+        { DirectX::XMFLOAT3(-1.0f, 1.0f, 0), DirectX::XMFLOAT2(0.0f, 0.0f) },
+        { DirectX::XMFLOAT3(1.0f, -1.0f, 0), DirectX::XMFLOAT2(maxU, maxV) },
+        { DirectX::XMFLOAT3(1.0f, -1.0f, 0), DirectX::XMFLOAT2(maxU, maxV) },
+        { DirectX::XMFLOAT3(-1.0f, 1.0f, 0), DirectX::XMFLOAT2(0.0f, 0.0f) },
+        { DirectX::XMFLOAT3(1.0f, 1.0f, 0), DirectX::XMFLOAT2(maxU, 0.0f) },
+    };
 
     D3D11_BUFFER_DESC bufferDesc;
     RtlZeroMemory(&bufferDesc, sizeof(bufferDesc));
@@ -148,26 +374,118 @@ Tako::TakoError Tako::Compositor::RenderComposite(HANDLE sharedTextureHandle, Ta
 
     // Create vertex buffer
     ID3D11Buffer* vertexBuffer = nullptr;
-    hr = g_GraphicContext->GetDevice()->CreateBuffer(&bufferDesc, &initData, &vertexBuffer);
+    HRESULT hr = g_GraphicContext->GetDevice()->CreateBuffer(&bufferDesc, &initData, &vertexBuffer);
     if (FAILED(hr))
-        return TakoError::DX11_ERROR;
+        return hr;
 
+    UINT stride = sizeof(Vertex);
+    UINT offset = 0;
+    g_GraphicContext->GetDeviceContext()->PSSetShaderResources(0, 1, &srv);
     g_GraphicContext->GetDeviceContext()->IASetVertexBuffers(0, 1, &vertexBuffer, &stride, &offset);
 
     // Draw textured quad onto render target
     g_GraphicContext->GetDeviceContext()->Draw(NumVertices, 0);
 
-    // Release keyed mutex
-    hr = keyMutex->ReleaseSync(0);
-    if (FAILED(hr))
-        return TakoError::DX11_ERROR;
-
-    srvResource->Release();
-    rtvResource->Release();
     vertexBuffer->Release();
-    sharedTexture->Release();
-    keyMutex->Release();
 
+    return S_OK;
+}
+
+Tako::TakoError Tako::Compositor::RenderCompositeCpu(const TakoFrameView& target, const TakoFrameView* displays, uint32_t numDisplays,
+    const TakoRedaction* redactions, uint32_t numRedactions)
+{
+    static constexpr uint32_t FillColor = 0xFF000000;
+
+    if (GetBytesPerPixel(target.m_Format) != sizeof(uint32_t))
+        return TakoError::NOT_SUPPORTED;
+
+    struct Source
+    {
+        TakoFrameView m_View;
+        bool m_Swizzle;
+    };
+
+    Source sources[MaxNumDisplays];
+    uint32_t numSources = 0;
+
+    for (uint32_t i = 0; i < numDisplays && numSources < MaxNumDisplays; ++i)
+    {
+        TakoError err = CropFrameView(displays[i], target.m_Rect, &sources[numSources].m_View);
+        if (err == TakoError::INVALID_ARGUMENT)
+            continue;
+
+        if (err != TakoError::OK)
+            return err;
+
+        err = GetConversion(sources[numSources].m_View.m_Format, target.m_Format, &sources[numSources].m_Swizzle);
+        if (err != TakoError::OK)
+            return err;
+
+        numSources++;
+    }
+
+    // Walking sources left to right lets each row fill the gaps between them in a single pass
+    std::sort(sources, sources + numSources, [](const Source& a, const Source& b) { return a.m_View.m_Rect.m_X < b.m_View.m_Rect.m_X; });
+
+    const PixelKernelTable& kernels = GetPixelKernels();
+    const uint32_t width = target.m_Rect.m_Width;
+
+    g_ThreadPool->ParallelFor(target.m_Rect.m_Height, GetBandHeight(width * sizeof(uint32_t)), [&](uint32_t begin, uint32_t end)
+    {
+        for (uint32_t y = begin; y < end; ++y)
+        {
+            uint32_t* dstRow = reinterpret_cast<uint32_t*>(target.m_Data + static_cast<size_t>(y) * target.m_Pitch);
+            int32_t desktopY = target.m_Rect.m_Y + static_cast<int32_t>(y);
+            uint32_t filledUntil = 0;
+
+            for (uint32_t i = 0; i < numSources; ++i)
+            {
+                const TakoRect& srcRect = sources[i].m_View.m_Rect;
+                if (desktopY < srcRect.m_Y || desktopY >= srcRect.m_Y + static_cast<int32_t>(srcRect.m_Height))
+                    continue;
+
+                uint32_t dstX = static_cast<uint32_t>(srcRect.m_X - target.m_Rect.m_X);
+                const uint32_t* srcRow = reinterpret_cast<const uint32_t*>(sources[i].m_View.m_Data + static_cast<size_t>(desktopY - srcRect.m_Y) * sources[i].m_View.m_Pitch);
+
+                if (sources[i].m_Swizzle)
+                    kernels.m_SwizzleRow(dstRow + dstX, srcRow, srcRect.m_Width);
+                else
+                    kernels.m_CopyRow(dstRow + dstX, srcRow, srcRect.m_Width);
+
+                // Only the gaps between displays are filled so covered pixels are written once
+                if (dstX > filledUntil)
+                    kernels.m_FillRow(dstRow + filledUntil, FillColor, dstX - filledUntil);
+
+                filledUntil = std::max(filledUntil, dstX + srcRect.m_Width);
+            }
+
+            if (filledUntil < width)
+                kernels.m_FillRow(dstRow + filledUntil, FillColor, width - filledUntil);
+        }
+    });
+
+    if (numRedactions == 0)
+        return TakoError::OK;
+
+    return m_Redactor.Apply(target, redactions, numRedactions);
+}
+
+Tako::TakoError Tako::Compositor::PrepareDeviceState()
+{
+    TakoError err;
+
+    if (m_DeviceStateReady)
+        return TakoError::OK;
+
+    err = InitializeSampler();
+    if (err != TakoError::OK)
+        return err;
+
+    err = InitializeShaders();
+    if (err != TakoError::OK)
+        return err;
+
+    m_DeviceStateReady = true;
     return TakoError::OK;
 }
 
@@ -217,6 +535,21 @@ Tako::TakoError Tako::Compositor::InitializeShaders()
     if (FAILED(hr))
         return TakoError::DX11_ERROR;
 
+    size = ARRAYSIZE(g_PS_Redact);
+    hr = g_GraphicContext->GetDevice()->CreatePixelShader(g_PS_Redact, size, nullptr, &m_RedactionShader);
+    if (FAILED(hr))
+        return TakoError::DX11_ERROR;
+
+    D3D11_BUFFER_DESC constantsDesc;
+    RtlZeroMemory(&constantsDesc, sizeof(constantsDesc));
+    constantsDesc.Usage = D3D11_USAGE_DEFAULT;
+    constantsDesc.ByteWidth = sizeof(RedactionConstants);
+    constantsDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+
+    hr = g_GraphicContext->GetDevice()->CreateBuffer(&constantsDesc, nullptr, &m_RedactionConstants);
+    if (FAILED(hr))
+        return TakoError::DX11_ERROR;
+
     return TakoError::OK;
 }
 
@@ -20,6 +20,7 @@
 #pragma once
 
 #include "common.h"
+#include "redactor.h"
 
 namespace Tako
 {
@@ -33,9 +34,25 @@ namespace Tako
         TakoError Shutdown();
 
     public:
-        TakoError RenderComposite(HANDLE outTexture, TakoRect targetRect, TakoDisplayBuffer* displays, uint32_t numDisplays = 1);
+        // Redactions are drawn over the composited displays, see TakoRedaction
+        TakoError RenderComposite(HANDLE outTexture, TakoRect targetRect, TakoDisplayBuffer* displays, uint32_t numDisplays = 1,
+            const TakoRedaction* redactions = nullptr, uint32_t numRedactions = 0);
+
+        // CPU counterpart of RenderComposite. Row bands of target are composited in parallel and areas
+        // not covered by any display are filled with opaque black.
+        TakoError RenderCompositeCpu(const TakoFrameView& target, const TakoFrameView* displays, uint32_t numDisplays,
+            const TakoRedaction* redactions = nullptr, uint32_t numRedactions = 0);
 
     private:
+        // Draws everything into target, expects its keyed mutex to be held
+        HRESULT RenderTarget(ID3D11Texture2D* target, TakoRect targetRect, TakoDisplayBuffer* displays, uint32_t numDisplays,
+            const TakoRedaction* redactions, uint32_t numRedactions);
+        HRESULT RenderDisplay(TakoRect targetRect, const TakoDisplayBuffer& display);
+        HRESULT RenderRedaction(ID3D11Texture2D* target, ID3D11RenderTargetView* targetView, TakoRect targetRect, const TakoRedaction& redaction);
+        HRESULT DrawQuad(const D3D11_VIEWPORT& viewport, FLOAT maxU, FLOAT maxV, ID3D11ShaderResourceView* srv);
+        HRESULT PrepareRedactionTextures(DXGI_FORMAT format, uint32_t width, uint32_t height);
+        HRESULT PrepareTexture(wrl::ComPtr<ID3D11Texture2D>* texture, DXGI_FORMAT format, UINT bindFlags, uint32_t width, uint32_t height);
+        TakoError PrepareDeviceState();
         TakoError InitializeSampler();
         TakoError InitializeShaders();
 
@@ -44,6 +61,14 @@ namespace Tako
         wrl::ComPtr<ID3D11VertexShader> m_VertexShader;
         wrl::ComPtr<ID3D11PixelShader> m_PixelShader;
         wrl::ComPtr<ID3D11InputLayout> m_InputLayout;
+
+        wrl::ComPtr<ID3D11PixelShader> m_RedactionShader;
+        wrl::ComPtr<ID3D11Buffer> m_RedactionConstants;
+        wrl::ComPtr<ID3D11Texture2D> m_RedactionTexture; // Copy of the pixels under a redaction, only grows
+        wrl::ComPtr<ID3D11Texture2D> m_RedactionPassTexture; // Result of the vertical pass, only grows
+        wrl::ComPtr<ID3D11RenderTargetView> m_RedactionPassTarget;
+        Redactor m_Redactor;
+        bool m_DeviceStateReady = false;
     };
 }
 
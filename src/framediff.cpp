@@ -0,0 +1,100 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "framediff.h"
+#include "frameview.h"
+#include "pixelkernels.h"
+#include "threadpool.h"
+
+extern Tako::ThreadPool* g_ThreadPool;
+
+Tako::TakoError Tako::DiffFrameViews(const TakoFrameView& current, const TakoFrameView& previous, uint32_t tileSize, std::vector<TakoRect>* outDirtyRects)
+{
+    if (!(current.m_Rect == previous.m_Rect) || current.m_Format != previous.m_Format || tileSize == 0)
+        return TakoError::INVALID_ARGUMENT;
+
+    if (GetBytesPerPixel(current.m_Format) != sizeof(uint32_t))
+        return TakoError::NOT_SUPPORTED;
+
+    const PixelKernelTable& kernels = GetPixelKernels();
+
+    DiffTiles(current.m_Rect, tileSize, [&](uint32_t y, uint32_t begin, uint32_t end)
+    {
+        const uint32_t* currentRow = reinterpret_cast<const uint32_t*>(current.m_Data + static_cast<size_t>(y) * current.m_Pitch);
+        const uint32_t* previousRow = reinterpret_cast<const uint32_t*>(previous.m_Data + static_cast<size_t>(y) * previous.m_Pitch);
+        return kernels.m_RowsEqual(currentRow + begin, previousRow + begin, end - begin);
+    }, outDirtyRects);
+
+    return TakoError::OK;
+}
+
+void Tako::DiffTiles(TakoRect rect, uint32_t tileSize, const SpanEqualFunction& spanEqual, std::vector<TakoRect>* outDirtyRects)
+{
+    const uint32_t width = rect.m_Width;
+    const uint32_t height = rect.m_Height;
+    const uint32_t numTilesX = (width + tileSize - 1) / tileSize;
+    const uint32_t numTilesY = (height + tileSize - 1) / tileSize;
+
+    std::vector<uint8_t> dirtyTiles(static_cast<size_t>(numTilesX) * numTilesY, 0);
+
+    g_ThreadPool->ParallelFor(numTilesY, 1, [&](uint32_t begin, uint32_t end)
+    {
+        for (uint32_t tileY = begin; tileY < end; ++tileY)
+        {
+            uint8_t* dirtyRow = dirtyTiles.data() + static_cast<size_t>(tileY) * numTilesX;
+            uint32_t rowEnd = std::min(height, (tileY + 1) * tileSize);
+
+            for (uint32_t y = tileY * tileSize; y < rowEnd; ++y)
+            {
+                for (uint32_t tileX = 0; tileX < numTilesX; ++tileX)
+                {
+                    // A single differing pixel settles the whole tile
+                    if (dirtyRow[tileX])
+                        continue;
+
+                    uint32_t x = tileX * tileSize;
+                    if (!spanEqual(y, x, std::min(width, x + tileSize)))
+                        dirtyRow[tileX] = 1;
+                }
+            }
+        }
+    });
+
+    for (uint32_t tileY = 0; tileY < numTilesY; ++tileY)
+    {
+        const uint8_t* dirtyRow = dirtyTiles.data() + static_cast<size_t>(tileY) * numTilesX;
+
+        for (uint32_t tileX = 0; tileX < numTilesX; ++tileX)
+        {
+            if (!dirtyRow[tileX])
+                continue;
+
+            uint32_t runStart = tileX;
+            while (tileX + 1 < numTilesX && dirtyRow[tileX + 1])
+                tileX++;
+
+            TakoRect dirtyRect;
+            dirtyRect.m_X = rect.m_X + static_cast<int32_t>(runStart * tileSize);
+            dirtyRect.m_Y = rect.m_Y + static_cast<int32_t>(tileY * tileSize);
+            dirtyRect.m_Width = std::min(width, (tileX + 1) * tileSize) - runStart * tileSize;
+            dirtyRect.m_Height = std::min(height, (tileY + 1) * tileSize) - tileY * tileSize;
+            outDirtyRects->push_back(dirtyRect);
+        }
+    }
+}
@@ -0,0 +1,39 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+#include <functional>
+
+namespace Tako
+{
+    static constexpr uint32_t DiffTileSize = 64;
+
+    // Reports whether row y of a compared rect, relative to its top, is unchanged over columns [begin, end)
+    using SpanEqualFunction = std::function<bool(uint32_t y, uint32_t begin, uint32_t end)>;
+
+    // Tiles rect and asks spanEqual about each tile row by row until one differs. Horizontal runs of changed
+    // tiles are merged and appended to outDirtyRects in desktop coordinates, top to bottom.
+    void DiffTiles(TakoRect rect, uint32_t tileSize, const SpanEqualFunction& spanEqual, std::vector<TakoRect>* outDirtyRects);
+
+    // Compares two views covering the same rect tile by tile. Horizontal runs of changed tiles
+    // are merged and appended to outDirtyRects in desktop coordinates, top to bottom.
+    TakoError DiffFrameViews(const TakoFrameView& current, const TakoFrameView& previous, uint32_t tileSize, std::vector<TakoRect>* outDirtyRects);
+}
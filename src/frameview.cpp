@@ -0,0 +1,165 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "frameview.h"
+#include "pixelkernels.h"
+#include "threadpool.h"
+
+extern Tako::ThreadPool* g_ThreadPool;
+
+uint32_t Tako::GetBytesPerPixel(DXGI_FORMAT format)
+{
+    switch (format)
+    {
+    case DXGI_FORMAT_B8G8R8A8_UNORM:
+    case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB:
+    case DXGI_FORMAT_R8G8B8A8_UNORM:
+    case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:
+    case DXGI_FORMAT_R10G10B10A2_UNORM:
+        return 4;
+    case DXGI_FORMAT_R16G16B16A16_FLOAT:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+Tako::TakoError Tako::GetConversion(DXGI_FORMAT srcFormat, DXGI_FORMAT dstFormat, bool* outSwizzle)
+{
+    auto isBgra = [](DXGI_FORMAT format) { return format == DXGI_FORMAT_B8G8R8A8_UNORM || format == DXGI_FORMAT_B8G8R8A8_UNORM_SRGB; };
+    auto isRgba = [](DXGI_FORMAT format) { return format == DXGI_FORMAT_R8G8B8A8_UNORM || format == DXGI_FORMAT_R8G8B8A8_UNORM_SRGB; };
+
+    if ((isBgra(srcFormat) && isRgba(dstFormat)) || (isRgba(srcFormat) && isBgra(dstFormat)))
+        *outSwizzle = true;
+    else if (srcFormat == dstFormat)
+        *outSwizzle = false;
+    else
+        return TakoError::NOT_SUPPORTED;
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::CropFrameView(const TakoFrameView& view, TakoRect cropRect, TakoFrameView* out)
+{
+    uint32_t bytesPerPixel = GetBytesPerPixel(view.m_Format);
+    if (bytesPerPixel == 0)
+        return TakoError::NOT_SUPPORTED;
+
+    TakoRect rect = view.m_Rect.Intersect(cropRect);
+    if (rect.IsEmpty())
+        return TakoError::INVALID_ARGUMENT;
+
+    uint32_t offsetX = static_cast<uint32_t>(rect.m_X - view.m_Rect.m_X);
+    uint32_t offsetY = static_cast<uint32_t>(rect.m_Y - view.m_Rect.m_Y);
+
+    out->m_Data = view.m_Data + static_cast<size_t>(offsetY) * view.m_Pitch + static_cast<size_t>(offsetX) * bytesPerPixel;
+    out->m_Pitch = view.m_Pitch;
+    out->m_Format = view.m_Format;
+    out->m_Rect = rect;
+    out->m_Generation = view.m_Generation;
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::SplitFrameView(const TakoFrameView& view, uint32_t tileWidth, uint32_t tileHeight, std::vector<TakoFrameView>* out)
+{
+    if (tileWidth == 0 || tileHeight == 0)
+        return TakoError::INVALID_ARGUMENT;
+
+    out->clear();
+
+    for (uint32_t y = 0; y < view.m_Rect.m_Height; y += tileHeight)
+    {
+        for (uint32_t x = 0; x < view.m_Rect.m_Width; x += tileWidth)
+        {
+            TakoRect tileRect;
+            tileRect.m_X = view.m_Rect.m_X + static_cast<int32_t>(x);
+            tileRect.m_Y = view.m_Rect.m_Y + static_cast<int32_t>(y);
+            tileRect.m_Width = std::min(tileWidth, view.m_Rect.m_Width - x);
+            tileRect.m_Height = std::min(tileHeight, view.m_Rect.m_Height - y);
+
+            TakoFrameView tile;
+            TakoError err = CropFrameView(view, tileRect, &tile);
+            if (err != TakoError::OK)
+                return err;
+
+            out->push_back(tile);
+        }
+    }
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::CopyFrameView(const TakoFrameView& view, void* dst, uint32_t dstPitch)
+{
+    uint32_t rowSize = view.m_Rect.m_Width * GetBytesPerPixel(view.m_Format);
+    if (rowSize == 0)
+        return TakoError::NOT_SUPPORTED;
+
+    if (dst == nullptr || dstPitch < rowSize)
+        return TakoError::INVALID_ARGUMENT;
+
+    uint8_t* dstRow = static_cast<uint8_t*>(dst);
+    const uint8_t* srcRow = view.m_Data;
+
+    // Tightly packed on both ends, the whole view is one contiguous block
+    if (view.m_Pitch == rowSize && dstPitch == rowSize)
+    {
+        memcpy(dstRow, srcRow, static_cast<size_t>(rowSize) * view.m_Rect.m_Height);
+        return TakoError::OK;
+    }
+
+    for (uint32_t y = 0; y < view.m_Rect.m_Height; ++y)
+    {
+        memcpy(dstRow, srcRow, rowSize);
+        dstRow += dstPitch;
+        srcRow += view.m_Pitch;
+    }
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::ConvertFrameView(const TakoFrameView& view, DXGI_FORMAT dstFormat, void* dst, uint32_t dstPitch)
+{
+    bool swizzle;
+    TakoError err = GetConversion(view.m_Format, dstFormat, &swizzle);
+    if (err != TakoError::OK)
+        return err;
+
+    if (!swizzle)
+        return CopyFrameView(view, dst, dstPitch);
+
+    if (dst == nullptr || dstPitch < view.m_Rect.m_Width * sizeof(uint32_t))
+        return TakoError::INVALID_ARGUMENT;
+
+    const PixelKernelTable& kernels = GetPixelKernels();
+    uint32_t bandHeight = GetBandHeight(view.m_Rect.m_Width * sizeof(uint32_t));
+
+    g_ThreadPool->ParallelFor(view.m_Rect.m_Height, bandHeight, [&](uint32_t begin, uint32_t end)
+    {
+        for (uint32_t y = begin; y < end; ++y)
+        {
+            uint8_t* dstRow = static_cast<uint8_t*>(dst) + static_cast<size_t>(y) * dstPitch;
+            const uint8_t* srcRow = view.m_Data + static_cast<size_t>(y) * view.m_Pitch;
+            kernels.m_SwizzleRow(reinterpret_cast<uint32_t*>(dstRow), reinterpret_cast<const uint32_t*>(srcRow), view.m_Rect.m_Width);
+        }
+    });
+
+    return TakoError::OK;
+}
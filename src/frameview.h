@@ -0,0 +1,50 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+
+namespace Tako
+{
+    inline TakoRect ToTakoRect(const RECT& rect)
+    {
+        return { static_cast<int32_t>(rect.left), static_cast<int32_t>(rect.top),
+            static_cast<uint32_t>(rect.right - rect.left), static_cast<uint32_t>(rect.bottom - rect.top) };
+    }
+
+    uint32_t GetBytesPerPixel(DXGI_FORMAT format);
+
+    // Reports whether copying between the formats needs the R and B channels swapped. Fails with NOT_SUPPORTED
+    // for pairs that are neither identical nor 8-bit BGRA/RGBA counterparts.
+    TakoError GetConversion(DXGI_FORMAT srcFormat, DXGI_FORMAT dstFormat, bool* outSwizzle);
+
+    // Narrows a view to the part that overlaps cropRect without touching any pixels
+    TakoError CropFrameView(const TakoFrameView& view, TakoRect cropRect, TakoFrameView* out);
+
+    // Splits a view into tiles of at most tileWidth x tileHeight. Passing the view width as
+    // tileWidth yields row bands. Like cropping, no pixels are copied.
+    TakoError SplitFrameView(const TakoFrameView& view, uint32_t tileWidth, uint32_t tileHeight, std::vector<TakoFrameView>* out);
+
+    // The only place pixels leave a view; dst must hold view.m_Rect.m_Height rows of dstPitch bytes
+    TakoError CopyFrameView(const TakoFrameView& view, void* dst, uint32_t dstPitch);
+
+    // Copies while converting between 8-bit BGRA and RGBA layouts
+    TakoError ConvertFrameView(const TakoFrameView& view, DXGI_FORMAT dstFormat, void* dst, uint32_t dstPitch);
+}
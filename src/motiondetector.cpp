@@ -0,0 +1,362 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "motiondetector.h"
+#include "framediff.h"
+#include "frameview.h"
+#include "pixelkernels.h"
+#include "threadpool.h"
+
+extern Tako::ThreadPool* g_ThreadPool;
+
+Tako::TakoError Tako::MotionDetector::Detect(const TakoFrameView& current, const TakoFrameView& previous,
+    std::vector<DXGI_OUTDUPL_MOVE_RECT>* outMoveRects, std::vector<RECT>* outDirtyRects)
+{
+    if (!(current.m_Rect == previous.m_Rect) || current.m_Format != previous.m_Format)
+        return TakoError::INVALID_ARGUMENT;
+
+    if (GetBytesPerPixel(current.m_Format) != sizeof(uint32_t))
+        return TakoError::NOT_SUPPORTED;
+
+    uint32_t previousSlot = IsCached(m_Hashes[1], previous) ? 1 : 0;
+    if (!IsCached(m_Hashes[previousSlot], previous))
+        ComputeHashes(previous, &m_Hashes[previousSlot]);
+
+    uint32_t currentSlot = previousSlot ^ 1;
+    if (!IsCached(m_Hashes[currentSlot], current))
+        ComputeHashes(current, &m_Hashes[currentSlot]);
+
+    const FrameHashes& previousHashes = m_Hashes[previousSlot];
+    const FrameHashes& currentHashes = m_Hashes[currentSlot];
+
+    const uint32_t width = current.m_Rect.m_Width;
+    const uint32_t height = current.m_Rect.m_Height;
+    const uint32_t numStrips = (width + StripWidth - 1) / StripWidth;
+    const uint32_t numBands = (height + BandHeight - 1) / BandHeight;
+
+    std::vector<std::vector<Shift>> verticalShifts(numStrips);
+    std::vector<std::vector<Shift>> horizontalShifts(numBands);
+
+    g_ThreadPool->ParallelFor(numStrips + numBands, 1, [&](uint32_t begin, uint32_t end)
+    {
+        for (uint32_t i = begin; i < end; ++i)
+        {
+            if (i < numStrips)
+            {
+                size_t offset = static_cast<size_t>(i) * height;
+                FindShifts(previousHashes.m_RowHashes.data() + offset, currentHashes.m_RowHashes.data() + offset, height, &verticalShifts[i]);
+            }
+            else
+            {
+                size_t offset = static_cast<size_t>(i - numStrips) * width;
+                FindShifts(previousHashes.m_ColumnHashes.data() + offset, currentHashes.m_ColumnHashes.data() + offset, width, &horizontalShifts[i - numStrips]);
+            }
+        }
+    });
+
+    outMoveRects->clear();
+    AppendMoves(verticalShifts.data(), numStrips, StripWidth, width, true, current.m_Rect, outMoveRects);
+    size_t numVerticalMoves = outMoveRects->size();
+
+    std::vector<DXGI_OUTDUPL_MOVE_RECT> horizontalMoves;
+    AppendMoves(horizontalShifts.data(), numBands, BandHeight, height, false, current.m_Rect, &horizontalMoves);
+
+    // Vertical scrolling is far more common, so it wins wherever the two disagree
+    for (const DXGI_OUTDUPL_MOVE_RECT& move : horizontalMoves)
+    {
+        bool overlaps = false;
+        for (size_t i = 0; i < numVerticalMoves && !overlaps; ++i)
+        {
+            const RECT& other = (*outMoveRects)[i].DestinationRect;
+            overlaps = move.DestinationRect.left < other.right && other.left < move.DestinationRect.right &&
+                move.DestinationRect.top < other.bottom && other.top < move.DestinationRect.bottom;
+        }
+
+        if (!overlaps)
+            outMoveRects->push_back(move);
+    }
+
+    outDirtyRects->clear();
+    FindResidual(current, previous, *outMoveRects, outDirtyRects);
+
+    return TakoError::OK;
+}
+
+bool Tako::MotionDetector::IsCached(const FrameHashes& hashes, const TakoFrameView& view)
+{
+    // Views without a generation cannot be told apart and are always rehashed
+    return view.m_Generation != 0 && hashes.m_Generation == view.m_Generation &&
+        hashes.m_Rect == view.m_Rect && hashes.m_CpuLevel == GetSelectedCpuLevel();
+}
+
+void Tako::MotionDetector::ComputeHashes(const TakoFrameView& view, FrameHashes* out)
+{
+    const uint32_t width = view.m_Rect.m_Width;
+    const uint32_t height = view.m_Rect.m_Height;
+    const uint32_t numStrips = (width + StripWidth - 1) / StripWidth;
+    const uint32_t numBands = (height + BandHeight - 1) / BandHeight;
+
+    out->m_Generation = view.m_Generation;
+    out->m_Rect = view.m_Rect;
+    out->m_CpuLevel = GetSelectedCpuLevel();
+    out->m_RowHashes.resize(static_cast<size_t>(numStrips) * height);
+    out->m_ColumnHashes.resize(static_cast<size_t>(numBands) * width);
+
+    const PixelKernelTable& kernels = GetPixelKernels();
+
+    // Each tile where a strip crosses a band hashes its rows for the strip and its columns for the band in one
+    // pass over its pixels. Tiles rather than whole bands keep the pool busy on frames with few bands.
+    g_ThreadPool->ParallelFor(numBands * numStrips, 1, [&](uint32_t begin, uint32_t end)
+    {
+        uint32_t columnHashes[StripWidth];
+
+        for (uint32_t tile = begin; tile < end; ++tile)
+        {
+            uint32_t band = tile / numStrips;
+            uint32_t strip = tile % numStrips;
+            uint32_t x = strip * StripWidth;
+            uint32_t stripWidth = std::min(StripWidth, width - x);
+
+            std::fill(columnHashes, columnHashes + stripWidth, PixelHashSeed);
+
+            uint32_t bandEnd = std::min(height, (band + 1) * BandHeight);
+            for (uint32_t y = band * BandHeight; y < bandEnd; ++y)
+            {
+                const uint32_t* row = reinterpret_cast<const uint32_t*>(view.m_Data + static_cast<size_t>(y) * view.m_Pitch) + x;
+                out->m_RowHashes[static_cast<size_t>(strip) * height + y] = kernels.m_HashRow(row, stripWidth);
+                kernels.m_HashColumns(columnHashes, row, stripWidth);
+            }
+
+            std::copy(columnHashes, columnHashes + stripWidth, out->m_ColumnHashes.begin() + static_cast<size_t>(band) * width + x);
+        }
+    });
+}
+
+void Tako::MotionDetector::FindShifts(const uint64_t* previous, const uint64_t* current, uint32_t length, std::vector<Shift>* out)
+{
+    uint32_t firstChange = 0;
+    while (firstChange < length && current[firstChange] == previous[firstChange])
+        firstChange++;
+
+    if (firstChange == length)
+        return;
+
+    // Only hashes that occur once in the previous frame can vote. Repeated ones such as blank
+    // lines would match at any offset. The open-addressed table is reused across calls on a thread.
+    static constexpr int32_t EmptySlot = -2;
+    static constexpr int32_t RepeatedHash = -1;
+
+    struct Slot
+    {
+        uint64_t m_Hash;
+        int32_t m_Position;
+    };
+
+    uint32_t capacity = 1;
+    while (capacity < length * 2)
+        capacity <<= 1;
+
+    thread_local std::vector<Slot> positions;
+    positions.assign(capacity, { 0, EmptySlot });
+
+    auto findSlot = [&](uint64_t hash) -> Slot&
+    {
+        uint32_t index = static_cast<uint32_t>(hash) & (capacity - 1);
+        while (positions[index].m_Position != EmptySlot && positions[index].m_Hash != hash)
+            index = (index + 1) & (capacity - 1);
+        return positions[index];
+    };
+
+    for (uint32_t i = 0; i < length; ++i)
+    {
+        Slot& slot = findSlot(previous[i]);
+        slot.m_Position = slot.m_Position == EmptySlot ? static_cast<int32_t>(i) : RepeatedHash;
+        slot.m_Hash = previous[i];
+    }
+
+    std::vector<uint32_t> votes(static_cast<size_t>(length) * 2, 0);
+    for (uint32_t i = firstChange; i < length; ++i)
+    {
+        if (current[i] == previous[i])
+            continue;
+
+        const Slot& slot = findSlot(current[i]);
+        if (slot.m_Position < 0)
+            continue;
+
+        votes[static_cast<size_t>(i) + length - slot.m_Position]++;
+    }
+
+    auto best = std::max_element(votes.begin(), votes.end());
+    if (*best < MinMoveLength)
+        return;
+
+    int32_t offset = static_cast<int32_t>(best - votes.begin()) - static_cast<int32_t>(length);
+    uint32_t begin = static_cast<uint32_t>(std::max(0, offset));
+    uint32_t end = static_cast<uint32_t>(std::min(static_cast<int32_t>(length), static_cast<int32_t>(length) + offset));
+
+    // Collect every run that matches at the winning offset and actually changed
+    uint32_t runStart = begin;
+    bool runMoved = false;
+    for (uint32_t i = begin; i <= end; ++i)
+    {
+        bool matches = i < end && current[i] == previous[i - offset];
+        if (matches)
+        {
+            runMoved |= current[i] != previous[i];
+            continue;
+        }
+
+        if (runMoved && i - runStart >= MinMoveLength)
+            out->push_back({ offset, runStart, i });
+
+        runStart = i + 1;
+        runMoved = false;
+    }
+}
+
+void Tako::MotionDetector::AppendMoves(const std::vector<Shift>* shifts, uint32_t numLanes, uint32_t laneSize, uint32_t laneExtent,
+    bool vertical, const TakoRect& rect, std::vector<DXGI_OUTDUPL_MOVE_RECT>* outMoveRects)
+{
+    struct LaneShift
+    {
+        Shift m_Shift;
+        uint32_t m_Lane;
+    };
+
+    std::vector<LaneShift> laneShifts;
+    for (uint32_t lane = 0; lane < numLanes; ++lane)
+    {
+        for (const Shift& shift : shifts[lane])
+            laneShifts.push_back({ shift, lane });
+    }
+
+    // Neighbouring lanes with the same shift over the same range describe one moved region
+    std::sort(laneShifts.begin(), laneShifts.end(), [](const LaneShift& a, const LaneShift& b)
+    {
+        if (a.m_Shift.m_Offset != b.m_Shift.m_Offset) return a.m_Shift.m_Offset < b.m_Shift.m_Offset;
+        if (a.m_Shift.m_Begin != b.m_Shift.m_Begin) return a.m_Shift.m_Begin < b.m_Shift.m_Begin;
+        if (a.m_Shift.m_End != b.m_Shift.m_End) return a.m_Shift.m_End < b.m_Shift.m_End;
+        return a.m_Lane < b.m_Lane;
+    });
+
+    for (size_t i = 0; i < laneShifts.size(); ++i)
+    {
+        const Shift& shift = laneShifts[i].m_Shift;
+        uint32_t firstLane = laneShifts[i].m_Lane;
+        uint32_t lastLane = firstLane;
+
+        while (i + 1 < laneShifts.size() && laneShifts[i + 1].m_Lane == lastLane + 1 &&
+            laneShifts[i + 1].m_Shift.m_Offset == shift.m_Offset &&
+            laneShifts[i + 1].m_Shift.m_Begin == shift.m_Begin &&
+            laneShifts[i + 1].m_Shift.m_End == shift.m_End)
+        {
+            lastLane++;
+            i++;
+        }
+
+        LONG laneBegin = static_cast<LONG>(firstLane * laneSize);
+        LONG laneEnd = static_cast<LONG>(std::min(laneExtent, (lastLane + 1) * laneSize));
+
+        DXGI_OUTDUPL_MOVE_RECT move;
+        if (vertical)
+        {
+            move.DestinationRect = { rect.m_X + laneBegin, rect.m_Y + static_cast<LONG>(shift.m_Begin), rect.m_X + laneEnd, rect.m_Y + static_cast<LONG>(shift.m_End) };
+            move.SourcePoint = { move.DestinationRect.left, move.DestinationRect.top - shift.m_Offset };
+        }
+        else
+        {
+            move.DestinationRect = { rect.m_X + static_cast<LONG>(shift.m_Begin), rect.m_Y + laneBegin, rect.m_X + static_cast<LONG>(shift.m_End), rect.m_Y + laneEnd };
+            move.SourcePoint = { move.DestinationRect.left - shift.m_Offset, move.DestinationRect.top };
+        }
+
+        outMoveRects->push_back(move);
+    }
+}
+
+void Tako::MotionDetector::FindResidual(const TakoFrameView& current, const TakoFrameView& previous,
+    const std::vector<DXGI_OUTDUPL_MOVE_RECT>& moveRects, std::vector<RECT>* outDirtyRects)
+{
+    // Work in view-relative coordinates, left to right
+    std::vector<DXGI_OUTDUPL_MOVE_RECT> moves = moveRects;
+    for (DXGI_OUTDUPL_MOVE_RECT& move : moves)
+    {
+        move.SourcePoint.x -= current.m_Rect.m_X;
+        move.SourcePoint.y -= current.m_Rect.m_Y;
+        move.DestinationRect.left -= current.m_Rect.m_X;
+        move.DestinationRect.right -= current.m_Rect.m_X;
+        move.DestinationRect.top -= current.m_Rect.m_Y;
+        move.DestinationRect.bottom -= current.m_Rect.m_Y;
+    }
+
+    std::sort(moves.begin(), moves.end(), [](const DXGI_OUTDUPL_MOVE_RECT& a, const DXGI_OUTDUPL_MOVE_RECT& b)
+    {
+        return a.DestinationRect.left < b.DestinationRect.left;
+    });
+
+    const PixelKernelTable& kernels = GetPixelKernels();
+
+    auto previousPixels = [&](LONG x, LONG y)
+    {
+        return reinterpret_cast<const uint32_t*>(previous.m_Data + static_cast<size_t>(y) * previous.m_Pitch) + x;
+    };
+
+    // Compares a span of one row against the previous frame with the moves applied
+    auto spanMatches = [&](const uint32_t* currentRow, LONG y, LONG begin, LONG end)
+    {
+        LONG x = begin;
+        for (const DXGI_OUTDUPL_MOVE_RECT& move : moves)
+        {
+            const RECT& dest = move.DestinationRect;
+            if (y < dest.top || y >= dest.bottom || dest.right <= x)
+                continue;
+
+            if (dest.left >= end)
+                break;
+
+            if (dest.left > x)
+            {
+                if (!kernels.m_RowsEqual(currentRow + x, previousPixels(x, y), static_cast<uint32_t>(dest.left - x)))
+                    return false;
+                x = dest.left;
+            }
+
+            LONG movedEnd = std::min(end, dest.right);
+            const uint32_t* source = previousPixels(move.SourcePoint.x + (x - dest.left), move.SourcePoint.y + (y - dest.top));
+            if (!kernels.m_RowsEqual(currentRow + x, source, static_cast<uint32_t>(movedEnd - x)))
+                return false;
+            x = movedEnd;
+        }
+
+        return x >= end || kernels.m_RowsEqual(currentRow + x, previousPixels(x, y), static_cast<uint32_t>(end - x));
+    };
+
+    std::vector<TakoRect> dirtyRects;
+    DiffTiles(current.m_Rect, DiffTileSize, [&](uint32_t y, uint32_t begin, uint32_t end)
+    {
+        const uint32_t* currentRow = reinterpret_cast<const uint32_t*>(current.m_Data + static_cast<size_t>(y) * current.m_Pitch);
+        return spanMatches(currentRow, static_cast<LONG>(y), static_cast<LONG>(begin), static_cast<LONG>(end));
+    }, &dirtyRects);
+
+    for (const TakoRect& rect : dirtyRects)
+    {
+        outDirtyRects->push_back({ static_cast<LONG>(rect.m_X), static_cast<LONG>(rect.m_Y),
+            static_cast<LONG>(rect.m_X + static_cast<int32_t>(rect.m_Width)), static_cast<LONG>(rect.m_Y + static_cast<int32_t>(rect.m_Height)) });
+    }
+}
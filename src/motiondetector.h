@@ -0,0 +1,77 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+
+namespace Tako
+{
+    // Recognizes content that moved between two frames, such as scrolled documents or dragged windows.
+    // Rows are hashed per vertical strip and columns per horizontal band; consistent shifts of hash
+    // sequences become move rects. Results use the layout of DXGI_OUTDUPL_FRAME_INFO metadata, but in
+    // desktop coordinates, so consumers can send "shift by N" instead of the moved pixels.
+    class MotionDetector
+    {
+    public:
+        MotionDetector() = default;
+        ~MotionDetector() = default;
+
+        // Both views must cover the same rect. Dirty rects are whatever remains different after
+        // applying the moves to previous.
+        TakoError Detect(const TakoFrameView& current, const TakoFrameView& previous,
+            std::vector<DXGI_OUTDUPL_MOVE_RECT>* outMoveRects, std::vector<RECT>* outDirtyRects);
+
+    private:
+        static constexpr uint32_t StripWidth = 128;
+        static constexpr uint32_t BandHeight = 128;
+        static constexpr uint32_t MinMoveLength = 16; // Shorter matching runs are not worth a move
+
+        struct FrameHashes
+        {
+            uint64_t m_Generation = 0;
+            TakoRect m_Rect = {};
+            TakoCpuLevel m_CpuLevel = TakoCpuLevel::SCALAR;
+            std::vector<uint64_t> m_RowHashes; // One row of hashes per strip: [strip * height + y]
+            std::vector<uint64_t> m_ColumnHashes; // One row of hashes per band: [band * width + x]
+        };
+
+        struct Shift
+        {
+            int32_t m_Offset; // Displacement from previous to current along the hashed axis
+            uint32_t m_Begin; // Matching range in current, along the same axis
+            uint32_t m_End;
+        };
+
+    private:
+        static bool IsCached(const FrameHashes& hashes, const TakoFrameView& view);
+        void ComputeHashes(const TakoFrameView& view, FrameHashes* out);
+
+        static void FindShifts(const uint64_t* previous, const uint64_t* current, uint32_t length, std::vector<Shift>* out);
+        static void AppendMoves(const std::vector<Shift>* shifts, uint32_t numLanes, uint32_t laneSize, uint32_t laneExtent,
+            bool vertical, const TakoRect& rect, std::vector<DXGI_OUTDUPL_MOVE_RECT>* outMoveRects);
+
+        void FindResidual(const TakoFrameView& current, const TakoFrameView& previous,
+            const std::vector<DXGI_OUTDUPL_MOVE_RECT>& moveRects, std::vector<RECT>* outDirtyRects);
+
+    private:
+        // Hashes of the last two frames; the current frame of one call is usually the previous frame of the next
+        FrameHashes m_Hashes[2];
+    };
+}
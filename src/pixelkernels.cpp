@@ -0,0 +1,455 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pixelkernels.h"
+#include <intrin.h>
+
+namespace
+{
+    // Each ISA exposes the same small set of vector primitives. The kernels below are written
+    // once against this interface and instantiated per ISA, so the compiler emits a dedicated
+    // loop for every (ISA, operation) pair with no per-pixel dispatch.
+    struct IsaScalar
+    {
+        using Vector = uint32_t;
+        static constexpr uint32_t Width = 1;
+
+        static inline Vector Load(const uint32_t* src) { return *src; }
+        static inline void Store(uint32_t* dst, Vector v) { *dst = v; }
+        static inline Vector Splat(uint32_t value) { return value; }
+        static inline Vector SwapRB(Vector v) { return (v & 0xFF00FF00) | ((v >> 16) & 0xFF) | ((v & 0xFF) << 16); }
+        static inline bool Equal(Vector a, Vector b) { return a == b; }
+        static inline Vector Xor(Vector a, Vector b) { return a ^ b; }
+        static inline Vector MulLo(Vector a, Vector b) { return a * b; }
+        static inline Vector ShiftRight(Vector v, int bits) { return v >> bits; }
+        static inline Vector Add(Vector a, Vector b) { return a + b; }
+        static inline Vector Sub(Vector a, Vector b) { return a - b; }
+    };
+
+    struct IsaSse42
+    {
+        using Vector = __m128i;
+        static constexpr uint32_t Width = 4;
+
+        static inline Vector Load(const uint32_t* src) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)); }
+        static inline void Store(uint32_t* dst, Vector v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), v); }
+        static inline Vector Splat(uint32_t value) { return _mm_set1_epi32(static_cast<int>(value)); }
+        static inline Vector SwapRB(Vector v)
+        {
+            const __m128i mask = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+            return _mm_shuffle_epi8(v, mask);
+        }
+        static inline bool Equal(Vector a, Vector b) { return _mm_movemask_epi8(_mm_cmpeq_epi32(a, b)) == 0xFFFF; }
+        static inline Vector Xor(Vector a, Vector b) { return _mm_xor_si128(a, b); }
+        static inline Vector MulLo(Vector a, Vector b) { return _mm_mullo_epi32(a, b); }
+        static inline Vector ShiftRight(Vector v, int bits) { return _mm_srli_epi32(v, bits); }
+        static inline Vector Add(Vector a, Vector b) { return _mm_add_epi32(a, b); }
+        static inline Vector Sub(Vector a, Vector b) { return _mm_sub_epi32(a, b); }
+
+        // Widen Width / 4 pixels into one 32-bit lane per channel, and back with saturation
+        static inline Vector WidenPixels(const uint32_t* src) { return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(static_cast<int>(*src))); }
+        static inline void NarrowPixels(uint32_t* dst, Vector v)
+        {
+            __m128i words = _mm_packus_epi32(v, v);
+            *dst = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(words, words)));
+        }
+        static inline Vector Scale(Vector v, float scale) { return _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(scale))); }
+    };
+
+    struct IsaAvx2
+    {
+        using Vector = __m256i;
+        static constexpr uint32_t Width = 8;
+
+        static inline Vector Load(const uint32_t* src) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src)); }
+        static inline void Store(uint32_t* dst, Vector v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), v); }
+        static inline Vector Splat(uint32_t value) { return _mm256_set1_epi32(static_cast<int>(value)); }
+        static inline Vector SwapRB(Vector v)
+        {
+            const __m256i mask = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                                  2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+            return _mm256_shuffle_epi8(v, mask);
+        }
+        static inline bool Equal(Vector a, Vector b) { return _mm256_movemask_epi8(_mm256_cmpeq_epi32(a, b)) == -1; }
+        static inline Vector Xor(Vector a, Vector b) { return _mm256_xor_si256(a, b); }
+        static inline Vector MulLo(Vector a, Vector b) { return _mm256_mullo_epi32(a, b); }
+        static inline Vector ShiftRight(Vector v, int bits) { return _mm256_srli_epi32(v, bits); }
+        static inline Vector Add(Vector a, Vector b) { return _mm256_add_epi32(a, b); }
+        static inline Vector Sub(Vector a, Vector b) { return _mm256_sub_epi32(a, b); }
+
+        static inline Vector WidenPixels(const uint32_t* src) { return _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src))); }
+        static inline void NarrowPixels(uint32_t* dst, Vector v)
+        {
+            // Packs stay within 128-bit halves, so each half ends up holding one pixel
+            __m256i words = _mm256_packus_epi32(v, v);
+            __m256i bytes = _mm256_packus_epi16(words, words);
+            __m128i pixels = _mm_unpacklo_epi32(_mm256_castsi256_si128(bytes), _mm256_extracti128_si256(bytes, 1));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), pixels);
+        }
+        static inline Vector Scale(Vector v, float scale) { return _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(v), _mm256_set1_ps(scale))); }
+    };
+
+    struct IsaAvx512
+    {
+        using Vector = __m512i;
+        static constexpr uint32_t Width = 16;
+
+        static inline Vector Load(const uint32_t* src) { return _mm512_loadu_si512(src); }
+        static inline void Store(uint32_t* dst, Vector v) { _mm512_storeu_si512(dst, v); }
+        static inline Vector Splat(uint32_t value) { return _mm512_set1_epi32(static_cast<int>(value)); }
+        static inline Vector SwapRB(Vector v)
+        {
+            const __m512i mask = _mm512_broadcast_i32x4(_mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15));
+            return _mm512_shuffle_epi8(v, mask);
+        }
+        static inline bool Equal(Vector a, Vector b) { return _mm512_cmpeq_epi32_mask(a, b) == 0xFFFF; }
+        static inline Vector Xor(Vector a, Vector b) { return _mm512_xor_si512(a, b); }
+        static inline Vector MulLo(Vector a, Vector b) { return _mm512_mullo_epi32(a, b); }
+        static inline Vector ShiftRight(Vector v, int bits) { return _mm512_srli_epi32(v, static_cast<unsigned int>(bits)); }
+        static inline Vector Add(Vector a, Vector b) { return _mm512_add_epi32(a, b); }
+        static inline Vector Sub(Vector a, Vector b) { return _mm512_sub_epi32(a, b); }
+
+        static inline Vector WidenPixels(const uint32_t* src) { return _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src))); }
+        static inline void NarrowPixels(uint32_t* dst, Vector v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm512_cvtusepi32_epi8(v)); }
+        static inline Vector Scale(Vector v, float scale) { return _mm512_cvtps_epi32(_mm512_mul_ps(_mm512_cvtepi32_ps(v), _mm512_set1_ps(scale))); }
+    };
+
+    template <typename Isa>
+    void CopyRow(uint32_t* dst, const uint32_t* src, uint32_t numPixels)
+    {
+        uint32_t i = 0;
+        for (; i + Isa::Width <= numPixels; i += Isa::Width)
+            Isa::Store(dst + i, Isa::Load(src + i));
+
+        for (; i < numPixels; ++i)
+            dst[i] = src[i];
+    }
+
+    template <typename Isa>
+    void SwizzleRow(uint32_t* dst, const uint32_t* src, uint32_t numPixels)
+    {
+        uint32_t i = 0;
+        for (; i + Isa::Width <= numPixels; i += Isa::Width)
+            Isa::Store(dst + i, Isa::SwapRB(Isa::Load(src + i)));
+
+        for (; i < numPixels; ++i)
+            dst[i] = IsaScalar::SwapRB(src[i]);
+    }
+
+    template <typename Isa>
+    void FillRow(uint32_t* dst, uint32_t value, uint32_t numPixels)
+    {
+        typename Isa::Vector v = Isa::Splat(value);
+
+        uint32_t i = 0;
+        for (; i + Isa::Width <= numPixels; i += Isa::Width)
+            Isa::Store(dst + i, v);
+
+        for (; i < numPixels; ++i)
+            dst[i] = value;
+    }
+
+    template <typename Isa>
+    bool RowsEqual(const uint32_t* a, const uint32_t* b, uint32_t numPixels)
+    {
+        uint32_t i = 0;
+        for (; i + Isa::Width <= numPixels; i += Isa::Width)
+        {
+            if (!Isa::Equal(Isa::Load(a + i), Isa::Load(b + i)))
+                return false;
+        }
+
+        for (; i < numPixels; ++i)
+        {
+            if (a[i] != b[i])
+                return false;
+        }
+
+        return true;
+    }
+
+    // One lane-wise mixing round, each 32-bit lane hashes every Width-th pixel
+    template <typename Isa>
+    inline typename Isa::Vector MixHash(typename Isa::Vector hash, typename Isa::Vector pixels)
+    {
+        hash = Isa::MulLo(Isa::Xor(hash, pixels), Isa::Splat(0x85EBCA6B));
+        return Isa::Xor(hash, Isa::ShiftRight(hash, 15));
+    }
+
+    template <typename Isa>
+    uint64_t HashRow(const uint32_t* src, uint32_t numPixels)
+    {
+        static constexpr uint64_t Multiplier = 0x9E3779B97F4A7C15ull;
+
+        typename Isa::Vector lanes = Isa::Splat(Tako::PixelHashSeed);
+
+        uint32_t i = 0;
+        for (; i + Isa::Width <= numPixels; i += Isa::Width)
+            lanes = MixHash<Isa>(lanes, Isa::Load(src + i));
+
+        // Lanes are folded in pairs, which halves the serial multiply chain for short rows
+        uint64_t laneHashes[(Isa::Width + 1) / 2] = {};
+        if constexpr (Isa::Width == 1)
+            laneHashes[0] = lanes;
+        else
+            Isa::Store(reinterpret_cast<uint32_t*>(laneHashes), lanes);
+
+        uint64_t hash = numPixels;
+        for (uint64_t laneHash : laneHashes)
+            hash = (hash ^ laneHash) * Multiplier;
+
+        for (; i < numPixels; ++i)
+            hash = (hash ^ src[i]) * Multiplier;
+
+        return hash ^ (hash >> 29);
+    }
+
+    template <typename Isa>
+    void HashColumns(uint32_t* hashes, const uint32_t* src, uint32_t numPixels)
+    {
+        uint32_t i = 0;
+        for (; i + Isa::Width <= numPixels; i += Isa::Width)
+            Isa::Store(hashes + i, MixHash<Isa>(Isa::Load(hashes + i), Isa::Load(src + i)));
+
+        for (; i < numPixels; ++i)
+            hashes[i] = MixHash<IsaScalar>(hashes[i], src[i]);
+    }
+
+    // Channel sums are kept as four 32-bit lanes per pixel, laid out in pixel order
+    template <typename Isa>
+    void AccumulateRow(uint32_t* sums, const uint32_t* addRow, const uint32_t* subRow, uint32_t numPixels)
+    {
+        uint32_t i = 0;
+        if constexpr (Isa::Width >= 4)
+        {
+            constexpr uint32_t PixelsPerVector = Isa::Width / 4;
+            for (; i + PixelsPerVector <= numPixels; i += PixelsPerVector)
+            {
+                typename Isa::Vector v = Isa::Load(sums + i * 4);
+                v = Isa::Sub(Isa::Add(v, Isa::WidenPixels(addRow + i)), Isa::WidenPixels(subRow + i));
+                Isa::Store(sums + i * 4, v);
+            }
+        }
+
+        for (; i < numPixels; ++i)
+        {
+            for (uint32_t c = 0; c < 4; ++c)
+                sums[i * 4 + c] += ((addRow[i] >> (c * 8)) & 0xFF) - ((subRow[i] >> (c * 8)) & 0xFF);
+        }
+    }
+
+    template <typename Isa>
+    void ResolveSums(uint32_t* dst, const uint32_t* sums, uint32_t numPixels, float scale)
+    {
+        uint32_t i = 0;
+        if constexpr (Isa::Width >= 4)
+        {
+            constexpr uint32_t PixelsPerVector = Isa::Width / 4;
+            for (; i + PixelsPerVector <= numPixels; i += PixelsPerVector)
+                Isa::NarrowPixels(dst + i, Isa::Scale(Isa::Load(sums + i * 4), scale));
+        }
+
+        for (; i < numPixels; ++i)
+        {
+            uint32_t pixel = 0;
+            for (uint32_t c = 0; c < 4; ++c)
+            {
+                uint32_t channel = static_cast<uint32_t>(static_cast<float>(sums[i * 4 + c]) * scale + 0.5f);
+                pixel |= std::min(channel, 255u) << (c * 8);
+            }
+            dst[i] = pixel;
+        }
+    }
+
+    // Per-channel sums of the 2 * r + 1 pixels centered on x, with the outermost pixels standing in for
+    // everything past the edges. Costs the row length at most, however far r reaches.
+    inline void SeedBlurSums(uint32_t* sums, const uint32_t* src, int32_t x, int32_t last, int32_t r)
+    {
+        int32_t begin = std::max(x - r, 0);
+        int32_t end = std::min(x + r, last);
+        uint32_t numBefore = static_cast<uint32_t>(begin - (x - r));
+        uint32_t numAfter = static_cast<uint32_t>(x + r - end);
+
+        for (uint32_t c = 0; c < 4; ++c)
+        {
+            sums[c] = ((src[0] >> (c * 8)) & 0xFF) * numBefore + ((src[last] >> (c * 8)) & 0xFF) * numAfter;
+            for (int32_t k = begin; k <= end; ++k)
+                sums[c] += (src[k] >> (c * 8)) & 0xFF;
+        }
+    }
+
+    // Running sum over dst[begin, end), costing one add and one subtract per pixel whatever the radius
+    void BlurSpan(uint32_t* dst, const uint32_t* src, int32_t begin, int32_t end, int32_t last, int32_t r, float scale)
+    {
+        uint32_t sums[4];
+        SeedBlurSums(sums, src, begin, last, r);
+
+        for (int32_t x = begin; x < end; ++x)
+        {
+            ResolveSums<IsaScalar>(dst + x, sums, 1, scale);
+            AccumulateRow<IsaScalar>(sums, src + std::min(x + r + 1, last), src + std::max(x - r, 0), 1);
+        }
+    }
+
+    // A running sum is one long dependency chain, so wider ISAs split the row into one segment per pixel a
+    // vector holds and advance all of them together, each in its own four lanes
+    template <typename Isa>
+    void BlurRow(uint32_t* dst, const uint32_t* src, uint32_t numPixels, uint32_t radius)
+    {
+        if (numPixels == 0)
+            return;
+
+        const int32_t last = static_cast<int32_t>(numPixels) - 1;
+        const int32_t r = static_cast<int32_t>(radius);
+        const float scale = 1.f / static_cast<float>(2 * r + 1);
+
+        int32_t x = 0;
+        if constexpr (Isa::Width >= 4)
+        {
+            constexpr uint32_t NumSegments = Isa::Width / 4;
+
+            // Every segment is seeded separately, which only pays off when they are longer than the window
+            if constexpr (NumSegments > 1)
+            {
+                if (numPixels < NumSegments * (2 * radius + 1))
+                    return BlurRow<IsaSse42>(dst, src, numPixels, radius);
+            }
+
+            const int32_t length = static_cast<int32_t>(numPixels / NumSegments);
+
+            uint32_t sums[Isa::Width];
+            for (uint32_t s = 0; s < NumSegments; ++s)
+                SeedBlurSums(sums + s * 4, src, static_cast<int32_t>(s) * length, last, r);
+
+            typename Isa::Vector sum = Isa::Load(sums);
+
+            // Pixels of the segments are interleaved a block at a time, so each step loads and stores them whole
+            constexpr int32_t BlockSize = 64;
+            uint32_t added[BlockSize * NumSegments];
+            uint32_t removed[BlockSize * NumSegments];
+            uint32_t resolved[BlockSize * NumSegments];
+
+            for (int32_t block = 0; block < length; block += BlockSize)
+            {
+                const int32_t numSteps = std::min(BlockSize, length - block);
+
+                for (uint32_t s = 0; s < NumSegments; ++s)
+                {
+                    for (int32_t i = 0; i < numSteps; ++i)
+                    {
+                        int32_t segmentX = static_cast<int32_t>(s) * length + block + i;
+                        added[i * NumSegments + s] = src[std::min(segmentX + r + 1, last)];
+                        removed[i * NumSegments + s] = src[std::max(segmentX - r, 0)];
+                    }
+                }
+
+                for (int32_t i = 0; i < numSteps; ++i)
+                {
+                    Isa::NarrowPixels(resolved + i * NumSegments, Isa::Scale(sum, scale));
+                    sum = Isa::Sub(Isa::Add(sum, Isa::WidenPixels(added + i * NumSegments)), Isa::WidenPixels(removed + i * NumSegments));
+                }
+
+                for (uint32_t s = 0; s < NumSegments; ++s)
+                {
+                    for (int32_t i = 0; i < numSteps; ++i)
+                        dst[static_cast<int32_t>(s) * length + block + i] = resolved[i * NumSegments + s];
+                }
+            }
+
+            x = length * NumSegments;
+        }
+
+        if (x <= last)
+            BlurSpan(dst, src, x, last + 1, last, r, scale);
+    }
+
+    template <typename Isa>
+    constexpr Tako::PixelKernelTable MakeKernelTable()
+    {
+        return { &CopyRow<Isa>, &SwizzleRow<Isa>, &FillRow<Isa>, &RowsEqual<Isa>, &HashRow<Isa>, &HashColumns<Isa>,
+                 &AccumulateRow<Isa>, &ResolveSums<Isa>, &BlurRow<Isa> };
+    }
+
+    constexpr Tako::PixelKernelTable g_KernelTables[] =
+    {
+        MakeKernelTable<IsaScalar>(),
+        MakeKernelTable<IsaSse42>(),
+        MakeKernelTable<IsaAvx2>(),
+        MakeKernelTable<IsaAvx512>(),
+    };
+
+    Tako::TakoCpuLevel g_SelectedCpuLevel = Tako::TakoCpuLevel::SCALAR;
+}
+
+Tako::TakoCpuLevel Tako::DetectCpuLevel()
+{
+    int info[4];
+
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    bool hasSsse3 = (info[2] & (1 << 9)) != 0;
+    bool hasSse42 = (info[2] & (1 << 20)) != 0;
+    bool hasOsxsave = (info[2] & (1 << 27)) != 0;
+    bool hasAvx = (info[2] & (1 << 28)) != 0;
+
+    if (!hasSsse3 || !hasSse42)
+        return TakoCpuLevel::SCALAR;
+
+    // The OS must also save the wider register state on context switches
+    if (!hasOsxsave || !hasAvx || maxLeaf < 7)
+        return TakoCpuLevel::SSE42;
+
+    uint64_t xcr0 = _xgetbv(0);
+    if ((xcr0 & 0x6) != 0x6)
+        return TakoCpuLevel::SSE42;
+
+    __cpuidex(info, 7, 0);
+    bool hasAvx2 = (info[1] & (1 << 5)) != 0;
+    bool hasAvx512F = (info[1] & (1 << 16)) != 0;
+    bool hasAvx512BW = (info[1] & (1 << 30)) != 0;
+
+    if (!hasAvx2)
+        return TakoCpuLevel::SSE42;
+
+    if (!hasAvx512F || !hasAvx512BW || (xcr0 & 0xE6) != 0xE6)
+        return TakoCpuLevel::AVX2;
+
+    return TakoCpuLevel::AVX512;
+}
+
+Tako::TakoError Tako::SelectPixelKernels(TakoCpuLevel level)
+{
+    if (static_cast<uint32_t>(level) > static_cast<uint32_t>(DetectCpuLevel()))
+        return TakoError::NOT_SUPPORTED;
+
+    g_SelectedCpuLevel = level;
+    return TakoError::OK;
+}
+
+Tako::TakoCpuLevel Tako::GetSelectedCpuLevel()
+{
+    return g_SelectedCpuLevel;
+}
+
+const Tako::PixelKernelTable& Tako::GetPixelKernels()
+{
+    return g_KernelTables[static_cast<uint32_t>(g_SelectedCpuLevel)];
+}
@@ -0,0 +1,50 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+
+namespace Tako
+{
+    // Row kernels shared by all CPU pixel stages. Every entry operates on 32-bit pixels and
+    // is filled in from one ISA specialization of the templates in pixelkernels.cpp.
+    struct PixelKernelTable
+    {
+        void (*m_CopyRow)(uint32_t* dst, const uint32_t* src, uint32_t numPixels);
+        void (*m_SwizzleRow)(uint32_t* dst, const uint32_t* src, uint32_t numPixels); // Swaps the R and B channels
+        void (*m_FillRow)(uint32_t* dst, uint32_t value, uint32_t numPixels);
+        bool (*m_RowsEqual)(const uint32_t* a, const uint32_t* b, uint32_t numPixels);
+        uint64_t (*m_HashRow)(const uint32_t* src, uint32_t numPixels);
+        void (*m_HashColumns)(uint32_t* hashes, const uint32_t* src, uint32_t numPixels); // Folds one row into per-column hashes
+        void (*m_AccumulateRow)(uint32_t* sums, const uint32_t* addRow, const uint32_t* subRow, uint32_t numPixels); // Adds and subtracts per-channel values
+        void (*m_ResolveSums)(uint32_t* dst, const uint32_t* sums, uint32_t numPixels, float scale); // Scales per-channel sums back into pixels
+        void (*m_BlurRow)(uint32_t* dst, const uint32_t* src, uint32_t numPixels, uint32_t radius); // Box blur, edges repeat the outermost pixel
+    };
+
+    // Hashes differ between CPU levels, only compare hashes produced by the same level
+    static constexpr uint32_t PixelHashSeed = 0x9E3779B9;
+
+    TakoCpuLevel DetectCpuLevel();
+
+    // Selects the kernels for the given level. Fails with NOT_SUPPORTED if the CPU cannot run them.
+    TakoError SelectPixelKernels(TakoCpuLevel level);
+    TakoCpuLevel GetSelectedCpuLevel();
+    const PixelKernelTable& GetPixelKernels();
+}
@@ -0,0 +1,281 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "redactor.h"
+#include "frameview.h"
+#include "pixelkernels.h"
+#include "threadpool.h"
+
+extern Tako::ThreadPool* g_ThreadPool;
+
+namespace
+{
+    inline uint32_t SwapRB(uint32_t pixel)
+    {
+        return (pixel & 0xFF00FF00) | ((pixel >> 16) & 0xFF) | ((pixel & 0xFF) << 16);
+    }
+
+    // Adds count copies of a row to per-channel sums, for the edge rows a blur repeats past the region
+    void AccumulateRepeatedRow(uint32_t* sums, const uint32_t* row, uint32_t count, uint32_t numPixels)
+    {
+        for (uint32_t x = 0; x < numPixels; ++x)
+        {
+            for (uint32_t c = 0; c < 4; ++c)
+                sums[x * 4 + c] += ((row[x] >> (c * 8)) & 0xFF) * count;
+        }
+    }
+
+    // Rows of zeros stand in for the subtracted row when a running sum is being seeded
+    const uint32_t* GetZeroRow(uint32_t numPixels)
+    {
+        thread_local std::vector<uint32_t> zeros;
+        if (zeros.size() < numPixels)
+            zeros.resize(numPixels);
+
+        return zeros.data();
+    }
+}
+
+Tako::TakoError Tako::Redactor::Apply(const TakoFrameView& target, const TakoRedaction* redactions, uint32_t numRedactions)
+{
+    TakoError err;
+
+    if (GetBytesPerPixel(target.m_Format) != sizeof(uint32_t))
+        return TakoError::NOT_SUPPORTED;
+
+    // Blur and pixelate average 8-bit channels, and fill colors are given as BGRA
+    bool swizzle;
+    err = GetConversion(DXGI_FORMAT_B8G8R8A8_UNORM, target.m_Format, &swizzle);
+    if (err != TakoError::OK)
+        return err;
+
+    for (uint32_t i = 0; i < numRedactions; ++i)
+    {
+        if (!IsValid(redactions[i]))
+            return TakoError::INVALID_ARGUMENT;
+    }
+
+    m_Cache.resize(numRedactions);
+
+    for (uint32_t i = 0; i < numRedactions; ++i)
+    {
+        const TakoRedaction& redaction = redactions[i];
+
+        TakoFrameView region;
+        err = CropFrameView(target, redaction.m_Rect, &region);
+        if (err == TakoError::INVALID_ARGUMENT)
+            continue;
+
+        if (err != TakoError::OK)
+            return err;
+
+        if (redaction.m_Mode == TakoRedactionMode::FILL)
+        {
+            Fill(region, swizzle ? SwapRB(redaction.m_Color) : redaction.m_Color);
+            continue;
+        }
+
+        CachedRegion& cached = m_Cache[i];
+        uint64_t sourceHash = HashRegion(region);
+
+        TakoFrameView cachedView = region;
+        cachedView.m_Data = reinterpret_cast<uint8_t*>(cached.m_Pixels.data());
+        cachedView.m_Pitch = region.m_Rect.m_Width * sizeof(uint32_t);
+
+        // Unchanged content under an unchanged redaction produces the same pixels as last time
+        if (cached.m_Rect == region.m_Rect && cached.m_Mode == redaction.m_Mode && cached.m_Strength == redaction.m_Strength &&
+            cached.m_CpuLevel == GetSelectedCpuLevel() && cached.m_SourceHash == sourceHash)
+        {
+            err = CopyFrameView(cachedView, region.m_Data, region.m_Pitch);
+            if (err != TakoError::OK)
+                return err;
+
+            continue;
+        }
+
+        if (redaction.m_Mode == TakoRedactionMode::PIXELATE)
+            Pixelate(region, redaction.m_Strength);
+        else
+            Blur(region, redaction.m_Strength);
+
+        cached.m_Rect = region.m_Rect;
+        cached.m_Mode = redaction.m_Mode;
+        cached.m_Strength = redaction.m_Strength;
+        cached.m_CpuLevel = GetSelectedCpuLevel();
+        cached.m_SourceHash = sourceHash;
+        cached.m_Pixels.resize(static_cast<size_t>(region.m_Rect.m_Width) * region.m_Rect.m_Height);
+
+        cachedView.m_Data = reinterpret_cast<uint8_t*>(cached.m_Pixels.data());
+        err = CopyFrameView(region, cachedView.m_Data, cachedView.m_Pitch);
+        if (err != TakoError::OK)
+            return err;
+    }
+
+    return TakoError::OK;
+}
+
+bool Tako::Redactor::IsValid(const TakoRedaction& redaction)
+{
+    switch (redaction.m_Mode)
+    {
+    case TakoRedactionMode::FILL:
+        return true;
+    case TakoRedactionMode::PIXELATE:
+    case TakoRedactionMode::BLUR:
+        return redaction.m_Strength > 0 && redaction.m_Strength <= MaxRedactionStrength;
+    default:
+        return false;
+    }
+}
+
+uint64_t Tako::Redactor::HashRegion(const TakoFrameView& region)
+{
+    static constexpr uint64_t Multiplier = 0x9E3779B97F4A7C15ull;
+
+    const PixelKernelTable& kernels = GetPixelKernels();
+    const uint32_t width = region.m_Rect.m_Width;
+    const uint32_t height = region.m_Rect.m_Height;
+
+    m_RowHashes.resize(height);
+    g_ThreadPool->ParallelFor(height, GetBandHeight(width * sizeof(uint32_t)), [&](uint32_t begin, uint32_t end)
+    {
+        for (uint32_t y = begin; y < end; ++y)
+            m_RowHashes[y] = kernels.m_HashRow(reinterpret_cast<const uint32_t*>(region.m_Data + static_cast<size_t>(y) * region.m_Pitch), width);
+    });
+
+    uint64_t hash = height;
+    for (uint64_t rowHash : m_RowHashes)
+        hash = (hash ^ rowHash) * Multiplier;
+
+    return hash;
+}
+
+void Tako::Redactor::Fill(const TakoFrameView& region, uint32_t color)
+{
+    const PixelKernelTable& kernels = GetPixelKernels();
+    const uint32_t width = region.m_Rect.m_Width;
+
+    g_ThreadPool->ParallelFor(region.m_Rect.m_Height, GetBandHeight(width * sizeof(uint32_t)), [&](uint32_t begin, uint32_t end)
+    {
+        for (uint32_t y = begin; y < end; ++y)
+            kernels.m_FillRow(reinterpret_cast<uint32_t*>(region.m_Data + static_cast<size_t>(y) * region.m_Pitch), color, width);
+    });
+}
+
+void Tako::Redactor::Pixelate(const TakoFrameView& region, uint32_t blockSize)
+{
+    const PixelKernelTable& kernels = GetPixelKernels();
+    const uint32_t width = region.m_Rect.m_Width;
+    const uint32_t height = region.m_Rect.m_Height;
+    const uint32_t numBlockRows = (height + blockSize - 1) / blockSize;
+    const uint32_t grain = std::max(1u, GetBandHeight(width * sizeof(uint32_t)) / blockSize);
+
+    g_ThreadPool->ParallelFor(numBlockRows, grain, [&](uint32_t begin, uint32_t end)
+    {
+        // Column sums over one row of blocks, so each pixel is read once
+        thread_local std::vector<uint32_t> sums;
+        const uint32_t* zeros = GetZeroRow(width);
+
+        for (uint32_t blockRow = begin; blockRow < end; ++blockRow)
+        {
+            uint32_t y0 = blockRow * blockSize;
+            uint32_t numRows = std::min(blockSize, height - y0);
+
+            sums.assign(static_cast<size_t>(width) * 4, 0);
+            for (uint32_t y = y0; y < y0 + numRows; ++y)
+                kernels.m_AccumulateRow(sums.data(), reinterpret_cast<const uint32_t*>(region.m_Data + static_cast<size_t>(y) * region.m_Pitch), zeros, width);
+
+            for (uint32_t x0 = 0; x0 < width; x0 += blockSize)
+            {
+                uint32_t numColumns = std::min(blockSize, width - x0);
+                uint32_t count = numColumns * numRows;
+
+                uint64_t channels[4] = {};
+                for (uint32_t x = x0; x < x0 + numColumns; ++x)
+                {
+                    for (uint32_t c = 0; c < 4; ++c)
+                        channels[c] += sums[x * 4 + c];
+                }
+
+                uint32_t average = 0;
+                for (uint32_t c = 0; c < 4; ++c)
+                    average |= static_cast<uint32_t>((channels[c] + count / 2) / count) << (c * 8);
+
+                for (uint32_t y = y0; y < y0 + numRows; ++y)
+                    kernels.m_FillRow(reinterpret_cast<uint32_t*>(region.m_Data + static_cast<size_t>(y) * region.m_Pitch) + x0, average, numColumns);
+            }
+        }
+    });
+}
+
+void Tako::Redactor::Blur(const TakoFrameView& region, uint32_t radius)
+{
+    const PixelKernelTable& kernels = GetPixelKernels();
+    const uint32_t width = region.m_Rect.m_Width;
+    const uint32_t height = region.m_Rect.m_Height;
+
+    const int32_t radiusY = static_cast<int32_t>(radius);
+
+    m_Scratch.resize(static_cast<size_t>(width) * height);
+
+    // Vertical pass: each strip keeps running column sums while walking down, and writes the averages
+    // to scratch. The region itself is only written by the horizontal pass once all reads are done.
+    const uint32_t numStrips = (width + StripWidth - 1) / StripWidth;
+    g_ThreadPool->ParallelFor(numStrips, 1, [&](uint32_t begin, uint32_t end)
+    {
+        thread_local std::vector<uint32_t> sums;
+        const uint32_t* zeros = GetZeroRow(StripWidth);
+        const float scale = 1.f / static_cast<float>(2 * radiusY + 1);
+        const int32_t lastRow = static_cast<int32_t>(height) - 1;
+
+        for (uint32_t strip = begin; strip < end; ++strip)
+        {
+            uint32_t x0 = strip * StripWidth;
+            uint32_t numPixels = std::min(StripWidth, width - x0);
+
+            auto row = [&](int32_t y)
+            {
+                size_t offset = static_cast<size_t>(std::clamp(y, 0, lastRow)) * region.m_Pitch;
+                return reinterpret_cast<const uint32_t*>(region.m_Data + offset) + x0;
+            };
+
+            // Seeding costs the region height at most, however far the radius reaches past the edges
+            sums.assign(static_cast<size_t>(numPixels) * 4, 0);
+            AccumulateRepeatedRow(sums.data(), row(0), radiusY + 1, numPixels);
+            for (int32_t k = 1; k <= std::min(radiusY, lastRow); ++k)
+                kernels.m_AccumulateRow(sums.data(), row(k), zeros, numPixels);
+            AccumulateRepeatedRow(sums.data(), row(lastRow), std::max(radiusY - lastRow, 0), numPixels);
+
+            for (int32_t y = 0; y <= lastRow; ++y)
+            {
+                kernels.m_ResolveSums(m_Scratch.data() + static_cast<size_t>(y) * width + x0, sums.data(), numPixels, scale);
+                kernels.m_AccumulateRow(sums.data(), row(y + radiusY + 1), row(y - radiusY), numPixels);
+            }
+        }
+    });
+
+    g_ThreadPool->ParallelFor(height, GetBandHeight(width * sizeof(uint32_t)), [&](uint32_t begin, uint32_t end)
+    {
+        for (uint32_t y = begin; y < end; ++y)
+        {
+            kernels.m_BlurRow(reinterpret_cast<uint32_t*>(region.m_Data + static_cast<size_t>(y) * region.m_Pitch),
+                m_Scratch.data() + static_cast<size_t>(y) * width, width, radius);
+        }
+    });
+}
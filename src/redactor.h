@@ -0,0 +1,64 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+
+namespace Tako
+{
+    // Applies redactions to a composited CPU frame. Work is confined to the redacted rects, and the
+    // output of a pixelated or blurred rect is cached so unchanged content costs a hash and a copy.
+    class Redactor
+    {
+    public:
+        Redactor() = default;
+        ~Redactor() = default;
+
+        // Redaction rects are in desktop coordinates and clipped to target. Fails with INVALID_ARGUMENT
+        // before touching target if any redaction is invalid.
+        TakoError Apply(const TakoFrameView& target, const TakoRedaction* redactions, uint32_t numRedactions);
+
+        static bool IsValid(const TakoRedaction& redaction);
+
+    private:
+        static constexpr uint32_t StripWidth = 256;
+
+        struct CachedRegion
+        {
+            TakoRect m_Rect = {};
+            TakoRedactionMode m_Mode = TakoRedactionMode::FILL;
+            uint32_t m_Strength = 0;
+            TakoCpuLevel m_CpuLevel = TakoCpuLevel::SCALAR;
+            uint64_t m_SourceHash = 0;
+            std::vector<uint32_t> m_Pixels; // Redacted output, tightly packed
+        };
+
+    private:
+        uint64_t HashRegion(const TakoFrameView& region);
+        static void Fill(const TakoFrameView& region, uint32_t color);
+        static void Pixelate(const TakoFrameView& region, uint32_t blockSize);
+        void Blur(const TakoFrameView& region, uint32_t radius);
+
+    private:
+        std::vector<CachedRegion> m_Cache; // Indexed like the redactions of the last call
+        std::vector<uint64_t> m_RowHashes;
+        std::vector<uint32_t> m_Scratch;
+    };
+}
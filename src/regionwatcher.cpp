@@ -0,0 +1,524 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "regionwatcher.h"
+#include "capturemanager.h"
+#include "frameview.h"
+#include "pixelkernels.h"
+#include <algorithm>
+
+extern Tako::CaptureManager* g_CaptureManager;
+extern std::mutex g_CaptureMutex;
+
+Tako::TakoError Tako::RegionWatcher::Initialize()
+{
+    m_Running = true;
+    m_WatchThread = std::thread(&RegionWatcher::WatchLoop, this);
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::RegionWatcher::Shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Running = false;
+    }
+    m_Condition.notify_all();
+
+    if (m_WatchThread.joinable())
+        m_WatchThread.join();
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Grid.clear();
+    m_UnprimedWatches.clear();
+    m_Watches.clear();
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::RegionWatcher::AddWatch(TakoRect rect, float threshold, TakoWatchCallback callback, void* userData, HANDLE event, uint32_t* outWatchId)
+{
+    if (rect.IsEmpty() || !(threshold >= 0.0f && threshold < 1.0f) || outWatchId == nullptr)
+        return TakoError::INVALID_ARGUMENT;
+
+    std::unique_ptr<Watch> watch = std::make_unique<Watch>();
+    watch->m_Rect = rect;
+    watch->m_Threshold = threshold;
+    watch->m_Callback = callback;
+    watch->m_UserData = userData;
+    watch->m_Event = event;
+    watch->m_Current.resize(static_cast<size_t>(rect.m_Width) * rect.m_Height);
+    watch->m_Reference.resize(watch->m_Current.size());
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        watch->m_Id = m_NextWatchId++;
+        *outWatchId = watch->m_Id;
+
+        InsertIntoGrid(watch.get());
+        m_UnprimedWatches.push_back(watch.get());
+        m_Watches.emplace(watch->m_Id, std::move(watch));
+    }
+    m_Condition.notify_all();
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::RegionWatcher::RemoveWatch(uint32_t watchId)
+{
+    // Waiting for callbacks to finish would never return when called from one of them
+    std::unique_lock<std::mutex> dispatchLock(m_DispatchMutex, std::defer_lock);
+    if (m_DispatchThread.load() != std::this_thread::get_id())
+        dispatchLock.lock();
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    auto it = m_Watches.find(watchId);
+    if (it == m_Watches.end())
+        return TakoError::INVALID_ARGUMENT;
+
+    Watch* watch = it->second.get();
+    RemoveFromGrid(watch);
+    m_UnprimedWatches.erase(std::remove(m_UnprimedWatches.begin(), m_UnprimedWatches.end(), watch), m_UnprimedWatches.end());
+    m_Watches.erase(it);
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::RegionWatcher::OnFrame(const TakoFrameView& view, const TakoRect* dirtyRects, uint32_t numDirtyRects)
+{
+    if (dirtyRects == nullptr && numDirtyRects > 0)
+        return TakoError::INVALID_ARGUMENT;
+
+    if (GetBytesPerPixel(view.m_Format) != sizeof(uint32_t))
+        return TakoError::NOT_SUPPORTED;
+
+    std::vector<Notification> notifications;
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        Update(view, dirtyRects, numDirtyRects, &notifications);
+
+        m_UnprimedWatches.erase(std::remove_if(m_UnprimedWatches.begin(), m_UnprimedWatches.end(),
+            [](const Watch* watch) { return watch->m_PrimedArea == static_cast<uint64_t>(watch->m_Rect.m_Width) * watch->m_Rect.m_Height; }),
+            m_UnprimedWatches.end());
+    }
+
+    if (!notifications.empty())
+        Dispatch(notifications);
+
+    return TakoError::OK;
+}
+
+template <typename Function>
+void Tako::RegionWatcher::ForEachWatch(TakoRect rect, const Function& function)
+{
+    // A watch spanning several cells is listed in each of them, but should be visited once
+    uint64_t visitStamp = ++m_Stamp;
+    int32_t lastCellX = static_cast<int32_t>((int64_t(rect.m_X) + rect.m_Width - 1) >> CellShift);
+    int32_t lastCellY = static_cast<int32_t>((int64_t(rect.m_Y) + rect.m_Height - 1) >> CellShift);
+
+    for (int32_t cellY = rect.m_Y >> CellShift; cellY <= lastCellY; ++cellY)
+    {
+        for (int32_t cellX = rect.m_X >> CellShift; cellX <= lastCellX; ++cellX)
+        {
+            auto cell = m_Grid.find(GetCellKey(cellX, cellY));
+            if (cell == m_Grid.end())
+                continue;
+
+            for (Watch* watch : cell->second)
+            {
+                if (watch->m_VisitStamp == visitStamp)
+                    continue;
+                watch->m_VisitStamp = visitStamp;
+
+                function(watch);
+            }
+        }
+    }
+}
+
+void Tako::RegionWatcher::Update(const TakoFrameView& view, const TakoRect* dirtyRects, uint32_t numDirtyRects, std::vector<Notification>* outNotifications)
+{
+    // Watches seen for the first time take their content from this frame and have nothing to compare yet
+    for (Watch* watch : m_UnprimedWatches)
+        Prime(watch, view);
+
+    uint64_t frameStamp = ++m_Stamp;
+    m_ChangedWatches.clear();
+
+    for (uint32_t i = 0; i < numDirtyRects; ++i)
+    {
+        TakoRect dirtyRect = dirtyRects[i].Intersect(view.m_Rect);
+        if (dirtyRect.IsEmpty())
+            continue;
+
+        ForEachWatch(dirtyRect, [&](Watch* watch)
+        {
+            TakoRect rect = dirtyRect.Intersect(watch->m_Rect);
+            if (rect.IsEmpty() || !Compare(watch, view, rect))
+                return;
+
+            if (watch->m_ChangeStamp != frameStamp)
+            {
+                watch->m_ChangeStamp = frameStamp;
+                m_ChangedWatches.push_back(watch);
+            }
+        });
+    }
+
+    for (Watch* watch : m_ChangedWatches)
+    {
+        uint64_t area = static_cast<uint64_t>(watch->m_Rect.m_Width) * watch->m_Rect.m_Height;
+        if (watch->m_NumDiffering == 0 || watch->m_NumDiffering <= watch->m_Threshold * area)
+            continue;
+
+        outNotifications->push_back({ watch->m_Id, static_cast<float>(watch->m_NumDiffering) / area,
+            watch->m_Callback, watch->m_UserData, watch->m_Event });
+
+        // Later changes are measured against what the subscriber was just told about
+        watch->m_Reference = watch->m_Current;
+        watch->m_NumDiffering = 0;
+    }
+}
+
+void Tako::RegionWatcher::WatchLoop()
+{
+    while (m_Running)
+    {
+        TakoRect region = {};
+        bool priming;
+
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            if (!m_Running)
+                break;
+
+            for (const auto& [id, watch] : m_Watches)
+                region = region.Union(watch->m_Rect);
+
+            if (region.IsEmpty())
+            {
+                m_Condition.wait(lock);
+                continue;
+            }
+
+            priming = !m_UnprimedWatches.empty();
+        }
+
+        TakoDisplayBuffer displays[MaxNumDisplays];
+        uint32_t numDisplays;
+        TakoError err;
+
+        m_DirtyRects.clear();
+        m_Notifications.clear();
+
+        {
+            std::lock_guard<std::mutex> captureLock(g_CaptureMutex);
+
+            // New watches need the current content even when the screen is static
+            if (priming)
+                g_CaptureManager->Invalidate(CaptureClient::REGION_WATCHER);
+
+            // Changes of frames consumed by a capture that gave up are still reported by the next one
+            err = g_CaptureManager->Capture(CaptureClient::REGION_WATCHER, region, displays, &numDisplays, AcquireTimeoutMs, &m_DirtyRects);
+            if (err == TakoError::OK)
+            {
+                const std::vector<TakoRect>& displayRects = g_CaptureManager->GetDisplayRects();
+                std::lock_guard<std::mutex> lock(m_Mutex);
+
+                for (uint32_t i = 0; i < numDisplays && err == TakoError::OK; ++i)
+                {
+                    // Displays without a new frame have nothing to compare, but may still hold content for new watches.
+                    // Only the parts of the capture that some watch needs are read back.
+                    uint64_t& lastGeneration = m_LastGenerations[displays[i].m_DisplayIndex];
+                    TakoRect displayRect = region.Intersect(displayRects[displays[i].m_DisplayIndex]);
+                    GetReadbackRects(displayRect, displays[i].m_Generation != lastGeneration, &m_ReadbackRects);
+
+                    for (const TakoRect& readbackRect : m_ReadbackRects)
+                    {
+                        // Each readback replaces the view of the previous one, so it is compared right away
+                        TakoFrameView view;
+                        err = g_CaptureManager->Readback(CaptureClient::REGION_WATCHER, displays[i], readbackRect, &view);
+                        if (err != TakoError::OK)
+                        {
+                            // The changes were handed out with this capture and cannot be compared anymore
+                            ResetWatches();
+                            m_Notifications.clear();
+                            break;
+                        }
+
+                        Update(view, m_DirtyRects.data(), static_cast<uint32_t>(m_DirtyRects.size()), &m_Notifications);
+                    }
+
+                    lastGeneration = displays[i].m_Generation;
+                }
+
+                // Parts of a watch outside the desktop or on displays that cannot be captured never get content.
+                // Watches added since the region was taken were not captured and wait for the next round.
+                m_UnprimedWatches.erase(std::remove_if(m_UnprimedWatches.begin(), m_UnprimedWatches.end(),
+                    [&](const Watch* watch)
+                    {
+                        if (watch->m_Rect.Intersect(region) != watch->m_Rect)
+                            return false;
+
+                        for (uint32_t i = 0; i < numDisplays; ++i)
+                        {
+                            if (!IsPrimed(watch, watch->m_Rect.Intersect(displayRects[displays[i].m_DisplayIndex])))
+                                return false;
+                        }
+                        return true;
+                    }),
+                    m_UnprimedWatches.end());
+            }
+        }
+
+        if (!m_Notifications.empty())
+            Dispatch(m_Notifications);
+
+        // Most likely a display mode change or a desktop switch, give the system a moment
+        if (err != TakoError::OK && err != TakoError::EXPECTED_ERROR)
+            std::this_thread::sleep_for(std::chrono::milliseconds(AcquireTimeoutMs));
+    }
+}
+
+void Tako::RegionWatcher::GetReadbackRects(TakoRect displayRect, bool compare, std::vector<TakoRect>* out)
+{
+    out->clear();
+
+    for (Watch* watch : m_UnprimedWatches)
+    {
+        TakoRect piece = watch->m_Rect.Intersect(displayRect);
+        if (!IsPrimed(watch, piece))
+            out->push_back(piece);
+    }
+
+    for (uint32_t i = 0; compare && i < m_DirtyRects.size(); ++i)
+    {
+        TakoRect dirtyRect = m_DirtyRects[i].Intersect(displayRect);
+        if (dirtyRect.IsEmpty())
+            continue;
+
+        ForEachWatch(dirtyRect, [&](Watch* watch)
+        {
+            TakoRect part = dirtyRect.Intersect(watch->m_Rect);
+            if (!part.IsEmpty())
+                out->push_back(part);
+        });
+    }
+
+    if (out->size() > MaxReadbackRects)
+    {
+        TakoRect bounds = {};
+        for (const TakoRect& rect : *out)
+            bounds = bounds.Union(rect);
+        out->assign(1, bounds);
+    }
+
+    // Parts are merged until none overlap, so every pixel is read back once and the piece of a new watch on
+    // this display ends up whole in one view, as Prime expects
+    for (size_t i = 0; i < out->size(); ++i)
+    {
+        for (size_t j = i + 1; j < out->size(); ++j)
+        {
+            if ((*out)[i].Intersect((*out)[j]).IsEmpty())
+                continue;
+
+            (*out)[i] = (*out)[i].Union((*out)[j]);
+            out->erase(out->begin() + j);
+
+            // The grown rect may now overlap parts that were checked against it before
+            i = static_cast<size_t>(-1);
+            break;
+        }
+    }
+}
+
+void Tako::RegionWatcher::Prime(Watch* watch, const TakoFrameView& view)
+{
+    TakoRect piece = watch->m_Rect.Intersect(view.m_Rect);
+    if (piece.IsEmpty())
+        return;
+
+    bool overlapsPrimed = false;
+    for (const TakoRect& primed : watch->m_PrimedRects)
+    {
+        TakoRect overlap = primed.Intersect(piece);
+        if (overlap == piece)
+            return;
+
+        overlapsPrimed |= !overlap.IsEmpty();
+    }
+
+    // Views only partly covering what is already recorded do not come from the watch thread, start over with this one
+    if (overlapsPrimed)
+    {
+        watch->m_PrimedRects.clear();
+        watch->m_PrimedArea = 0;
+        watch->m_NumDiffering = 0;
+    }
+
+    const PixelKernelTable& kernels = GetPixelKernels();
+    for (uint32_t y = 0; y < piece.m_Height; ++y)
+    {
+        const uint32_t* src = reinterpret_cast<const uint32_t*>(view.m_Data + static_cast<size_t>(piece.m_Y - view.m_Rect.m_Y + y) * view.m_Pitch) +
+            (piece.m_X - view.m_Rect.m_X);
+        size_t offset = static_cast<size_t>(piece.m_Y - watch->m_Rect.m_Y + y) * watch->m_Rect.m_Width + (piece.m_X - watch->m_Rect.m_X);
+
+        kernels.m_CopyRow(&watch->m_Current[offset], src, piece.m_Width);
+        kernels.m_CopyRow(&watch->m_Reference[offset], src, piece.m_Width);
+    }
+
+    watch->m_PrimedRects.push_back(piece);
+    watch->m_PrimedArea += static_cast<uint64_t>(piece.m_Width) * piece.m_Height;
+}
+
+bool Tako::RegionWatcher::IsPrimed(const Watch* watch, TakoRect piece)
+{
+    if (piece.IsEmpty())
+        return true;
+
+    for (const TakoRect& primed : watch->m_PrimedRects)
+    {
+        if (primed.Intersect(piece) == piece)
+            return true;
+    }
+
+    return false;
+}
+
+bool Tako::RegionWatcher::Compare(Watch* watch, const TakoFrameView& view, TakoRect rect)
+{
+    const PixelKernelTable& kernels = GetPixelKernels();
+    bool changed = false;
+
+    for (const TakoRect& primed : watch->m_PrimedRects)
+    {
+        TakoRect part = rect.Intersect(primed);
+        if (part.IsEmpty())
+            continue;
+
+        for (uint32_t y = 0; y < part.m_Height; ++y)
+        {
+            const uint32_t* src = reinterpret_cast<const uint32_t*>(view.m_Data + static_cast<size_t>(part.m_Y - view.m_Rect.m_Y + y) * view.m_Pitch) +
+                (part.m_X - view.m_Rect.m_X);
+            size_t offset = static_cast<size_t>(part.m_Y - watch->m_Rect.m_Y + y) * watch->m_Rect.m_Width + (part.m_X - watch->m_Rect.m_X);
+            uint32_t* current = &watch->m_Current[offset];
+
+            // Dirty rects are coarse, most of the rows they cover are usually untouched
+            if (kernels.m_RowsEqual(src, current, part.m_Width))
+                continue;
+
+            // Keep the count of pixels that differ from the reference up to date without rescanning the region
+            const uint32_t* reference = &watch->m_Reference[offset];
+            int64_t delta = 0;
+            for (uint32_t x = 0; x < part.m_Width; ++x)
+            {
+                if (src[x] == current[x])
+                    continue;
+
+                delta += int64_t(src[x] != reference[x]) - int64_t(current[x] != reference[x]);
+                current[x] = src[x];
+            }
+
+            watch->m_NumDiffering += delta;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+void Tako::RegionWatcher::Dispatch(const std::vector<Notification>& notifications)
+{
+    std::lock_guard<std::mutex> dispatchLock(m_DispatchMutex);
+    m_DispatchThread = std::this_thread::get_id();
+
+    for (const Notification& notification : notifications)
+    {
+        // An earlier callback may have removed the watch
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if (m_Watches.find(notification.m_WatchId) == m_Watches.end())
+                continue;
+        }
+
+        if (notification.m_Callback != nullptr)
+            notification.m_Callback(notification.m_WatchId, notification.m_ChangedFraction, notification.m_UserData);
+
+        if (notification.m_Event != nullptr)
+            SetEvent(notification.m_Event);
+    }
+
+    m_DispatchThread = std::thread::id();
+}
+
+void Tako::RegionWatcher::ResetWatches()
+{
+    m_UnprimedWatches.clear();
+
+    for (const auto& [id, watch] : m_Watches)
+    {
+        watch->m_PrimedRects.clear();
+        watch->m_PrimedArea = 0;
+        watch->m_NumDiffering = 0;
+        m_UnprimedWatches.push_back(watch.get());
+    }
+}
+
+void Tako::RegionWatcher::InsertIntoGrid(Watch* watch)
+{
+    const TakoRect& rect = watch->m_Rect;
+    int32_t lastCellX = static_cast<int32_t>((int64_t(rect.m_X) + rect.m_Width - 1) >> CellShift);
+    int32_t lastCellY = static_cast<int32_t>((int64_t(rect.m_Y) + rect.m_Height - 1) >> CellShift);
+
+    for (int32_t cellY = rect.m_Y >> CellShift; cellY <= lastCellY; ++cellY)
+    {
+        for (int32_t cellX = rect.m_X >> CellShift; cellX <= lastCellX; ++cellX)
+            m_Grid[GetCellKey(cellX, cellY)].push_back(watch);
+    }
+}
+
+void Tako::RegionWatcher::RemoveFromGrid(Watch* watch)
+{
+    const TakoRect& rect = watch->m_Rect;
+    int32_t lastCellX = static_cast<int32_t>((int64_t(rect.m_X) + rect.m_Width - 1) >> CellShift);
+    int32_t lastCellY = static_cast<int32_t>((int64_t(rect.m_Y) + rect.m_Height - 1) >> CellShift);
+
+    for (int32_t cellY = rect.m_Y >> CellShift; cellY <= lastCellY; ++cellY)
+    {
+        for (int32_t cellX = rect.m_X >> CellShift; cellX <= lastCellX; ++cellX)
+        {
+            auto cell = m_Grid.find(GetCellKey(cellX, cellY));
+            if (cell == m_Grid.end())
+                continue;
+
+            std::vector<Watch*>& watches = cell->second;
+            watches.erase(std::remove(watches.begin(), watches.end(), watch), watches.end());
+            if (watches.empty())
+                m_Grid.erase(cell);
+        }
+    }
+}
+
+uint64_t Tako::RegionWatcher::GetCellKey(int32_t cellX, int32_t cellY)
+{
+    return (static_cast<uint64_t>(static_cast<uint32_t>(cellY)) << 32) | static_cast<uint32_t>(cellX);
+}
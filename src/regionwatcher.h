@@ -0,0 +1,140 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace Tako
+{
+    // Notifies subscribers when the content of a watched desktop region changes. Work is driven by the
+    // areas the displays report as changed: each dirty rect is looked up in a grid of watches and only
+    // the pixels it covers are compared, so a frame costs time in proportion to what changed on screen
+    // rather than to the number and size of the watches. Each watch keeps a copy of its region as it was
+    // when the watch last fired and a running count of the pixels that differ from it.
+    //
+    // While any watch exists the watcher captures from its own thread as a separate CaptureManager client,
+    // holding g_CaptureMutex while it reads the frames. Callbacks run once the lock is released, so they may
+    // capture as well. OnFrame can also be fed directly.
+    class RegionWatcher
+    {
+    public:
+        RegionWatcher() = default;
+        ~RegionWatcher() = default;
+
+        TakoError Initialize();
+        TakoError Shutdown();
+
+        // Fires once more than threshold (0 to 1) of rect has changed. callback runs on the watcher thread and
+        // event is signaled with SetEvent; either may be null. The event must stay open until the watch is removed.
+        TakoError AddWatch(TakoRect rect, float threshold, TakoWatchCallback callback, void* userData, HANDLE event, uint32_t* outWatchId);
+        // Once this returns the callback of the watch is not running and will not be called again
+        TakoError RemoveWatch(uint32_t watchId);
+
+        // Updates the watches from one captured view. Only the parts of the view covered by dirtyRects are
+        // compared; the first frame covering a watch just records its content.
+        TakoError OnFrame(const TakoFrameView& view, const TakoRect* dirtyRects, uint32_t numDirtyRects);
+
+    private:
+        static constexpr uint32_t AcquireTimeoutMs = 100;
+        static constexpr uint32_t CellShift = 8; // Grid cells are 256x256 pixels
+        static constexpr size_t MaxReadbackRects = 16; // Beyond this one readback of their bounding box is cheaper
+
+        struct Watch
+        {
+            uint32_t m_Id;
+            TakoRect m_Rect;
+            float m_Threshold;
+            TakoWatchCallback m_Callback;
+            void* m_UserData;
+            HANDLE m_Event;
+
+            // Tightly packed copies of the region: the latest content seen and the content it is compared against
+            std::vector<uint32_t> m_Current;
+            std::vector<uint32_t> m_Reference;
+            uint64_t m_NumDiffering = 0;
+
+            // Non-overlapping parts of the region that have been captured at least once
+            std::vector<TakoRect> m_PrimedRects;
+            uint64_t m_PrimedArea = 0;
+
+            uint64_t m_VisitStamp = 0; // Last dirty rect that looked at the watch
+            uint64_t m_ChangeStamp = 0; // Last frame that changed the watch
+        };
+
+        struct Notification
+        {
+            uint32_t m_WatchId;
+            float m_ChangedFraction;
+            TakoWatchCallback m_Callback;
+            void* m_UserData;
+            HANDLE m_Event;
+        };
+
+    private:
+        void WatchLoop();
+        // Expects m_Mutex to be held. The parts of a display the watches need from the latest capture: where they
+        // have no content yet and, if compare is set, where m_DirtyRects touch them. Overlapping parts are merged.
+        void GetReadbackRects(TakoRect displayRect, bool compare, std::vector<TakoRect>* out);
+        // Expects m_Mutex to be held; notifications are appended for Dispatch to deliver after it is released
+        void Update(const TakoFrameView& view, const TakoRect* dirtyRects, uint32_t numDirtyRects, std::vector<Notification>* outNotifications);
+        // Calls function once for every watch in the grid cells that rect touches
+        template <typename Function>
+        void ForEachWatch(TakoRect rect, const Function& function);
+        void Prime(Watch* watch, const TakoFrameView& view);
+        static bool IsPrimed(const Watch* watch, TakoRect piece);
+        bool Compare(Watch* watch, const TakoFrameView& view, TakoRect rect); // Returns whether any pixel changed
+        void Dispatch(const std::vector<Notification>& notifications);
+        void ResetWatches();
+
+        void InsertIntoGrid(Watch* watch);
+        void RemoveFromGrid(Watch* watch);
+
+        static uint64_t GetCellKey(int32_t cellX, int32_t cellY);
+
+    private:
+        std::atomic<bool> m_Running = false;
+        std::thread m_WatchThread;
+
+        std::mutex m_Mutex;
+        std::condition_variable m_Condition; // Wakes the watch thread when watches are added
+        std::unordered_map<uint32_t, std::unique_ptr<Watch>> m_Watches;
+        std::unordered_map<uint64_t, std::vector<Watch*>> m_Grid;
+        std::vector<Watch*> m_UnprimedWatches;
+        uint32_t m_NextWatchId = 1;
+        uint64_t m_Stamp = 0;
+        std::vector<Watch*> m_ChangedWatches;
+
+        // Held while callbacks run so RemoveWatch can wait for them, unless called from a callback
+        std::mutex m_DispatchMutex;
+        std::atomic<std::thread::id> m_DispatchThread;
+
+        // Only touched by the watch thread
+        std::vector<TakoRect> m_DirtyRects;
+        std::vector<TakoRect> m_ReadbackRects;
+        std::vector<Notification> m_Notifications;
+        uint64_t m_LastGenerations[MaxNumDisplays] = {};
+    };
+}
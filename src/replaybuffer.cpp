@@ -0,0 +1,347 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "replaybuffer.h"
+#include "compositor.h"
+#include "framediff.h"
+#include "frameview.h"
+
+extern Tako::Compositor* g_Compositor;
+
+Tako::TakoError Tako::ReplayBuffer::Initialize(TakoRect region, uint64_t budgetBytes, const TakoRedaction* redactions, uint32_t numRedactions)
+{
+    if (region.IsEmpty() || (redactions == nullptr && numRedactions > 0))
+        return TakoError::INVALID_ARGUMENT;
+
+    // Rejected here rather than by every Insert, which would leave the buffer silently empty
+    for (uint32_t i = 0; i < numRedactions; ++i)
+    {
+        if (!Redactor::IsValid(redactions[i]))
+            return TakoError::INVALID_ARGUMENT;
+    }
+
+    const size_t frameBytes = static_cast<size_t>(region.m_Width) * region.m_Height * sizeof(uint32_t);
+    const uint64_t stagingBytes = static_cast<uint64_t>(frameBytes) * NumStagingFrames;
+    const uint64_t keyframeBytes = sizeof(TakoStreamFrameHeader) + sizeof(TakoStreamChunk) + frameBytes;
+
+    // At least one keyframe has to fit next to the staging frames
+    if (budgetBytes < stagingBytes + keyframeBytes)
+        return TakoError::INVALID_ARGUMENT;
+
+    m_Region = region;
+    m_Redactions.assign(redactions, redactions + numRedactions);
+    m_SegmentBudget = budgetBytes - stagingBytes;
+    m_StartTime = std::chrono::steady_clock::now();
+
+    for (StagingFrame& frame : m_StagingFrames)
+    {
+        frame.m_Pixels.resize(frameBytes);
+        frame.m_View.m_Data = frame.m_Pixels.data();
+        frame.m_View.m_Pitch = region.m_Width * sizeof(uint32_t);
+        frame.m_View.m_Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+        frame.m_View.m_Rect = region;
+        frame.m_View.m_Generation = 0;
+        m_FreeFrames.push_back(&frame);
+    }
+
+    m_Running = true;
+    m_EncodeThread = std::thread(&ReplayBuffer::EncodeLoop, this);
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::ReplayBuffer::Shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_QueueMutex);
+        m_Running = false;
+    }
+    m_QueueCondition.notify_all();
+
+    if (m_EncodeThread.joinable())
+        m_EncodeThread.join();
+
+    if (m_SaveThread.joinable())
+        m_SaveThread.join();
+
+    std::lock_guard<std::mutex> lock(m_SegmentsMutex);
+    m_Segments.clear();
+    m_TotalBytes = 0;
+    m_EvictedSavingBytes = 0;
+
+    return TakoError::OK;
+}
+
+void Tako::ReplayBuffer::Insert(const TakoFrameView* views, uint32_t numViews)
+{
+    StagingFrame* frame = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(m_QueueMutex);
+        if (m_Running && !m_FreeFrames.empty())
+        {
+            frame = m_FreeFrames.back();
+            m_FreeFrames.pop_back();
+        }
+    }
+
+    // The encoder is behind, dropping the capture keeps the caller from waiting on it
+    if (frame == nullptr)
+    {
+        m_FramesDropped++;
+        m_DroppedSinceEncoded++;
+        return;
+    }
+
+    frame->m_TimestampUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_StartTime).count();
+    TakoError err = g_Compositor->RenderCompositeCpu(frame->m_View, views, numViews, m_Redactions.data(), static_cast<uint32_t>(m_Redactions.size()));
+
+    {
+        std::lock_guard<std::mutex> lock(m_QueueMutex);
+        if (err == TakoError::OK)
+            m_ReadyFrames.push_back(frame);
+        else
+            m_FreeFrames.push_back(frame);
+    }
+    m_QueueCondition.notify_one();
+}
+
+Tako::TakoError Tako::ReplayBuffer::Save(const wchar_t* path)
+{
+    if (path == nullptr)
+        return TakoError::INVALID_ARGUMENT;
+
+    if (m_Saving)
+        return TakoError::EXPECTED_ERROR;
+
+    if (m_SaveThread.joinable())
+        m_SaveThread.join();
+
+    // Encoded frames are immutable, so the snapshot only holds references while the file is written. Segments
+    // remember how much of them the snapshot holds, evicting them does not free that memory until the save ends.
+    std::vector<EncodedFrame> frames;
+    {
+        std::lock_guard<std::mutex> lock(m_SegmentsMutex);
+        for (Segment& segment : m_Segments)
+        {
+            frames.insert(frames.end(), segment.m_Frames.begin(), segment.m_Frames.end());
+            segment.m_SavingBytes = segment.m_Bytes;
+        }
+    }
+
+    if (frames.empty())
+        return TakoError::EXPECTED_ERROR;
+
+    m_Saving = true;
+    m_SaveThread = std::thread([this, path = std::wstring(path), frames = std::move(frames)]() mutable
+    {
+        TakoError result = WriteReplayFile(path, frames);
+        frames.clear();
+
+        {
+            std::lock_guard<std::mutex> lock(m_SegmentsMutex);
+            for (Segment& segment : m_Segments)
+                segment.m_SavingBytes = 0;
+            m_EvictedSavingBytes = 0;
+        }
+
+        m_LastSaveResult = result;
+        m_Saving = false;
+    });
+
+    return TakoError::OK;
+}
+
+void Tako::ReplayBuffer::GetStats(TakoStats* outStats) const
+{
+    std::lock_guard<std::mutex> lock(m_SegmentsMutex);
+
+    uint64_t durationUs = m_Segments.empty() ? 0 : m_Segments.back().m_EndUs - m_Segments.front().m_StartUs;
+
+    outStats->m_ReplayDurationUs = durationUs;
+    outStats->m_ReplayBytes = m_TotalBytes + m_EvictedSavingBytes;
+    outStats->m_ReplayFramesRecorded = m_FramesRecorded;
+    outStats->m_ReplayFramesDropped = m_FramesDropped;
+    outStats->m_ReplaySaving = m_Saving ? 1 : 0;
+    outStats->m_ReplayLastSaveResult = static_cast<uint32_t>(m_LastSaveResult.load());
+
+    // Until the buffer is full this extrapolates the current data rate to the whole budget
+    outStats->m_ReplayBudgetDurationUs = m_TotalBytes == 0 ? 0 :
+        static_cast<uint64_t>(static_cast<double>(durationUs) * static_cast<double>(m_SegmentBudget) / static_cast<double>(m_TotalBytes));
+}
+
+void Tako::ReplayBuffer::EncodeLoop()
+{
+    while (true)
+    {
+        StagingFrame* frame;
+        {
+            std::unique_lock<std::mutex> lock(m_QueueMutex);
+            m_QueueCondition.wait(lock, [this]() { return !m_Running || !m_ReadyFrames.empty(); });
+            if (!m_Running)
+                break;
+
+            frame = m_ReadyFrames.front();
+            m_ReadyFrames.pop_front();
+        }
+
+        bool stored = Encode(*frame);
+
+        // The encoded frame stays checked out as the reference for the next delta
+        std::lock_guard<std::mutex> lock(m_QueueMutex);
+        if (m_PreviousFrame != nullptr)
+            m_FreeFrames.push_back(m_PreviousFrame);
+
+        m_PreviousFrame = stored ? frame : nullptr;
+        if (!stored)
+            m_FreeFrames.push_back(frame);
+    }
+}
+
+bool Tako::ReplayBuffer::Encode(const StagingFrame& frame)
+{
+    bool keyframe = m_PreviousFrame == nullptr || frame.m_TimestampUs - m_SegmentStartUs >= SegmentDurationUs;
+    uint32_t numSkipped = m_DroppedSinceEncoded.exchange(0);
+
+    if (!keyframe)
+    {
+        m_DirtyRects.clear();
+        TakoError err = DiffFrameViews(frame.m_View, m_PreviousFrame->m_View, DiffTileSize, &m_DirtyRects);
+        keyframe = err != TakoError::OK || !Append(EncodeFrame(frame, m_DirtyRects, false, numSkipped), false, frame.m_TimestampUs);
+    }
+
+    if (keyframe)
+    {
+        m_DirtyRects.assign(1, m_Region);
+        if (!Append(EncodeFrame(frame, m_DirtyRects, true, numSkipped), true, frame.m_TimestampUs))
+        {
+            m_FramesDropped++;
+            return false;
+        }
+
+        m_SegmentStartUs = frame.m_TimestampUs;
+    }
+
+    m_FramesRecorded++;
+    return true;
+}
+
+Tako::ReplayBuffer::EncodedFrame Tako::ReplayBuffer::EncodeFrame(const StagingFrame& frame, const std::vector<TakoRect>& rects,
+    bool keyframe, uint32_t numSkipped)
+{
+    size_t size = sizeof(TakoStreamFrameHeader);
+    for (const TakoRect& rect : rects)
+        size += sizeof(TakoStreamChunk) + static_cast<size_t>(rect.m_Width) * rect.m_Height * sizeof(uint32_t);
+
+    auto encoded = std::make_shared<std::vector<uint8_t>>(size);
+    uint8_t* data = encoded->data();
+
+    TakoStreamFrameHeader header = {};
+    header.m_Magic = TakoStreamMagic;
+    header.m_Version = TakoStreamVersion;
+    header.m_FrameId = m_NextFrameId++;
+    header.m_TimestampUs = frame.m_TimestampUs;
+    header.m_Region = m_Region;
+    header.m_Format = static_cast<uint32_t>(frame.m_View.m_Format);
+    header.m_Flags = static_cast<uint32_t>(keyframe ? TakoStreamFlags::KEYFRAME : TakoStreamFlags::NONE);
+    header.m_NumChunks = static_cast<uint32_t>(rects.size());
+    header.m_NumSkippedFrames = numSkipped;
+    memcpy(data, &header, sizeof(header));
+    data += sizeof(header);
+
+    for (const TakoRect& rect : rects)
+    {
+        TakoStreamChunk chunk = {};
+        chunk.m_Rect = rect;
+        chunk.m_Size = rect.m_Width * rect.m_Height * sizeof(uint32_t);
+        memcpy(data, &chunk, sizeof(chunk));
+        data += sizeof(chunk);
+
+        TakoFrameView tile;
+        if (CropFrameView(frame.m_View, rect, &tile) == TakoError::OK)
+            CopyFrameView(tile, data, rect.m_Width * sizeof(uint32_t));
+
+        data += chunk.m_Size;
+    }
+
+    return encoded;
+}
+
+bool Tako::ReplayBuffer::Append(const EncodedFrame& frame, bool keyframe, uint64_t timestampUs)
+{
+    std::lock_guard<std::mutex> lock(m_SegmentsMutex);
+
+    const uint64_t size = frame->size();
+    if (!keyframe && m_Segments.empty())
+        return false;
+
+    // A delta needs the open segment, a keyframe starts a new one and may evict everything before it
+    const size_t numKept = keyframe ? 0 : 1;
+    while (m_Segments.size() > numKept && m_TotalBytes + m_EvictedSavingBytes + size > m_SegmentBudget)
+    {
+        m_TotalBytes -= m_Segments.front().m_Bytes;
+        m_EvictedSavingBytes += m_Segments.front().m_SavingBytes;
+        m_Segments.pop_front();
+    }
+
+    // While a save runs this may drop frames the budget would otherwise have room for
+    if (m_TotalBytes + m_EvictedSavingBytes + size > m_SegmentBudget)
+        return false;
+
+    if (keyframe)
+    {
+        m_Segments.emplace_back();
+        m_Segments.back().m_StartUs = timestampUs;
+    }
+
+    Segment& segment = m_Segments.back();
+    segment.m_Frames.push_back(frame);
+    segment.m_Bytes += size;
+    segment.m_EndUs = timestampUs;
+    m_TotalBytes += size;
+
+    return true;
+}
+
+Tako::TakoError Tako::ReplayBuffer::WriteReplayFile(const std::wstring& path, const std::vector<EncodedFrame>& frames)
+{
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return TakoError::IO_ERROR;
+
+    TakoError result = TakoError::OK;
+    for (const EncodedFrame& frame : frames)
+    {
+        const uint8_t* bytes = frame->data();
+        size_t remaining = frame->size();
+
+        while (remaining > 0 && result == TakoError::OK)
+        {
+            DWORD bytesWritten = 0;
+            DWORD chunkSize = static_cast<DWORD>(std::min<size_t>(remaining, 1u << 30));
+            if (!WriteFile(file, bytes, chunkSize, &bytesWritten, nullptr) || bytesWritten == 0)
+                result = TakoError::IO_ERROR;
+
+            bytes += bytesWritten;
+            remaining -= bytesWritten;
+        }
+    }
+
+    CloseHandle(file);
+    return result;
+}
@@ -0,0 +1,130 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace Tako
+{
+    // Keeps the most recent captures of one region in memory for "save the last N seconds". Frames are
+    // stored in the TakoStreamFrameHeader format: segments start with a keyframe and continue with the
+    // tiles that changed since the previous frame. When the memory budget is reached, whole segments
+    // are evicted oldest first, so the buffer always starts at a keyframe.
+    //
+    // Insert only composites into a free staging frame, applying the redactions given to Initialize, and queues
+    // it; diffing and encoding happen on a separate thread, and captures arriving while every staging frame is
+    // busy are dropped.
+    class ReplayBuffer
+    {
+    public:
+        ReplayBuffer() = default;
+        ~ReplayBuffer() = default;
+
+        // budgetBytes covers the staging frames as well as the encoded segments. The redactions are applied to
+        // every recorded frame.
+        TakoError Initialize(TakoRect region, uint64_t budgetBytes, const TakoRedaction* redactions, uint32_t numRedactions);
+        TakoError Shutdown();
+
+        // views are expected to cover the region of the buffer
+        void Insert(const TakoFrameView* views, uint32_t numViews);
+
+        inline TakoRect GetRegion() const { return m_Region; }
+
+        // Writes the buffered frames to path on a background thread. Fails with EXPECTED_ERROR if an
+        // earlier save is still running or nothing has been recorded yet.
+        TakoError Save(const wchar_t* path);
+
+        void GetStats(TakoStats* outStats) const;
+
+    private:
+        static constexpr uint32_t NumStagingFrames = 4; // One being filled, one queued, one encoding, one previous
+        static constexpr uint64_t SegmentDurationUs = 2000000;
+
+        struct StagingFrame
+        {
+            std::vector<uint8_t> m_Pixels; // Tightly packed BGRA rows of the region
+            TakoFrameView m_View;
+            uint64_t m_TimestampUs = 0;
+        };
+
+        using EncodedFrame = std::shared_ptr<const std::vector<uint8_t>>;
+
+        struct Segment
+        {
+            std::vector<EncodedFrame> m_Frames; // The first frame is a keyframe
+            uint64_t m_Bytes = 0;
+            uint64_t m_SavingBytes = 0; // Part of m_Bytes referenced by the running save
+            uint64_t m_StartUs = 0;
+            uint64_t m_EndUs = 0;
+        };
+
+    private:
+        void EncodeLoop();
+        bool Encode(const StagingFrame& frame);
+        EncodedFrame EncodeFrame(const StagingFrame& frame, const std::vector<TakoRect>& rects, bool keyframe, uint32_t numSkipped);
+
+        // Fails if the frame does not fit the budget, which for a delta means a keyframe has to be stored instead.
+        // Evicted frames that a running save still writes out keep counting against the budget until it is done.
+        bool Append(const EncodedFrame& frame, bool keyframe, uint64_t timestampUs);
+
+        static TakoError WriteReplayFile(const std::wstring& path, const std::vector<EncodedFrame>& frames);
+
+    private:
+        TakoRect m_Region = {};
+        std::vector<TakoRedaction> m_Redactions;
+        uint64_t m_SegmentBudget = 0;
+        std::chrono::steady_clock::time_point m_StartTime;
+
+        std::mutex m_QueueMutex;
+        std::condition_variable m_QueueCondition;
+        bool m_Running = false;
+        StagingFrame m_StagingFrames[NumStagingFrames];
+        std::vector<StagingFrame*> m_FreeFrames;
+        std::deque<StagingFrame*> m_ReadyFrames;
+        std::thread m_EncodeThread;
+
+        // Only touched by the encode thread
+        StagingFrame* m_PreviousFrame = nullptr;
+        std::vector<TakoRect> m_DirtyRects;
+        uint64_t m_NextFrameId = 1;
+        uint64_t m_SegmentStartUs = 0;
+
+        mutable std::mutex m_SegmentsMutex;
+        std::deque<Segment> m_Segments;
+        uint64_t m_TotalBytes = 0;
+        uint64_t m_EvictedSavingBytes = 0; // Evicted, but kept alive by the running save
+
+        std::thread m_SaveThread;
+        std::atomic<bool> m_Saving = false;
+        std::atomic<TakoError> m_LastSaveResult = TakoError::OK;
+
+        std::atomic<uint64_t> m_FramesRecorded = 0;
+        std::atomic<uint64_t> m_FramesDropped = 0;
+        std::atomic<uint32_t> m_DroppedSinceEncoded = 0;
+    };
+}
@@ -0,0 +1,93 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+Texture2D g_Source          : register( t0 );
+
+// Pixelate and blur run as two passes over one axis each, first down the columns into an intermediate
+// float texture and then along the rows into the target. Both average exactly the pixels the CPU Redactor does.
+cbuffer RedactionConstants  : register( b0 )
+{
+    float4 g_FillColor;
+    int2 g_Size;            // Size of the redacted region, which sits at the origin of g_Source
+    int2 g_Axis;            // (0, 1) for the vertical pass, (1, 0) for the horizontal one
+    float2 g_SourceSize;    // Size of g_Source in texels
+    uint g_Strength;        // Block size or blur radius in pixels
+    uint g_Mode;            // TakoRedactionMode
+    uint g_Quantize;        // Rounds to 8 bits per channel, like the rows between the CPU blur passes
+    float3 g_Padding;
+};
+
+struct PS_INPUT
+{
+    float4 Position         : SV_POSITION;
+    float2 UV               : TEXCOORD;
+};
+
+static const uint ModeFill = 0;
+static const uint ModePixelate = 1;
+
+float4 LoadAlongAxis(int2 pixel, int position)
+{
+    return g_Source.Load(int3(pixel * (1 - g_Axis) + g_Axis * position, 0));
+}
+
+float4 PS_Redact(PS_INPUT input) : SV_Target
+{
+    if (g_Mode == ModeFill)
+        return g_FillColor;
+
+    int2 pixel = int2(input.UV * g_SourceSize);
+    int position = dot(pixel, g_Axis);
+    int size = dot(g_Size, g_Axis);
+    int strength = int(g_Strength);
+
+    float4 sum = 0;
+    float count;
+
+    if (g_Mode == ModePixelate)
+    {
+        // Blocks start at the region origin, the last one along the axis is cut short by its edge
+        int first = position / strength * strength;
+        int last = min(first + strength, size) - 1;
+
+        [loop]
+        for (int i = first; i <= last; ++i)
+            sum += LoadAlongAxis(pixel, i);
+
+        count = last - first + 1;
+    }
+    else
+    {
+        // The edge pixels stand in for everything past the region, so they are weighted by how often they
+        // repeat and the loop only visits pixels inside it
+        int first = position - strength;
+        int last = position + strength;
+
+        [loop]
+        for (int i = max(first, 0); i <= min(last, size - 1); ++i)
+            sum += LoadAlongAxis(pixel, i);
+
+        sum += LoadAlongAxis(pixel, 0) * max(-first, 0);
+        sum += LoadAlongAxis(pixel, size - 1) * max(last - (size - 1), 0);
+        count = 2 * strength + 1;
+    }
+
+    float4 average = sum / count;
+    return g_Quantize ? round(average * 255.0) / 255.0 : average;
+}
@@ -0,0 +1,241 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sparseframebuffer.h"
+#include "framediff.h"
+#include "frameview.h"
+#include "pixelkernels.h"
+#include "threadpool.h"
+
+extern Tako::ThreadPool* g_ThreadPool;
+
+Tako::TakoError Tako::SparseFramebuffer::Initialize(TakoRect bounds, const TakoRect* populatedRects, uint32_t numPopulatedRects)
+{
+    if (bounds.IsEmpty())
+        return TakoError::INVALID_ARGUMENT;
+
+    m_Bounds = bounds;
+    m_NumColumns = (bounds.m_Width + TileSize - 1) / TileSize;
+    m_NumRows = (bounds.m_Height + TileSize - 1) / TileSize;
+    m_TileIndices.assign(static_cast<size_t>(m_NumColumns) * m_NumRows, NoTile);
+    m_Tiles.clear();
+
+    size_t numPixels = 0;
+    for (uint32_t row = 0; row < m_NumRows; ++row)
+    {
+        for (uint32_t column = 0; column < m_NumColumns; ++column)
+        {
+            TakoRect cell = { bounds.m_X + static_cast<int32_t>(column * TileSize), bounds.m_Y + static_cast<int32_t>(row * TileSize), TileSize, TileSize };
+            cell = cell.Intersect(bounds);
+
+            bool populated = false;
+            for (uint32_t i = 0; i < numPopulatedRects && !populated; ++i)
+                populated = !cell.Intersect(populatedRects[i]).IsEmpty();
+
+            if (!populated)
+                continue;
+
+            m_TileIndices[static_cast<size_t>(row) * m_NumColumns + column] = static_cast<int32_t>(m_Tiles.size());
+            m_Tiles.push_back({ cell, numPixels });
+            numPixels += static_cast<size_t>(cell.m_Width) * cell.m_Height;
+        }
+    }
+
+    // Parts of populated tiles outside every display are never composited and keep reading as fill
+    m_Pixels.assign(numPixels, FillColor);
+    m_TileDirtyRects.resize(m_Tiles.size());
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::SparseFramebuffer::Shutdown()
+{
+    m_TileIndices.clear();
+    m_Tiles.clear();
+    m_Pixels.clear();
+    m_Pixels.shrink_to_fit();
+    m_TileDirtyRects.clear();
+
+    return TakoError::OK;
+}
+
+Tako::TakoFrameView Tako::SparseFramebuffer::GetTileView(uint32_t tileIndex) const
+{
+    const Tile& tile = m_Tiles[tileIndex];
+
+    TakoFrameView view;
+    view.m_Data = reinterpret_cast<uint8_t*>(const_cast<uint32_t*>(m_Pixels.data() + tile.m_Offset));
+    view.m_Pitch = tile.m_Rect.m_Width * sizeof(uint32_t);
+    view.m_Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    view.m_Rect = tile.m_Rect;
+    view.m_Generation = 0;
+
+    return view;
+}
+
+Tako::TakoError Tako::SparseFramebuffer::Composite(const TakoFrameView* views, uint32_t numViews)
+{
+    TakoError err;
+
+    bool swizzles[MaxNumDisplays];
+    numViews = std::min(numViews, MaxNumDisplays);
+
+    for (uint32_t i = 0; i < numViews; ++i)
+    {
+        err = GetConversion(views[i].m_Format, DXGI_FORMAT_B8G8R8A8_UNORM, &swizzles[i]);
+        if (err != TakoError::OK)
+            return err;
+    }
+
+    const PixelKernelTable& kernels = GetPixelKernels();
+
+    g_ThreadPool->ParallelFor(GetNumTiles(), 1, [&](uint32_t begin, uint32_t end)
+    {
+        for (uint32_t tileIndex = begin; tileIndex < end; ++tileIndex)
+        {
+            TakoFrameView tile = GetTileView(tileIndex);
+
+            for (uint32_t i = 0; i < numViews; ++i)
+            {
+                TakoFrameView source;
+                if (CropFrameView(views[i], tile.m_Rect, &source) != TakoError::OK)
+                    continue;
+
+                uint32_t dstX = static_cast<uint32_t>(source.m_Rect.m_X - tile.m_Rect.m_X);
+                uint32_t dstY = static_cast<uint32_t>(source.m_Rect.m_Y - tile.m_Rect.m_Y);
+
+                for (uint32_t y = 0; y < source.m_Rect.m_Height; ++y)
+                {
+                    uint32_t* dstRow = reinterpret_cast<uint32_t*>(tile.m_Data + static_cast<size_t>(dstY + y) * tile.m_Pitch) + dstX;
+                    const uint32_t* srcRow = reinterpret_cast<const uint32_t*>(source.m_Data + static_cast<size_t>(y) * source.m_Pitch);
+
+                    if (swizzles[i])
+                        kernels.m_SwizzleRow(dstRow, srcRow, source.m_Rect.m_Width);
+                    else
+                        kernels.m_CopyRow(dstRow, srcRow, source.m_Rect.m_Width);
+                }
+            }
+        }
+    });
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::SparseFramebuffer::Diff(const SparseFramebuffer& previous, std::vector<TakoRect>* outDirtyRects)
+{
+    if (!(previous.m_Bounds == m_Bounds) || previous.m_TileIndices != m_TileIndices)
+        return TakoError::INVALID_ARGUMENT;
+
+    std::atomic<bool> failed = false;
+
+    g_ThreadPool->ParallelFor(GetNumTiles(), 1, [&](uint32_t begin, uint32_t end)
+    {
+        for (uint32_t tileIndex = begin; tileIndex < end; ++tileIndex)
+        {
+            m_TileDirtyRects[tileIndex].clear();
+            if (DiffFrameViews(GetTileView(tileIndex), previous.GetTileView(tileIndex), DiffTileSize, &m_TileDirtyRects[tileIndex]) != TakoError::OK)
+                failed = true;
+        }
+    });
+
+    if (failed)
+        return TakoError::UNEXPECTED_ERROR;
+
+    for (const std::vector<TakoRect>& tileDirtyRects : m_TileDirtyRects)
+        outDirtyRects->insert(outDirtyRects->end(), tileDirtyRects.begin(), tileDirtyRects.end());
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::SparseFramebuffer::Readback(TakoRect rect, DXGI_FORMAT format, void* dst, uint32_t dstPitch) const
+{
+    TakoError err;
+
+    if (rect.IsEmpty() || dst == nullptr || dstPitch < static_cast<uint64_t>(rect.m_Width) * GetBytesPerPixel(format))
+        return TakoError::INVALID_ARGUMENT;
+
+    bool swizzle;
+    err = GetConversion(DXGI_FORMAT_B8G8R8A8_UNORM, format, &swizzle);
+    if (err != TakoError::OK)
+        return err;
+
+    const PixelKernelTable& kernels = GetPixelKernels();
+    const int32_t boundsRight = m_Bounds.m_X + static_cast<int32_t>(m_Bounds.m_Width);
+    const int32_t boundsBottom = m_Bounds.m_Y + static_cast<int32_t>(m_Bounds.m_Height);
+
+    g_ThreadPool->ParallelFor(rect.m_Height, GetBandHeight(rect.m_Width * sizeof(uint32_t)), [&](uint32_t begin, uint32_t end)
+    {
+        for (uint32_t y = begin; y < end; ++y)
+        {
+            uint32_t* dstRow = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(dst) + static_cast<size_t>(y) * dstPitch);
+            int32_t desktopY = rect.m_Y + static_cast<int32_t>(y);
+
+            if (desktopY < m_Bounds.m_Y || desktopY >= boundsBottom)
+            {
+                kernels.m_FillRow(dstRow, FillColor, rect.m_Width);
+                continue;
+            }
+
+            const uint32_t row = static_cast<uint32_t>(desktopY - m_Bounds.m_Y) / TileSize;
+
+            // Walk the row one grid cell at a time, copying populated cells and filling everything else
+            uint32_t x = 0;
+            while (x < rect.m_Width)
+            {
+                int32_t desktopX = rect.m_X + static_cast<int32_t>(x);
+                int32_t spanEnd = rect.m_X + static_cast<int32_t>(rect.m_Width);
+                int32_t tileIndex = NoTile;
+
+                if (desktopX < m_Bounds.m_X)
+                {
+                    spanEnd = std::min(spanEnd, m_Bounds.m_X);
+                }
+                else if (desktopX < boundsRight)
+                {
+                    uint32_t column = static_cast<uint32_t>(desktopX - m_Bounds.m_X) / TileSize;
+                    spanEnd = std::min(spanEnd, m_Bounds.m_X + static_cast<int32_t>((column + 1) * TileSize));
+                    spanEnd = std::min(spanEnd, boundsRight);
+                    tileIndex = m_TileIndices[static_cast<size_t>(row) * m_NumColumns + column];
+                }
+
+                uint32_t spanWidth = static_cast<uint32_t>(spanEnd - desktopX);
+
+                if (tileIndex == NoTile)
+                {
+                    kernels.m_FillRow(dstRow + x, FillColor, spanWidth);
+                }
+                else
+                {
+                    const Tile& tile = m_Tiles[tileIndex];
+                    const uint32_t* srcRow = m_Pixels.data() + tile.m_Offset +
+                        static_cast<size_t>(desktopY - tile.m_Rect.m_Y) * tile.m_Rect.m_Width + (desktopX - tile.m_Rect.m_X);
+
+                    if (swizzle)
+                        kernels.m_SwizzleRow(dstRow + x, srcRow, spanWidth);
+                    else
+                        kernels.m_CopyRow(dstRow + x, srcRow, spanWidth);
+                }
+
+                x += spanWidth;
+            }
+        }
+    });
+
+    return TakoError::OK;
+}
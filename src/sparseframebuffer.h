@@ -0,0 +1,75 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+
+namespace Tako
+{
+    // CPU framebuffer for rects too large or too empty to hold densely, such as the whole desktop of a
+    // staggered multi-display layout. Bounds are split into fixed tiles and only tiles overlapping a
+    // populated rect get storage, so memory follows the real pixels rather than the bounding box.
+    // Compositing and diffing visit populated tiles only; reads of the gaps return FillColor.
+    class SparseFramebuffer
+    {
+    public:
+        static constexpr uint32_t TileSize = 256;
+        static constexpr uint32_t FillColor = 0xFF000000;
+
+        SparseFramebuffer() = default;
+        ~SparseFramebuffer() = default;
+
+        TakoError Initialize(TakoRect bounds, const TakoRect* populatedRects, uint32_t numPopulatedRects);
+        TakoError Shutdown();
+
+        // Copies the views into the tiles they overlap; pixels outside every view keep their contents
+        TakoError Composite(const TakoFrameView* views, uint32_t numViews);
+
+        // Compares against a framebuffer with the same layout. Dirty rects are in desktop coordinates and
+        // never cross a tile border.
+        TakoError Diff(const SparseFramebuffer& previous, std::vector<TakoRect>* outDirtyRects);
+
+        // Copies rect into dst, converting to format; rect may extend past the bounds
+        TakoError Readback(TakoRect rect, DXGI_FORMAT format, void* dst, uint32_t dstPitch) const;
+
+        inline TakoRect GetBounds() const { return m_Bounds; }
+        inline uint32_t GetNumTiles() const { return static_cast<uint32_t>(m_Tiles.size()); }
+        inline uint64_t GetMemoryBytes() const { return m_Pixels.size() * sizeof(uint32_t); }
+        TakoFrameView GetTileView(uint32_t tileIndex) const;
+
+    private:
+        struct Tile
+        {
+            TakoRect m_Rect; // Clipped to the bounds, rows are m_Rect.m_Width pixels apart
+            size_t m_Offset; // In pixels, into m_Pixels
+        };
+
+        static constexpr int32_t NoTile = -1;
+
+    private:
+        TakoRect m_Bounds = {};
+        uint32_t m_NumColumns = 0;
+        uint32_t m_NumRows = 0;
+        std::vector<int32_t> m_TileIndices; // Per grid cell, NoTile for gaps
+        std::vector<Tile> m_Tiles;
+        std::vector<uint32_t> m_Pixels;
+        std::vector<std::vector<TakoRect>> m_TileDirtyRects;
+    };
+}
@@ -0,0 +1,595 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "streamserver.h"
+#include "frameview.h"
+
+Tako::TakoError Tako::StreamServer::Initialize(const wchar_t* pipeName, CaptureFunction capture)
+{
+    if (pipeName == nullptr || capture == nullptr)
+        return TakoError::INVALID_ARGUMENT;
+
+    TakoError err = InitializeSecurity();
+    if (err != TakoError::OK)
+        return err;
+
+    m_PipeName = pipeName;
+    m_Capture = std::move(capture);
+
+    // Creating the first instance here reports a bad or taken name to the caller instead of the accept thread
+    HANDLE pipe = CreatePipeInstance(FILE_FLAG_FIRST_PIPE_INSTANCE);
+    if (pipe == INVALID_HANDLE_VALUE)
+        return GetLastError() == ERROR_ACCESS_DENIED ? TakoError::EXPECTED_ERROR : TakoError::IO_ERROR;
+
+    m_StartTime = std::chrono::steady_clock::now();
+    m_Running = true;
+    m_AcceptStopped = false;
+
+    m_AcceptThread = std::thread(&StreamServer::AcceptLoop, this, pipe);
+    m_CaptureThread = std::thread(&StreamServer::CaptureLoop, this);
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::StreamServer::Shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_SubscribersMutex);
+        m_Running = false;
+    }
+    m_SubscribersCondition.notify_all();
+
+    // Connecting ourselves releases the accept thread from ConnectNamedPipe. It may be between pipe
+    // instances at this point, so keep trying until it has noticed.
+    while (!m_AcceptStopped)
+    {
+        HANDLE wakeup = CreateFileW(m_PipeName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+        if (wakeup != INVALID_HANDLE_VALUE)
+            CloseHandle(wakeup);
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    if (m_AcceptThread.joinable())
+        m_AcceptThread.join();
+
+    if (m_CaptureThread.joinable())
+        m_CaptureThread.join();
+
+    // Subscriber threads may still need the subscribers lock on their way out, so join them without it
+    std::vector<std::unique_ptr<Subscriber>> subscribers;
+    {
+        std::lock_guard<std::mutex> lock(m_SubscribersMutex);
+        subscribers.swap(m_Subscribers);
+    }
+
+    for (std::unique_ptr<Subscriber>& subscriber : subscribers)
+    {
+        CloseSubscriber(subscriber.get());
+        if (subscriber->m_Thread.joinable())
+            subscriber->m_Thread.join();
+        CloseHandle(subscriber->m_Pipe);
+    }
+
+    m_PreviousFrame.reset();
+    m_FramePool.clear();
+
+    return TakoError::OK;
+}
+
+void Tako::StreamServer::GetStats(TakoStats* outStats) const
+{
+    std::lock_guard<std::mutex> lock(m_SubscribersMutex);
+
+    outStats->m_NumStreamSubscribers = 0;
+    for (const std::unique_ptr<Subscriber>& subscriber : m_Subscribers)
+    {
+        std::lock_guard<std::mutex> subscriberLock(subscriber->m_Mutex);
+        if (subscriber->m_Active && !subscriber->m_Closed)
+            outStats->m_NumStreamSubscribers++;
+    }
+
+    outStats->m_StreamFramesSent = m_FramesSent.load(std::memory_order_relaxed);
+    outStats->m_StreamFramesSkipped = m_FramesSkipped.load(std::memory_order_relaxed);
+}
+
+Tako::TakoFrameView Tako::StreamServer::Frame::GetView() const
+{
+    TakoFrameView view;
+    view.m_Data = const_cast<uint8_t*>(m_Pixels.data());
+    view.m_Pitch = m_Rect.m_Width * sizeof(uint32_t);
+    view.m_Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    view.m_Rect = m_Rect;
+    view.m_Generation = m_Id;
+    return view;
+}
+
+Tako::TakoError Tako::StreamServer::InitializeSecurity()
+{
+    HANDLE token;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token))
+        return TakoError::UNEXPECTED_ERROR;
+
+    DWORD size = 0;
+    GetTokenInformation(token, TokenUser, nullptr, 0, &size);
+    m_TokenUser.resize(size);
+    bool queried = size > 0 && GetTokenInformation(token, TokenUser, m_TokenUser.data(), size, &size);
+    CloseHandle(token);
+
+    if (!queried)
+        return TakoError::UNEXPECTED_ERROR;
+
+    PSID sid = reinterpret_cast<TOKEN_USER*>(m_TokenUser.data())->User.Sid;
+    m_Acl.resize(sizeof(ACL) + sizeof(ACCESS_ALLOWED_ACE) - sizeof(DWORD) + GetLengthSid(sid));
+    PACL acl = reinterpret_cast<PACL>(m_Acl.data());
+
+    // A DACL with a single entry denies everyone else, unlike a null DACL which allows everyone
+    if (!InitializeAcl(acl, static_cast<DWORD>(m_Acl.size()), ACL_REVISION) ||
+        !AddAccessAllowedAce(acl, ACL_REVISION, GENERIC_ALL, sid) ||
+        !InitializeSecurityDescriptor(&m_SecurityDescriptor, SECURITY_DESCRIPTOR_REVISION) ||
+        !SetSecurityDescriptorDacl(&m_SecurityDescriptor, TRUE, acl, FALSE))
+        return TakoError::UNEXPECTED_ERROR;
+
+    m_SecurityAttributes.nLength = sizeof(SECURITY_ATTRIBUTES);
+    m_SecurityAttributes.lpSecurityDescriptor = &m_SecurityDescriptor;
+    m_SecurityAttributes.bInheritHandle = FALSE;
+
+    return TakoError::OK;
+}
+
+HANDLE Tako::StreamServer::CreatePipeInstance(DWORD flags)
+{
+    return CreateNamedPipeW(m_PipeName.c_str(), PIPE_ACCESS_DUPLEX | flags, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        PIPE_UNLIMITED_INSTANCES, ChunkSize * 4, sizeof(TakoStreamRequest), 0, &m_SecurityAttributes);
+}
+
+void Tako::StreamServer::AcceptLoop(HANDLE pipe)
+{
+    while (m_Running)
+    {
+        // Running out of resources is hopefully temporary, keep the server alive and try again
+        if (pipe == INVALID_HANDLE_VALUE)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(AcquireTimeoutMs));
+            pipe = CreatePipeInstance(0);
+            continue;
+        }
+
+        bool connected = ConnectNamedPipe(pipe, nullptr) || GetLastError() == ERROR_PIPE_CONNECTED;
+        if (!connected || !m_Running)
+        {
+            CloseHandle(pipe);
+            pipe = m_Running ? CreatePipeInstance(0) : INVALID_HANDLE_VALUE;
+            continue;
+        }
+
+        // Open the next instance right away, so clients arriving meanwhile find one to connect to
+        HANDLE connectedPipe = pipe;
+        pipe = CreatePipeInstance(0);
+
+        std::lock_guard<std::mutex> lock(m_SubscribersMutex);
+
+        // Reap subscribers that have disconnected since the last client arrived
+        for (auto it = m_Subscribers.begin(); it != m_Subscribers.end();)
+        {
+            bool closed;
+            {
+                std::lock_guard<std::mutex> subscriberLock((*it)->m_Mutex);
+                closed = (*it)->m_Closed;
+            }
+
+            if (!closed)
+            {
+                ++it;
+                continue;
+            }
+
+            (*it)->m_Thread.join();
+            CloseHandle((*it)->m_Pipe);
+            it = m_Subscribers.erase(it);
+        }
+
+        m_Subscribers.push_back(std::make_unique<Subscriber>());
+        m_Subscribers.back()->m_Pipe = connectedPipe;
+        m_Subscribers.back()->m_Thread = std::thread(&StreamServer::SubscriberLoop, this, m_Subscribers.back().get());
+    }
+
+    if (pipe != INVALID_HANDLE_VALUE)
+        CloseHandle(pipe);
+
+    m_AcceptStopped = true;
+}
+
+void Tako::StreamServer::CaptureLoop()
+{
+    auto lastCapture = std::chrono::steady_clock::now();
+
+    while (m_Running)
+    {
+        TakoRect region = {};
+        uint32_t maxFps = 0;
+
+        {
+            std::unique_lock<std::mutex> lock(m_SubscribersMutex);
+            if (!m_Running)
+                break;
+
+            // Capture the smallest rect that satisfies every subscriber, at the rate of the fastest one
+            for (const std::unique_ptr<Subscriber>& subscriber : m_Subscribers)
+            {
+                std::lock_guard<std::mutex> subscriberLock(subscriber->m_Mutex);
+                if (!subscriber->m_Active || subscriber->m_Closed)
+                    continue;
+
+                region = region.Union(subscriber->m_Region);
+                maxFps = std::max(maxFps, subscriber->m_MaxFps);
+            }
+
+            if (region.IsEmpty())
+            {
+                m_SubscribersCondition.wait(lock);
+                continue;
+            }
+
+            auto nextCapture = lastCapture + std::chrono::microseconds(1000000 / maxFps);
+            if (m_SubscribersCondition.wait_until(lock, nextCapture, [this]() { return !m_Running; }))
+                break;
+        }
+
+        lastCapture = std::chrono::steady_clock::now();
+
+        std::shared_ptr<Frame> frame;
+        TakoError err = CaptureFrame(region, &frame);
+        if (err == TakoError::EXPECTED_ERROR)
+            continue;
+
+        if (err != TakoError::OK)
+        {
+            // Most likely a display mode change or a desktop switch, give the system a moment
+            std::this_thread::sleep_for(std::chrono::milliseconds(AcquireTimeoutMs));
+            continue;
+        }
+
+        Publish(frame);
+        m_PreviousFrame = frame;
+    }
+}
+
+Tako::TakoError Tako::StreamServer::CaptureFrame(TakoRect region, std::shared_ptr<Frame>* out)
+{
+    TakoError err;
+
+    std::shared_ptr<Frame> frame = GetFreeFrame();
+    frame->m_Rect = region;
+    frame->m_Pixels.resize(static_cast<size_t>(region.m_Width) * region.m_Height * sizeof(uint32_t));
+    frame->m_MoveRects.clear();
+    frame->m_DirtyRects.clear();
+
+    err = m_Capture(region, frame->GetView());
+    if (err != TakoError::OK)
+        return err;
+
+    // Ids only count frames that were captured, the motion detector caches hashes by them
+    frame->m_Id = m_NextFrameId++;
+    frame->m_TimestampUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_StartTime).count();
+
+    frame->m_Keyframe = m_PreviousFrame == nullptr || !(m_PreviousFrame->m_Rect == region);
+    if (!frame->m_Keyframe)
+    {
+        err = m_MotionDetector.Detect(frame->GetView(), m_PreviousFrame->GetView(), &frame->m_MoveRects, &frame->m_DirtyRects);
+        if (err != TakoError::OK)
+            return err;
+    }
+
+    *out = frame;
+    return TakoError::OK;
+}
+
+std::shared_ptr<Tako::StreamServer::Frame> Tako::StreamServer::GetFreeFrame()
+{
+    // A frame is free again once neither the previous-frame slot nor any subscriber refers to it
+    for (std::shared_ptr<Frame>& frame : m_FramePool)
+    {
+        if (frame.use_count() == 1)
+            return frame;
+    }
+
+    m_FramePool.push_back(std::make_shared<Frame>());
+    return m_FramePool.back();
+}
+
+void Tako::StreamServer::Publish(const std::shared_ptr<const Frame>& frame)
+{
+    std::lock_guard<std::mutex> lock(m_SubscribersMutex);
+
+    for (std::unique_ptr<Subscriber>& subscriber : m_Subscribers)
+    {
+        {
+            std::lock_guard<std::mutex> subscriberLock(subscriber->m_Mutex);
+            if (!subscriber->m_Active || subscriber->m_Closed)
+                continue;
+
+            if (frame->m_Keyframe)
+                subscriber->m_NeedsKeyframe = true;
+
+            if (subscriber->m_Pending != nullptr)
+            {
+                // The subscriber is still busy with an older frame, fold that one into the new frame
+                if (!subscriber->m_Merged)
+                    AppendChangedRects(*subscriber->m_Pending, subscriber->m_Region, &subscriber->m_MergedDirtyRects);
+
+                AppendChangedRects(*frame, subscriber->m_Region, &subscriber->m_MergedDirtyRects);
+                subscriber->m_Merged = true;
+                subscriber->m_NumSkipped++;
+                m_FramesSkipped.fetch_add(1, std::memory_order_relaxed);
+
+                if (subscriber->m_MergedDirtyRects.size() > MaxMergedDirtyRects)
+                    subscriber->m_NeedsKeyframe = true;
+            }
+
+            subscriber->m_Pending = frame;
+        }
+
+        subscriber->m_Condition.notify_one();
+    }
+}
+
+void Tako::StreamServer::CloseSubscriber(Subscriber* subscriber)
+{
+    {
+        std::lock_guard<std::mutex> lock(subscriber->m_Mutex);
+        subscriber->m_Closed = true;
+        subscriber->m_Pending.reset();
+    }
+    subscriber->m_Condition.notify_one();
+
+    // Breaks a blocking read or write on the subscriber thread
+    CancelSynchronousIo(subscriber->m_Thread.native_handle());
+    DisconnectNamedPipe(subscriber->m_Pipe);
+}
+
+void Tako::StreamServer::SubscriberLoop(Subscriber* subscriber)
+{
+    TakoStreamRequest request;
+    bool valid = ReadExact(subscriber->m_Pipe, &request, sizeof(request)) &&
+        request.m_Magic == TakoStreamMagic && request.m_Version == TakoStreamVersion &&
+        !request.m_Region.IsEmpty() && request.m_MaxFps > 0;
+
+    // Taking the subscribers lock first keeps the capture thread from missing the new region. After this
+    // point the thread never touches that lock again, so it can be joined while the lock is held.
+    {
+        std::lock_guard<std::mutex> lock(m_SubscribersMutex);
+        std::lock_guard<std::mutex> subscriberLock(subscriber->m_Mutex);
+        subscriber->m_Region = request.m_Region;
+        subscriber->m_MaxFps = std::min(request.m_MaxFps, MaxFps);
+        subscriber->m_Active = valid && !subscriber->m_Closed;
+        subscriber->m_Closed = !subscriber->m_Active;
+    }
+    m_SubscribersCondition.notify_all();
+
+    auto interval = std::chrono::microseconds(1000000 / std::max(1u, subscriber->m_MaxFps));
+    auto nextSend = std::chrono::steady_clock::now();
+
+    while (true)
+    {
+        std::shared_ptr<const Frame> frame;
+        std::vector<TakoRect> mergedDirtyRects;
+        bool keyframe, merged;
+        uint32_t numSkipped;
+
+        {
+            std::unique_lock<std::mutex> lock(subscriber->m_Mutex);
+            subscriber->m_Condition.wait(lock, [subscriber]() { return subscriber->m_Closed || subscriber->m_Pending != nullptr; });
+
+            // Frames arriving while we honour the requested rate replace the pending one
+            subscriber->m_Condition.wait_until(lock, nextSend, [subscriber]() { return subscriber->m_Closed; });
+
+            if (subscriber->m_Closed)
+                break;
+
+            frame = std::move(subscriber->m_Pending);
+            mergedDirtyRects = std::move(subscriber->m_MergedDirtyRects);
+            keyframe = subscriber->m_NeedsKeyframe;
+            merged = subscriber->m_Merged;
+            numSkipped = subscriber->m_NumSkipped;
+
+            subscriber->m_Pending.reset();
+            subscriber->m_MergedDirtyRects.clear();
+            subscriber->m_NeedsKeyframe = false;
+            subscriber->m_Merged = false;
+            subscriber->m_NumSkipped = 0;
+        }
+
+        nextSend = std::chrono::steady_clock::now() + interval;
+
+        if (!SendFrame(subscriber, *frame, keyframe, merged, mergedDirtyRects, numSkipped))
+            break;
+
+        m_FramesSent.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::lock_guard<std::mutex> lock(subscriber->m_Mutex);
+    subscriber->m_Closed = true;
+    subscriber->m_Pending.reset();
+}
+
+bool Tako::StreamServer::SendFrame(Subscriber* subscriber, const Frame& frame, bool keyframe, bool merged,
+    const std::vector<TakoRect>& mergedDirtyRects, uint32_t numSkipped)
+{
+    TakoRect region = subscriber->m_Region.Intersect(frame.m_Rect);
+
+    std::vector<TakoStreamMoveRect> moveRects;
+    std::vector<TakoRect> chunkRects;
+
+    if (keyframe)
+    {
+        chunkRects.push_back(region);
+    }
+    else if (merged)
+    {
+        for (const TakoRect& rect : mergedDirtyRects)
+        {
+            TakoRect clipped = rect.Intersect(region);
+            if (!clipped.IsEmpty())
+                chunkRects.push_back(clipped);
+        }
+    }
+    else
+    {
+        for (const DXGI_OUTDUPL_MOVE_RECT& move : frame.m_MoveRects)
+        {
+            TakoStreamMoveRect moveRect;
+            moveRect.m_SourceX = move.SourcePoint.x;
+            moveRect.m_SourceY = move.SourcePoint.y;
+            moveRect.m_Destination = ToTakoRect(move.DestinationRect);
+
+            TakoRect source = { moveRect.m_SourceX, moveRect.m_SourceY, moveRect.m_Destination.m_Width, moveRect.m_Destination.m_Height };
+
+            // The subscriber only has its own region, moves crossing its edge are resent as pixels
+            if (region.Intersect(source) == source && region.Intersect(moveRect.m_Destination) == moveRect.m_Destination)
+            {
+                moveRects.push_back(moveRect);
+                continue;
+            }
+
+            TakoRect clipped = moveRect.m_Destination.Intersect(region);
+            if (!clipped.IsEmpty())
+                chunkRects.push_back(clipped);
+        }
+
+        for (const RECT& rect : frame.m_DirtyRects)
+        {
+            TakoRect clipped = ToTakoRect(rect).Intersect(region);
+            if (!clipped.IsEmpty())
+                chunkRects.push_back(clipped);
+        }
+    }
+
+    // Split into chunks of at most ChunkSize bytes of pixels
+    std::vector<TakoRect> chunks;
+    for (const TakoRect& rect : chunkRects)
+    {
+        uint32_t rowsPerChunk = std::max(1u, ChunkSize / (rect.m_Width * static_cast<uint32_t>(sizeof(uint32_t))));
+        for (uint32_t y = 0; y < rect.m_Height; y += rowsPerChunk)
+            chunks.push_back({ rect.m_X, rect.m_Y + static_cast<int32_t>(y), rect.m_Width, std::min(rowsPerChunk, rect.m_Height - y) });
+    }
+
+    TakoStreamFrameHeader header = {};
+    header.m_Magic = TakoStreamMagic;
+    header.m_Version = TakoStreamVersion;
+    header.m_FrameId = frame.m_Id;
+    header.m_TimestampUs = frame.m_TimestampUs;
+    header.m_Region = region;
+    header.m_Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    header.m_Flags = static_cast<uint32_t>(keyframe ? TakoStreamFlags::KEYFRAME : TakoStreamFlags::NONE);
+    header.m_NumMoveRects = static_cast<uint32_t>(moveRects.size());
+    header.m_NumChunks = static_cast<uint32_t>(chunks.size());
+    header.m_NumSkippedFrames = numSkipped;
+
+    if (!WriteExact(subscriber->m_Pipe, &header, sizeof(header)))
+        return false;
+
+    if (!moveRects.empty() && !WriteExact(subscriber->m_Pipe, moveRects.data(), static_cast<uint32_t>(moveRects.size() * sizeof(TakoStreamMoveRect))))
+        return false;
+
+    return WriteChunks(subscriber->m_Pipe, frame, chunks);
+}
+
+bool Tako::StreamServer::WriteChunks(HANDLE pipe, const Frame& frame, const std::vector<TakoRect>& rects)
+{
+    std::vector<uint8_t> buffer;
+    TakoFrameView frameView = frame.GetView();
+
+    for (const TakoRect& rect : rects)
+    {
+        TakoFrameView chunkView;
+        if (CropFrameView(frameView, rect, &chunkView) != TakoError::OK)
+            return false;
+
+        uint32_t rowSize = rect.m_Width * sizeof(uint32_t);
+
+        TakoStreamChunk chunk = {};
+        chunk.m_Rect = rect;
+        chunk.m_Size = rowSize * rect.m_Height;
+
+        buffer.resize(sizeof(chunk) + chunk.m_Size);
+        memcpy(buffer.data(), &chunk, sizeof(chunk));
+        if (CopyFrameView(chunkView, buffer.data() + sizeof(chunk), rowSize) != TakoError::OK)
+            return false;
+
+        if (!WriteExact(pipe, buffer.data(), static_cast<uint32_t>(buffer.size())))
+            return false;
+    }
+
+    return true;
+}
+
+void Tako::StreamServer::AppendChangedRects(const Frame& frame, TakoRect region, std::vector<TakoRect>* out)
+{
+    if (frame.m_Keyframe)
+    {
+        out->push_back(region);
+        return;
+    }
+
+    auto append = [&](const RECT& rect)
+    {
+        TakoRect changed = ToTakoRect(rect).Intersect(region);
+        if (!changed.IsEmpty())
+            out->push_back(changed);
+    };
+
+    for (const DXGI_OUTDUPL_MOVE_RECT& move : frame.m_MoveRects)
+        append(move.DestinationRect);
+
+    for (const RECT& rect : frame.m_DirtyRects)
+        append(rect);
+}
+
+bool Tako::StreamServer::ReadExact(HANDLE pipe, void* data, uint32_t size)
+{
+    uint8_t* bytes = static_cast<uint8_t*>(data);
+    while (size > 0)
+    {
+        DWORD bytesRead = 0;
+        if (!ReadFile(pipe, bytes, size, &bytesRead, nullptr) || bytesRead == 0)
+            return false;
+
+        bytes += bytesRead;
+        size -= bytesRead;
+    }
+
+    return true;
+}
+
+bool Tako::StreamServer::WriteExact(HANDLE pipe, const void* data, uint32_t size)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    while (size > 0)
+    {
+        DWORD bytesWritten = 0;
+        if (!WriteFile(pipe, bytes, size, &bytesWritten, nullptr) || bytesWritten == 0)
+            return false;
+
+        bytes += bytesWritten;
+        size -= bytesWritten;
+    }
+
+    return true;
+}
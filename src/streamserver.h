@@ -0,0 +1,151 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+#include "motiondetector.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace Tako
+{
+    // Captures once and fans the result out to any number of local subscribers over a named pipe.
+    // Each subscriber picks its own region and frame rate with a TakoStreamRequest and then receives
+    // frames in the chunked format described by TakoStreamFrameHeader. Every subscriber is served by
+    // its own thread that only ever holds the newest frame, so a slow reader skips frames instead of
+    // holding back capture or the other subscribers.
+    //
+    // Frames come from a capture function called on the server's own thread, so the server itself does not
+    // depend on how the desktop is captured. Only the user running the server can open the pipe, and only locally.
+    class StreamServer
+    {
+    public:
+        // Fills target, tightly packed BGRA rows of region, with the current desktop. Returns EXPECTED_ERROR
+        // when nothing changed within a short timeout, which makes the server simply try again.
+        using CaptureFunction = std::function<TakoError(TakoRect region, const TakoFrameView& target)>;
+
+        StreamServer() = default;
+        ~StreamServer() = default;
+
+        // The first pipe instance exists when this returns, so clients can connect right away. Fails if the
+        // pipe cannot be created, including when another server already owns pipeName.
+        TakoError Initialize(const wchar_t* pipeName, CaptureFunction capture);
+        TakoError Shutdown();
+
+        void GetStats(TakoStats* outStats) const;
+
+    private:
+        static constexpr uint32_t AcquireTimeoutMs = 100;
+        static constexpr uint32_t ChunkSize = 64 * 1024;
+        static constexpr uint32_t MaxFps = 240;
+        static constexpr size_t MaxMergedDirtyRects = 256; // Beyond this a keyframe is cheaper to describe
+
+        // One composited capture, shared read-only by every subscriber that sends it
+        struct Frame
+        {
+            uint64_t m_Id;
+            uint64_t m_TimestampUs;
+            TakoRect m_Rect;
+            std::vector<uint8_t> m_Pixels; // Tightly packed BGRA rows
+            std::vector<DXGI_OUTDUPL_MOVE_RECT> m_MoveRects;
+            std::vector<RECT> m_DirtyRects;
+            bool m_Keyframe; // Not comparable with the previous frame, everything is dirty
+
+            TakoFrameView GetView() const;
+        };
+
+        struct Subscriber
+        {
+            HANDLE m_Pipe = INVALID_HANDLE_VALUE;
+            std::thread m_Thread;
+
+            std::mutex m_Mutex;
+            std::condition_variable m_Condition;
+            bool m_Active = false; // Set once the request has been received
+            bool m_Closed = false;
+            TakoRect m_Region = {};
+            uint32_t m_MaxFps = 0;
+
+            // Newest frame not yet sent. If it replaced an unsent frame the moves of both are folded into
+            // m_MergedDirtyRects, which then describes everything that changed since the last sent frame.
+            std::shared_ptr<const Frame> m_Pending;
+            std::vector<TakoRect> m_MergedDirtyRects;
+            bool m_Merged = false;
+            bool m_NeedsKeyframe = true;
+            uint32_t m_NumSkipped = 0;
+        };
+
+    private:
+        TakoError InitializeSecurity();
+        HANDLE CreatePipeInstance(DWORD flags);
+        void AcceptLoop(HANDLE pipe);
+        void CaptureLoop();
+        void SubscriberLoop(Subscriber* subscriber);
+
+        TakoError CaptureFrame(TakoRect region, std::shared_ptr<Frame>* out);
+        std::shared_ptr<Frame> GetFreeFrame();
+        void Publish(const std::shared_ptr<const Frame>& frame);
+        void CloseSubscriber(Subscriber* subscriber);
+
+        bool SendFrame(Subscriber* subscriber, const Frame& frame, bool keyframe, bool merged,
+            const std::vector<TakoRect>& mergedDirtyRects, uint32_t numSkipped);
+        bool WriteChunks(HANDLE pipe, const Frame& frame, const std::vector<TakoRect>& rects);
+
+        static void AppendChangedRects(const Frame& frame, TakoRect region, std::vector<TakoRect>* out);
+        static bool ReadExact(HANDLE pipe, void* data, uint32_t size);
+        static bool WriteExact(HANDLE pipe, const void* data, uint32_t size);
+
+    private:
+        std::wstring m_PipeName;
+        CaptureFunction m_Capture;
+
+        // Grants the user of this process, and nobody else, access to the pipe
+        std::vector<uint8_t> m_TokenUser;
+        std::vector<uint8_t> m_Acl;
+        SECURITY_DESCRIPTOR m_SecurityDescriptor;
+        SECURITY_ATTRIBUTES m_SecurityAttributes;
+
+        std::atomic<bool> m_Running = false;
+        std::atomic<bool> m_AcceptStopped = true;
+
+        std::thread m_AcceptThread;
+        std::thread m_CaptureThread;
+
+        mutable std::mutex m_SubscribersMutex;
+        std::condition_variable m_SubscribersCondition; // Wakes the capture thread when subscribers change
+        std::vector<std::unique_ptr<Subscriber>> m_Subscribers;
+
+        // Only touched by the capture thread
+        MotionDetector m_MotionDetector;
+        std::shared_ptr<Frame> m_PreviousFrame;
+        std::vector<std::shared_ptr<Frame>> m_FramePool;
+        uint64_t m_NextFrameId = 1;
+        std::chrono::steady_clock::time_point m_StartTime;
+
+        std::atomic<uint64_t> m_FramesSent = 0;
+        std::atomic<uint64_t> m_FramesSkipped = 0;
+    };
+}
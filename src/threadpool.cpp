@@ -0,0 +1,255 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "threadpool.h"
+
+Tako::TakoError Tako::ThreadPool::Initialize(uint32_t numWorkers, uint64_t affinityMask)
+{
+    if (numWorkers > MaxNumWorkers)
+        return TakoError::INVALID_ARGUMENT;
+
+    m_ShuttingDown = false;
+    m_NumQueued = 0;
+    m_StartTime = std::chrono::steady_clock::now();
+    m_AffinityMask = affinityMask;
+    m_StartAttempted = false;
+
+    // Queues exist from the start so stats can be read at any time, threads are started on demand
+    for (uint32_t i = 0; i < numWorkers; ++i)
+        m_Workers.push_back(std::make_unique<Worker>());
+
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::ThreadPool::StartWorkers()
+{
+    std::lock_guard<std::mutex> lock(m_StartMutex);
+
+    if (m_StartAttempted)
+        return m_WorkersStarted || m_Workers.empty() ? TakoError::OK : TakoError::UNEXPECTED_ERROR;
+    m_StartAttempted = true;
+
+    if (m_Workers.empty())
+        return TakoError::OK;
+
+    uint64_t remainingMask = m_AffinityMask;
+    for (uint32_t i = 0; i < m_Workers.size(); ++i)
+    {
+        m_Workers[i]->m_Thread = std::thread(&ThreadPool::WorkerLoop, this, i);
+
+        if (remainingMask == 0)
+            continue;
+
+        // Take the lowest remaining core, wrapping around when there are more workers than cores
+        uint64_t coreMask = remainingMask & (~remainingMask + 1);
+        remainingMask &= ~coreMask;
+        if (remainingMask == 0)
+            remainingMask = m_AffinityMask;
+
+        if (SetThreadAffinityMask(m_Workers[i]->m_Thread.native_handle(), static_cast<DWORD_PTR>(coreMask)) == 0)
+        {
+            // Workers started so far would be left running unpinned, nothing is queued for them yet
+            StopWorkers();
+            return TakoError::UNEXPECTED_ERROR;
+        }
+    }
+
+    m_WorkersStarted.store(true, std::memory_order_release);
+    return TakoError::OK;
+}
+
+Tako::TakoError Tako::ThreadPool::Shutdown()
+{
+    StopWorkers();
+
+    m_Workers.clear();
+    m_WorkersStarted = false;
+    return TakoError::OK;
+}
+
+void Tako::ThreadPool::StopWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_WakeMutex);
+        m_ShuttingDown = true;
+    }
+    m_WakeCondition.notify_all();
+
+    for (std::unique_ptr<Worker>& worker : m_Workers)
+    {
+        if (worker->m_Thread.joinable())
+            worker->m_Thread.join();
+    }
+}
+
+void Tako::ThreadPool::ParallelFor(uint32_t count, uint32_t grainSize, const RangeFunction& func)
+{
+    if (count == 0)
+        return;
+
+    grainSize = std::max(1u, grainSize);
+    uint32_t numTasks = (count + grainSize - 1) / grainSize;
+
+    if (numTasks > 1 && !m_WorkersStarted.load(std::memory_order_acquire))
+        StartWorkers();
+
+    if (!m_WorkersStarted.load(std::memory_order_acquire) || numTasks == 1)
+    {
+        func(0, count);
+        return;
+    }
+
+    std::atomic<uint32_t> remaining = numTasks;
+
+    // Counted before they are queued: workers that are already awake may take a chunk as soon as it is
+    // pushed, and the count must not drop below zero when they do
+    {
+        std::lock_guard<std::mutex> lock(m_WakeMutex);
+        m_NumQueued += numTasks;
+    }
+
+    // Deal chunks round-robin so every worker starts with local work, idle ones steal the rest
+    uint32_t queueIndex = m_NextQueue.fetch_add(1, std::memory_order_relaxed);
+    for (uint32_t begin = 0; begin < count; begin += grainSize)
+    {
+        Worker* worker = m_Workers[queueIndex++ % m_Workers.size()].get();
+        std::lock_guard<std::mutex> lock(worker->m_Mutex);
+        worker->m_Tasks.push_back({ &func, begin, std::min(count, begin + grainSize), &remaining });
+    }
+    m_WakeCondition.notify_all();
+
+    // The caller steals too, which also keeps nested ParallelFor calls from deadlocking. Once nothing is left
+    // to take it sleeps until the chunks still running elsewhere are done.
+    while (remaining.load(std::memory_order_acquire) > 0)
+    {
+        Task task;
+        if (TrySteal(GetNumWorkers(), &task))
+        {
+            RunTask(task, nullptr);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_DoneMutex);
+        m_DoneCondition.wait(lock, [&remaining]() { return remaining.load(std::memory_order_acquire) == 0; });
+    }
+}
+
+void Tako::ThreadPool::GetWorkerStats(TakoWorkerStats* outStats, uint32_t* outNumWorkers) const
+{
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_StartTime).count();
+
+    for (uint32_t i = 0; i < m_Workers.size(); ++i)
+    {
+        outStats[i].m_TasksExecuted = m_Workers[i]->m_TasksExecuted.load(std::memory_order_relaxed);
+        outStats[i].m_TasksStolen = m_Workers[i]->m_TasksStolen.load(std::memory_order_relaxed);
+        outStats[i].m_BusyTimeUs = m_Workers[i]->m_BusyTime.load(std::memory_order_relaxed);
+        outStats[i].m_Utilization = elapsed > 0 ? static_cast<float>(outStats[i].m_BusyTimeUs) / static_cast<float>(elapsed) : 0.0f;
+    }
+
+    *outNumWorkers = GetNumWorkers();
+}
+
+void Tako::ThreadPool::WorkerLoop(uint32_t workerIndex)
+{
+    Worker* worker = m_Workers[workerIndex].get();
+
+    while (true)
+    {
+        Task task;
+        if (TryPop(workerIndex, &task))
+        {
+            RunTask(task, worker);
+            continue;
+        }
+
+        if (TrySteal(workerIndex, &task))
+        {
+            worker->m_TasksStolen.fetch_add(1, std::memory_order_relaxed);
+            RunTask(task, worker);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_WakeMutex);
+        m_WakeCondition.wait(lock, [this]() { return m_ShuttingDown || m_NumQueued > 0; });
+
+        if (m_ShuttingDown)
+            return;
+    }
+}
+
+bool Tako::ThreadPool::TryPop(uint32_t workerIndex, Task* out)
+{
+    Worker* worker = m_Workers[workerIndex].get();
+    std::lock_guard<std::mutex> lock(worker->m_Mutex);
+
+    if (worker->m_Tasks.empty())
+        return false;
+
+    // Owners work from the back, which is the most recently queued and cache-warm chunk
+    *out = worker->m_Tasks.back();
+    worker->m_Tasks.pop_back();
+    m_NumQueued--;
+    return true;
+}
+
+bool Tako::ThreadPool::TrySteal(uint32_t thiefIndex, Task* out)
+{
+    uint32_t numWorkers = GetNumWorkers();
+
+    for (uint32_t i = 1; i <= numWorkers; ++i)
+    {
+        uint32_t victimIndex = (thiefIndex + i) % numWorkers;
+        if (victimIndex == thiefIndex)
+            continue;
+
+        Worker* victim = m_Workers[victimIndex].get();
+        std::lock_guard<std::mutex> lock(victim->m_Mutex);
+
+        if (victim->m_Tasks.empty())
+            continue;
+
+        *out = victim->m_Tasks.front();
+        victim->m_Tasks.pop_front();
+        m_NumQueued--;
+        return true;
+    }
+
+    return false;
+}
+
+void Tako::ThreadPool::RunTask(const Task& task, Worker* worker)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    (*task.m_Function)(task.m_Begin, task.m_End);
+
+    if (worker != nullptr)
+    {
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        worker->m_BusyTime.fetch_add(static_cast<uint64_t>(elapsed), std::memory_order_relaxed);
+        worker->m_TasksExecuted.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // The caller may return as soon as the count reaches zero, so the task is not touched after this
+    if (task.m_Remaining->fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        std::lock_guard<std::mutex> lock(m_DoneMutex);
+        m_DoneCondition.notify_all();
+    }
+}
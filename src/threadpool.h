@@ -0,0 +1,111 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace Tako
+{
+    // Row bands are sized so a band of the source and destination stays in a core's L2
+    static constexpr uint32_t TargetBandBytes = 256 * 1024;
+
+    inline uint32_t GetBandHeight(uint32_t rowBytes)
+    {
+        return std::max(1u, TargetBandBytes / std::max(1u, rowBytes));
+    }
+
+    class ThreadPool
+    {
+    public:
+        using RangeFunction = std::function<void(uint32_t begin, uint32_t end)>;
+
+        ThreadPool() = default;
+        ~ThreadPool() = default;
+
+        // numWorkers excludes the calling thread, which always helps out in ParallelFor. Each worker
+        // is pinned to the next set bit of affinityMask, an empty mask leaves scheduling to the OS.
+        // Worker threads are only started by StartWorkers or the first ParallelFor that can use them.
+        TakoError Initialize(uint32_t numWorkers, uint64_t affinityMask);
+        TakoError Shutdown();
+        // Starts the worker threads now, so that pinning failures are reported. Starting is only tried once
+        // per Initialize; if it fails, ParallelFor runs everything on the calling thread.
+        TakoError StartWorkers();
+
+    public:
+        // Splits [0, count) into chunks of grainSize and blocks until every chunk has run
+        void ParallelFor(uint32_t count, uint32_t grainSize, const RangeFunction& func);
+        void GetWorkerStats(TakoWorkerStats* outStats, uint32_t* outNumWorkers) const;
+        inline uint32_t GetNumWorkers() const { return static_cast<uint32_t>(m_Workers.size()); }
+
+    private:
+        struct Task
+        {
+            const RangeFunction* m_Function;
+            uint32_t m_Begin;
+            uint32_t m_End;
+            std::atomic<uint32_t>* m_Remaining;
+        };
+
+        struct Worker
+        {
+            std::mutex m_Mutex;
+            std::deque<Task> m_Tasks;
+            std::thread m_Thread;
+
+            std::atomic<uint64_t> m_BusyTime = 0; // In microseconds
+            std::atomic<uint64_t> m_TasksExecuted = 0;
+            std::atomic<uint64_t> m_TasksStolen = 0;
+        };
+
+    private:
+        void StopWorkers();
+        void WorkerLoop(uint32_t workerIndex);
+        bool TryPop(uint32_t workerIndex, Task* out);
+        bool TrySteal(uint32_t thiefIndex, Task* out);
+        void RunTask(const Task& task, Worker* worker);
+
+    private:
+        std::vector<std::unique_ptr<Worker>> m_Workers;
+        uint64_t m_AffinityMask = 0;
+
+        std::mutex m_StartMutex;
+        bool m_StartAttempted = false;
+        std::atomic<bool> m_WorkersStarted = false;
+
+        std::mutex m_WakeMutex;
+        std::condition_variable m_WakeCondition;
+        std::atomic<uint32_t> m_NumQueued = 0;
+
+        std::mutex m_DoneMutex;
+        std::condition_variable m_DoneCondition; // Wakes ParallelFor callers when their last chunk finishes
+        std::atomic<uint32_t> m_NextQueue = 0;
+        bool m_ShuttingDown = false;
+
+        std::chrono::steady_clock::time_point m_StartTime;
+    };
+}
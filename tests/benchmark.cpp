@@ -0,0 +1,209 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Times the CPU stages on synthetic frames, without capturing anything. Each stage runs with a growing number
+// of pool workers to show how it scales with the cores available.
+
+#include "frameview.h"
+#include "framediff.h"
+#include "motiondetector.h"
+#include "pixelkernels.h"
+#include "threadpool.h"
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+using namespace Tako;
+
+Tako::ThreadPool* g_ThreadPool;
+
+static constexpr uint32_t NumRuns = 15;
+// Budget for motion detection of one 4K frame on the pool, so it can run on every frame of a 60 Hz stream
+static constexpr double MotionTargetMs = 4.0;
+
+// An 8K frame of noise, so neither diffing nor hashing can finish early on uniform content
+struct Frame
+{
+    std::vector<uint32_t> m_Pixels;
+    TakoFrameView m_View;
+
+    Frame(uint32_t width, uint32_t height, uint32_t seed) : m_Pixels(static_cast<size_t>(width) * height)
+    {
+        std::mt19937 random(seed);
+        for (uint32_t& pixel : m_Pixels)
+            pixel = random() | 0xFF000000;
+
+        m_View.m_Data = reinterpret_cast<uint8_t*>(m_Pixels.data());
+        m_View.m_Pitch = width * sizeof(uint32_t);
+        m_View.m_Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+        m_View.m_Rect = { 0, 0, width, height };
+        m_View.m_Generation = seed;
+    }
+};
+
+// Median time of one run in milliseconds, after a warm-up run
+template <typename Function>
+static double Measure(const Function& function)
+{
+    function();
+
+    std::vector<double> times;
+    for (uint32_t i = 0; i < NumRuns; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        function();
+        times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+static bool ResizePool(uint32_t numWorkers)
+{
+    g_ThreadPool->Shutdown();
+    return g_ThreadPool->Initialize(numWorkers, 0) == TakoError::OK;
+}
+
+// A 4K desktop scrolling by a fixed step. Frames are views into one tall image, moving down and back up
+// so that consecutive frames always differ by exactly one step.
+struct ScrollingFrames
+{
+    static constexpr uint32_t Width = 3840;
+    static constexpr uint32_t Height = 2160;
+    static constexpr uint32_t Step = 40;
+    static constexpr uint32_t NumSteps = 16;
+
+    Frame m_Image;
+    uint32_t m_Position = 0;
+    uint64_t m_Generation = 1;
+
+    ScrollingFrames() : m_Image(Width, Height + Step * NumSteps, 2) {}
+
+    // Like a capture: every call returns a new frame, whose hashes the detector has not seen yet
+    TakoFrameView Next()
+    {
+        ++m_Position;
+        uint32_t step = m_Position % (2 * NumSteps);
+        uint32_t offset = Step * (step <= NumSteps ? step : 2 * NumSteps - step);
+
+        TakoFrameView view = m_Image.m_View;
+        view.m_Data += static_cast<size_t>(offset) * view.m_Pitch;
+        view.m_Rect.m_Height = Height;
+        view.m_Generation = ++m_Generation;
+        return view;
+    }
+};
+
+// Runs each stage with 1, 2, 4, ... threads up to the number of cores; the calling thread counts as one.
+// Returns false if a stage with a target missed it with all threads.
+static bool MeasureScaling()
+{
+    static constexpr uint32_t Width = 7680;
+    static constexpr uint32_t Height = 4320;
+
+    // Identical frames make the diff compare every pixel
+    Frame current(Width, Height, 1);
+    Frame previous(Width, Height, 1);
+    std::vector<uint32_t> converted(current.m_Pixels.size());
+    std::vector<TakoRect> dirtyRects;
+
+    ScrollingFrames scrolling;
+    TakoFrameView previousScroll = scrolling.Next();
+    MotionDetector motionDetector;
+    std::vector<DXGI_OUTDUPL_MOVE_RECT> moveRects;
+    std::vector<RECT> residualRects;
+
+    struct Stage
+    {
+        const char* m_Name;
+        std::function<void()> m_Run;
+        double m_TargetMs = 0.0;
+        double m_SingleThreadMs = 0.0;
+        double m_LastMs = 0.0;
+        uint32_t m_LastThreads = 0;
+    };
+
+    Stage stages[] =
+    {
+        { "convert 8K", [&]() { ConvertFrameView(current.m_View, DXGI_FORMAT_R8G8B8A8_UNORM, converted.data(), Width * sizeof(uint32_t)); } },
+        { "diff 8K", [&]() { dirtyRects.clear(); DiffFrameViews(current.m_View, previous.m_View, DiffTileSize, &dirtyRects); } },
+        // Hashes one new frame per run, as a stream would; the previous frame's hashes are cached
+        { "motion 4K", [&]()
+        {
+            TakoFrameView currentScroll = scrolling.Next();
+            motionDetector.Detect(currentScroll, previousScroll, &moveRects, &residualRects);
+            previousScroll = currentScroll;
+        }, MotionTargetMs },
+    };
+
+    uint32_t numCores = std::max(1u, std::thread::hardware_concurrency());
+    printf("%-16s %8s %10s %8s %10s\n", "stage", "threads", "ms", "speedup", "efficiency");
+
+    for (uint32_t numThreads = 1; numThreads <= std::min(numCores, MaxNumWorkers + 1); numThreads *= 2)
+    {
+        if (!ResizePool(numThreads - 1))
+            break;
+
+        for (Stage& stage : stages)
+        {
+            double ms = Measure(stage.m_Run);
+            if (numThreads == 1)
+                stage.m_SingleThreadMs = ms;
+
+            stage.m_LastMs = ms;
+            stage.m_LastThreads = numThreads;
+
+            double speedup = stage.m_SingleThreadMs / ms;
+            printf("%-16s %8u %10.2f %8.2f %9.0f%%\n", stage.m_Name, numThreads, ms, speedup, 100.0 * speedup / numThreads);
+        }
+    }
+
+    // A scroll that the detector misses would make the timing meaningless
+    printf("\nmotion 4K found %zu move rects and %zu dirty rects for a %u px scroll\n", moveRects.size(), residualRects.size(), ScrollingFrames::Step);
+
+    bool metTargets = !moveRects.empty();
+    for (const Stage& stage : stages)
+    {
+        if (stage.m_TargetMs <= 0.0)
+            continue;
+
+        bool met = stage.m_LastMs <= stage.m_TargetMs;
+        printf("%s: %.2f ms with %u threads, target %.2f ms: %s\n", stage.m_Name, stage.m_LastMs, stage.m_LastThreads, stage.m_TargetMs, met ? "met" : "MISSED");
+        metTargets = metTargets && met;
+    }
+
+    return metTargets;
+}
+
+int main()
+{
+    if (SelectPixelKernels(DetectCpuLevel()) != TakoError::OK)
+        return 1;
+
+    g_ThreadPool = new ThreadPool();
+    printf("cpu level %u, %u hardware threads\n\n", static_cast<uint32_t>(GetSelectedCpuLevel()), std::thread::hardware_concurrency());
+
+    bool metTargets = MeasureScaling();
+
+    g_ThreadPool->Shutdown();
+    delete g_ThreadPool;
+
+    return metTargets ? 0 : 1;
+}
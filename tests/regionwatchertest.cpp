@@ -0,0 +1,203 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Feeds synthetic frames and dirty rects straight to a RegionWatcher, so no display is needed and its watch
+// thread never starts. Checks when watches fire, that only dirty pixels are looked at, and that callbacks
+// and events see what changed.
+
+#include "regionwatcher.h"
+#include "capturemanager.h"
+#include "graphiccontext.h"
+#include "pixelkernels.h"
+#include "threadpool.h"
+#include <cstdio>
+#include <random>
+
+using namespace Tako;
+
+// The watch thread and the capture code it uses are linked in, but not used here
+Tako::GraphicContext* g_GraphicContext;
+Tako::CaptureManager* g_CaptureManager;
+Tako::ThreadPool* g_ThreadPool;
+std::mutex g_CaptureMutex;
+
+// A desktop of noise whose left display starts left of the primary one, so views do not begin at the origin
+class SyntheticDesktop
+{
+public:
+    static constexpr TakoRect Rect = { -128, 0, 640, 256 };
+
+    SyntheticDesktop() : m_Pixels(static_cast<size_t>(Rect.m_Width) * Rect.m_Height), m_Random(1)
+    {
+        for (uint32_t& pixel : m_Pixels)
+            pixel = m_Random() | 0xFF000000;
+    }
+
+    // Gives every pixel of rect a new value
+    void Paint(TakoRect rect)
+    {
+        for (int32_t y = rect.m_Y; y < rect.m_Y + static_cast<int32_t>(rect.m_Height); ++y)
+        {
+            for (int32_t x = rect.m_X; x < rect.m_X + static_cast<int32_t>(rect.m_Width); ++x)
+                At(x, y) ^= (m_Random() | 1) & 0x00FFFFFF;
+        }
+    }
+
+    uint32_t& At(int32_t x, int32_t y)
+    {
+        return m_Pixels[static_cast<size_t>(y - Rect.m_Y) * Rect.m_Width + (x - Rect.m_X)];
+    }
+
+    TakoFrameView GetView()
+    {
+        return { reinterpret_cast<uint8_t*>(m_Pixels.data()), Rect.m_Width * static_cast<uint32_t>(sizeof(uint32_t)),
+            DXGI_FORMAT_B8G8R8A8_UNORM, Rect, ++m_Generation };
+    }
+
+    std::vector<uint32_t> m_Pixels;
+
+private:
+    std::mt19937 m_Random;
+    uint64_t m_Generation = 0;
+};
+
+struct Subscriber
+{
+    uint32_t m_WatchId = 0;
+    uint32_t m_NumCalls = 0;
+    float m_LastFraction = 0.0f;
+    RegionWatcher* m_Watcher = nullptr;
+    bool m_RemoveOnCall = false;
+};
+
+static void OnChange(uint32_t watchId, float changedFraction, void* userData)
+{
+    Subscriber* subscriber = static_cast<Subscriber*>(userData);
+    subscriber->m_NumCalls += subscriber->m_WatchId == watchId;
+    subscriber->m_LastFraction = changedFraction;
+
+    // Callbacks may remove watches, including their own
+    if (subscriber->m_RemoveOnCall)
+        subscriber->m_Watcher->RemoveWatch(watchId);
+}
+
+static bool g_Passed = true;
+
+static void Check(const char* name, bool condition)
+{
+    printf("%-56s %s\n", name, condition ? "ok" : "FAILED");
+    g_Passed = g_Passed && condition;
+}
+
+int main()
+{
+    if (SelectPixelKernels(DetectCpuLevel()) != TakoError::OK)
+        return 1;
+
+    SyntheticDesktop desktop;
+    RegionWatcher watcher;
+
+    uint32_t invalidId;
+    Check("empty rects and thresholds of 1 are rejected",
+        watcher.AddWatch({ 0, 0, 0, 16 }, 0.5f, nullptr, nullptr, nullptr, &invalidId) == TakoError::INVALID_ARGUMENT &&
+        watcher.AddWatch({ 0, 0, 16, 16 }, 1.0f, nullptr, nullptr, nullptr, &invalidId) == TakoError::INVALID_ARGUMENT);
+
+    // small is 64x64 on the left display; wide spans both displays and several grid cells
+    static constexpr TakoRect SmallRect = { -96, 32, 64, 64 };
+    static constexpr TakoRect WideRect = { 32, 16, 400, 200 };
+    static constexpr TakoRect PixelRect = { 250, 100, 1, 1 };
+
+    Subscriber small, wide, pixel;
+    HANDLE wideEvent = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+    pixel.m_Watcher = &watcher;
+    pixel.m_RemoveOnCall = true;
+
+    bool added = watcher.AddWatch(SmallRect, 0.25f, OnChange, &small, nullptr, &small.m_WatchId) == TakoError::OK;
+    added = added && watcher.AddWatch(WideRect, 0.1f, OnChange, &wide, wideEvent, &wide.m_WatchId) == TakoError::OK;
+    added = added && watcher.AddWatch(PixelRect, 0.0f, OnChange, &pixel, nullptr, &pixel.m_WatchId) == TakoError::OK;
+    Check("watches added", added);
+
+    // The first frame only records the content
+    watcher.OnFrame(desktop.GetView(), &SyntheticDesktop::Rect, 1);
+    Check("first frame fires nothing", small.m_NumCalls == 0 && wide.m_NumCalls == 0 && pixel.m_NumCalls == 0);
+
+    // A quarter of small changes, which is not more than its threshold
+    TakoRect quarter = { -96, 32, 32, 32 };
+    desktop.Paint(quarter);
+    watcher.OnFrame(desktop.GetView(), &quarter, 1);
+    Check("change at the threshold does not fire", small.m_NumCalls == 0);
+
+    // One more pixel crosses it
+    TakoRect extra = { -64, 32, 1, 1 };
+    desktop.Paint(extra);
+    watcher.OnFrame(desktop.GetView(), &extra, 1);
+    Check("change past the threshold fires once", small.m_NumCalls == 1 && small.m_LastFraction == 1025.0f / 4096.0f);
+
+    // Changes are then measured against the content the subscriber was told about
+    watcher.OnFrame(desktop.GetView(), &SmallRect, 1);
+    Check("unchanged content after firing does not fire again", small.m_NumCalls == 1);
+
+    // Pixels outside the dirty rects are not looked at, even when they changed
+    TakoRect block = { 200, 40, 100, 100 };
+    desktop.Paint(block);
+    watcher.OnFrame(desktop.GetView(), nullptr, 0);
+    Check("changes without dirty rects are not seen", wide.m_NumCalls == 0);
+
+    // Reporting them later catches up, and a watch spanning several cells is counted once
+    watcher.OnFrame(desktop.GetView(), &block, 1);
+    Check("late dirty rect fires the wide watch once", wide.m_NumCalls == 1 && WaitForSingleObject(wideEvent, 0) == WAIT_OBJECT_0);
+
+    // The pixel watch sits inside block, fires on any change and removes itself from its callback
+    Check("callback removed its own watch", pixel.m_NumCalls == 1 &&
+        watcher.RemoveWatch(pixel.m_WatchId) == TakoError::INVALID_ARGUMENT);
+
+    // Changes that are undone no longer count: the wide watch sees two changes of 5000 pixels each, but never
+    // more than one at a time, which stays below its 8000 pixel threshold
+    TakoRect first = { 40, 20, 100, 50 };
+    TakoRect second = { 40, 120, 100, 50 };
+    std::vector<uint32_t> saved = desktop.m_Pixels;
+    desktop.Paint(first);
+    watcher.OnFrame(desktop.GetView(), &first, 1);
+    desktop.m_Pixels = saved;
+    desktop.Paint(second);
+    TakoRect both[] = { first, second };
+    watcher.OnFrame(desktop.GetView(), both, 2);
+    Check("reverted changes are not counted", wide.m_NumCalls == 1 && WaitForSingleObject(wideEvent, 0) == WAIT_TIMEOUT);
+
+    // Overlapping dirty rects must not count the same pixels twice: 2000 more pixels stay below the threshold,
+    // 4000 would not
+    TakoRect third = { 200, 150, 50, 40 };
+    desktop.Paint(third);
+    TakoRect overlapping[] = { third, third, { 150, 140, 200, 60 } };
+    watcher.OnFrame(desktop.GetView(), overlapping, 3);
+    Check("overlapping dirty rects are counted once", wide.m_NumCalls == 1);
+
+    // Removed watches stay silent
+    Check("remove", watcher.RemoveWatch(small.m_WatchId) == TakoError::OK);
+    desktop.Paint(SmallRect);
+    watcher.OnFrame(desktop.GetView(), &SmallRect, 1);
+    Check("removed watch does not fire", small.m_NumCalls == 1);
+
+    watcher.Shutdown();
+    CloseHandle(wideEvent);
+
+    printf("%s\n", g_Passed ? "PASSED" : "FAILED");
+
+    return g_Passed ? 0 : 1;
+}
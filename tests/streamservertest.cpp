@@ -0,0 +1,339 @@
+/*
+    This file is part of Tako, an open-source display capture library.
+
+    Copyright (c) 2020-2023 Samuel Huang - All rights reserved.
+
+    Tako is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANT without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Drives a stream server over a local pipe with a synthetic desktop, so no display is needed. A fast and a
+// slow subscriber read the same changing desktop. Both must rebuild every frame they receive exactly, and the
+// slow one must have frames folded together for it instead of holding back capture or the fast one.
+
+#include "streamserver.h"
+#include "pixelkernels.h"
+#include "threadpool.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+using namespace Tako;
+
+Tako::ThreadPool* g_ThreadPool;
+
+static constexpr wchar_t PipeName[] = L"\\\\.\\pipe\\tako_streamservertest";
+static constexpr uint32_t DesktopWidth = 512;
+static constexpr uint32_t DesktopHeight = 384;
+static constexpr uint32_t NumFrames = 200;
+static constexpr uint32_t SlowReadDelayMs = 40;
+static constexpr auto Deadline = std::chrono::seconds(30);
+
+// A document that scrolls every capture, aligned with the motion detector's strips, and a few noisy tiles
+// painted anywhere. Frames carry both moves and scattered changes, and enough changed pixels to fill the pipe
+// of a subscriber that does not keep up. Every frame is kept to check against.
+class SyntheticDesktop
+{
+public:
+    SyntheticDesktop() : m_Random(1), m_Pixels(static_cast<size_t>(DesktopWidth) * DesktopHeight)
+    {
+        for (uint32_t& pixel : m_Pixels)
+            pixel = m_Random() | 0xFF000000;
+    }
+
+    TakoError Capture(TakoRect region, const TakoFrameView& target)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        // Afterwards the screen is static, like a real capture timing out
+        if (m_Frames.size() == NumFrames)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            return TakoError::EXPECTED_ERROR;
+        }
+
+        static constexpr TakoRect Document = { 128, 64, 256, 256 };
+        static constexpr uint32_t ScrollRows = 8;
+        static constexpr uint32_t TileSize = 32;
+
+        for (uint32_t y = 0; y < Document.m_Height; ++y)
+        {
+            uint32_t* row = &m_Pixels[static_cast<size_t>(Document.m_Y + y) * DesktopWidth + Document.m_X];
+            if (y + ScrollRows < Document.m_Height)
+                memcpy(row, row + ScrollRows * DesktopWidth, Document.m_Width * sizeof(uint32_t));
+            else
+                std::generate(row, row + Document.m_Width, [this]() { return m_Random() | 0xFF000000; });
+        }
+
+        for (uint32_t tile = 0; tile < 4; ++tile)
+        {
+            uint32_t tileX = m_Random() % (DesktopWidth - TileSize);
+            uint32_t tileY = m_Random() % (DesktopHeight - TileSize);
+            for (uint32_t y = 0; y < TileSize; ++y)
+            {
+                for (uint32_t x = 0; x < TileSize; ++x)
+                    m_Pixels[static_cast<size_t>(tileY + y) * DesktopWidth + tileX + x] = m_Random() | 0xFF000000;
+            }
+        }
+
+        m_Frames.push_back(m_Pixels);
+
+        for (uint32_t y = 0; y < region.m_Height; ++y)
+        {
+            memcpy(target.m_Data + static_cast<size_t>(y) * target.m_Pitch,
+                &m_Pixels[static_cast<size_t>(region.m_Y + y) * DesktopWidth + region.m_X], region.m_Width * sizeof(uint32_t));
+        }
+
+        return TakoError::OK;
+    }
+
+    // The server numbers captured frames from 1
+    bool Matches(uint64_t frameId, TakoRect region, const std::vector<uint32_t>& image)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+
+        if (frameId == 0 || frameId > m_Frames.size())
+            return false;
+
+        const std::vector<uint32_t>& frame = m_Frames[frameId - 1];
+        for (uint32_t y = 0; y < region.m_Height; ++y)
+        {
+            if (memcmp(&image[static_cast<size_t>(y) * region.m_Width], &frame[static_cast<size_t>(region.m_Y + y) * DesktopWidth + region.m_X],
+                region.m_Width * sizeof(uint32_t)) != 0)
+                return false;
+        }
+
+        return true;
+    }
+
+private:
+    std::mutex m_Mutex;
+    std::mt19937 m_Random;
+    std::vector<uint32_t> m_Pixels;
+    std::vector<std::vector<uint32_t>> m_Frames;
+};
+
+static SyntheticDesktop g_Desktop;
+
+// The server has one instance waiting at a time, clients arriving together wait for the next one
+static HANDLE Connect(bool retry)
+{
+    while (true)
+    {
+        HANDLE pipe = CreateFileW(PipeName, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+        if (pipe != INVALID_HANDLE_VALUE || !retry || GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeW(PipeName, 1000))
+            return pipe;
+    }
+}
+
+static bool ReadExact(HANDLE pipe, void* data, uint32_t size)
+{
+    uint8_t* bytes = static_cast<uint8_t*>(data);
+    while (size > 0)
+    {
+        DWORD read;
+        if (!ReadFile(pipe, bytes, size, &read, nullptr) || read == 0)
+            return false;
+
+        bytes += read;
+        size -= read;
+    }
+
+    return true;
+}
+
+// Reads one frame and applies it to image, which holds the region as tightly packed rows
+static bool ReadFrame(HANDLE pipe, TakoRect region, std::vector<uint32_t>* image, TakoStreamFrameHeader* outHeader)
+{
+    TakoStreamFrameHeader& header = *outHeader;
+    if (!ReadExact(pipe, &header, sizeof(header)) || header.m_Magic != TakoStreamMagic || header.m_Version != TakoStreamVersion ||
+        !(header.m_Region == region) || header.m_Format != DXGI_FORMAT_B8G8R8A8_UNORM)
+        return false;
+
+    std::vector<TakoStreamMoveRect> moveRects(header.m_NumMoveRects);
+    if (!moveRects.empty() && !ReadExact(pipe, moveRects.data(), static_cast<uint32_t>(moveRects.size() * sizeof(TakoStreamMoveRect))))
+        return false;
+
+    // Moves read from the previous frame, not from the result of earlier moves
+    std::vector<uint32_t> previous = *image;
+    for (const TakoStreamMoveRect& move : moveRects)
+    {
+        const TakoRect& destination = move.m_Destination;
+        TakoRect source = { move.m_SourceX, move.m_SourceY, destination.m_Width, destination.m_Height };
+        if (!(region.Intersect(source) == source) || !(region.Intersect(destination) == destination))
+            return false;
+
+        for (uint32_t y = 0; y < destination.m_Height; ++y)
+        {
+            memcpy(&(*image)[static_cast<size_t>(destination.m_Y - region.m_Y + y) * region.m_Width + (destination.m_X - region.m_X)],
+                &previous[static_cast<size_t>(source.m_Y - region.m_Y + y) * region.m_Width + (source.m_X - region.m_X)],
+                destination.m_Width * sizeof(uint32_t));
+        }
+    }
+
+    std::vector<uint32_t> rows;
+    for (uint32_t i = 0; i < header.m_NumChunks; ++i)
+    {
+        TakoStreamChunk chunk;
+        if (!ReadExact(pipe, &chunk, sizeof(chunk)) || !(region.Intersect(chunk.m_Rect) == chunk.m_Rect) ||
+            chunk.m_Size != chunk.m_Rect.m_Width * chunk.m_Rect.m_Height * sizeof(uint32_t))
+            return false;
+
+        rows.resize(chunk.m_Size / sizeof(uint32_t));
+        if (!ReadExact(pipe, rows.data(), chunk.m_Size))
+            return false;
+
+        for (uint32_t y = 0; y < chunk.m_Rect.m_Height; ++y)
+        {
+            memcpy(&(*image)[static_cast<size_t>(chunk.m_Rect.m_Y - region.m_Y + y) * region.m_Width + (chunk.m_Rect.m_X - region.m_X)],
+                &rows[static_cast<size_t>(y) * chunk.m_Rect.m_Width], chunk.m_Rect.m_Width * sizeof(uint32_t));
+        }
+    }
+
+    return true;
+}
+
+struct Reader
+{
+    const char* m_Name;
+    TakoRect m_Region;
+    uint32_t m_ReadDelayMs;
+
+    HANDLE m_Pipe = INVALID_HANDLE_VALUE;
+    bool m_Passed = false;
+    uint32_t m_NumFrames = 0;
+    uint32_t m_NumMismatches = 0;
+    uint64_t m_NumSkipped = 0;
+};
+
+// Reads until the last frame the desktop produces has arrived, checking every frame along the way
+static void ReadLoop(Reader* reader)
+{
+    TakoStreamRequest request = { TakoStreamMagic, TakoStreamVersion, reader->m_Region, 240, 0 };
+    DWORD written;
+    if (!WriteFile(reader->m_Pipe, &request, sizeof(request), &written, nullptr) || written != sizeof(request))
+        return;
+
+    std::vector<uint32_t> image(static_cast<size_t>(reader->m_Region.m_Width) * reader->m_Region.m_Height);
+    TakoStreamFrameHeader header = {};
+
+    while (header.m_FrameId < NumFrames)
+    {
+        if (!ReadFrame(reader->m_Pipe, reader->m_Region, &image, &header))
+            return;
+
+        // Nothing before the first frame can be built upon
+        bool keyframe = (header.m_Flags & static_cast<uint32_t>(TakoStreamFlags::KEYFRAME)) != 0;
+        if (reader->m_NumFrames == 0 && !keyframe)
+            return;
+
+        reader->m_NumFrames++;
+        reader->m_NumSkipped += header.m_NumSkippedFrames;
+        reader->m_NumMismatches += !g_Desktop.Matches(header.m_FrameId, reader->m_Region, image);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(reader->m_ReadDelayMs));
+    }
+
+    reader->m_Passed = reader->m_NumMismatches == 0;
+}
+
+int main()
+{
+    if (SelectPixelKernels(DetectCpuLevel()) != TakoError::OK)
+        return 1;
+
+    g_ThreadPool = new ThreadPool();
+    if (g_ThreadPool->Initialize(std::min(std::max(1u, std::thread::hardware_concurrency()) - 1, MaxNumWorkers), 0) != TakoError::OK)
+        return 1;
+
+    auto capture = [](TakoRect region, const TakoFrameView& target) { return g_Desktop.Capture(region, target); };
+
+    StreamServer server;
+    bool passed = server.Initialize(PipeName, capture) == TakoError::OK;
+
+    // The pipe is owned by the first server, a second one must be turned away
+    StreamServer duplicate;
+    bool duplicateRejected = duplicate.Initialize(PipeName, capture) != TakoError::OK;
+    printf("second server on the same pipe %s\n", duplicateRejected ? "rejected" : "accepted");
+    passed = passed && duplicateRejected;
+
+    Reader readers[] =
+    {
+        { "fast", { 0, 0, DesktopWidth, DesktopHeight }, 0 },
+        { "slow", { 64, 32, 384, 320 }, SlowReadDelayMs },
+    };
+
+    // The first client must get in as soon as Initialize returned, without retrying
+    for (Reader& reader : readers)
+    {
+        if (passed)
+            reader.m_Pipe = Connect(&reader != &readers[0]);
+
+        passed = passed && reader.m_Pipe != INVALID_HANDLE_VALUE;
+    }
+    printf("readers %s\n", passed ? "connected" : "failed to connect");
+
+    std::vector<std::thread> readThreads;
+    for (Reader& reader : readers)
+    {
+        if (reader.m_Pipe != INVALID_HANDLE_VALUE)
+            readThreads.emplace_back(ReadLoop, &reader);
+    }
+
+    // A server that stops sending would leave the readers blocked for good
+    std::atomic<bool> finished = false;
+    std::thread watchdog([&finished]()
+    {
+        auto start = std::chrono::steady_clock::now();
+        while (!finished && std::chrono::steady_clock::now() - start < Deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        if (!finished)
+        {
+            printf("timed out\nFAILED\n");
+            std::_Exit(1);
+        }
+    });
+
+    for (std::thread& thread : readThreads)
+        thread.join();
+
+    finished = true;
+    watchdog.join();
+
+    TakoStats stats = {};
+    server.GetStats(&stats);
+    server.Shutdown();
+
+    for (Reader& reader : readers)
+    {
+        printf("%s: frames %u, skipped %llu, mismatches %u, %s\n", reader.m_Name, reader.m_NumFrames,
+            static_cast<unsigned long long>(reader.m_NumSkipped), reader.m_NumMismatches, reader.m_Passed ? "complete" : "incomplete");
+        passed = passed && reader.m_Passed;
+
+        if (reader.m_Pipe != INVALID_HANDLE_VALUE)
+            CloseHandle(reader.m_Pipe);
+    }
+    printf("server: sent %llu, skipped %llu\n", static_cast<unsigned long long>(stats.m_StreamFramesSent),
+        static_cast<unsigned long long>(stats.m_StreamFramesSkipped));
+
+    // The slow reader must have been skipped, while the fast one kept receiving frames at the capture rate
+    passed = passed && readers[1].m_NumSkipped > 0 && stats.m_StreamFramesSkipped > 0 && readers[0].m_NumFrames > 2 * readers[1].m_NumFrames;
+    printf("%s\n", passed ? "PASSED" : "FAILED");
+
+    g_ThreadPool->Shutdown();
+    delete g_ThreadPool;
+
+    return passed ? 0 : 1;
+}